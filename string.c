@@ -1,27 +1,321 @@
 #include "string.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STRING_X86 1
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define STRING_URING 1
+#endif
+#endif
+
+/*
+Optional block pool.
+
+Blocks are cached per thread in power-of-two size classes (header included),
+which lines up with the capacity doubling done by string_append. Each thread
+keeps at most STRING_POOL_CACHE_BLOCKS blocks per class; when a class
+overflows, half of it is handed to a shared, mutex-protected depot so that
+blocks freed on one thread can be reused by another. Everything beyond the
+depot limit goes back to free().
+*/
+#define STRING_POOL_MIN_SHIFT 5   // 32 bytes
+#define STRING_POOL_MAX_SHIFT 16  // 64 KiB
+#define STRING_POOL_CLASSES (STRING_POOL_MAX_SHIFT - STRING_POOL_MIN_SHIFT + 1)
+#define STRING_POOL_CACHE_BLOCKS 64
+#define STRING_POOL_DEPOT_BLOCKS 1024
+
+typedef struct pool_block {
+  struct pool_block *next;
+} pool_block;
+
+typedef struct pool_list {
+  pool_block *head;
+  size_t count;
+} pool_list;
+
+static atomic_bool pool_enabled = false;
+
+static _Thread_local pool_list pool_cache[STRING_POOL_CLASSES];
+static _Thread_local bool pool_cache_registered = false;
+static _Thread_local bool pool_cache_dead = false;
+
+static pool_list pool_depot[STRING_POOL_CLASSES];
+static pthread_mutex_t pool_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t pool_thread_key;
+static pthread_once_t pool_thread_once = PTHREAD_ONCE_INIT;
+
+// Returns the size class for a block of the given total size, or -1 if the
+// block is too large to be pooled.
+static int pool_class(size_t block_size) {
+  if (block_size > ((size_t)1 << STRING_POOL_MAX_SHIFT)) {
+    return -1;
+  }
+
+  int shift = STRING_POOL_MIN_SHIFT;
+  while (((size_t)1 << shift) < block_size) {
+    shift++;
+  }
+  return shift - STRING_POOL_MIN_SHIFT;
+}
+
+static size_t pool_class_size(int cls) {
+  return (size_t)1 << (cls + STRING_POOL_MIN_SHIFT);
+}
+
+static void pool_list_release(pool_list *list) {
+  pool_block *block = list->head;
+  while (block) {
+    pool_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  list->head = NULL;
+  list->count = 0;
+}
+
+// Move up to count blocks from src to dst.
+static void pool_list_move(pool_list *dst, pool_list *src, size_t count) {
+  while (count-- > 0 && src->head) {
+    pool_block *block = src->head;
+    src->head = block->next;
+    src->count--;
+
+    block->next = dst->head;
+    dst->head = block;
+    dst->count++;
+  }
+}
+
+// Hand the thread cache over to the depot when the thread exits. Strings
+// freed by later TLS destructors on this thread go straight to the depot.
+static void pool_thread_exit(void *arg) {
+  (void)arg;
+  pool_cache_dead = true;
+  pthread_mutex_lock(&pool_depot_lock);
+  for (int cls = 0; cls < STRING_POOL_CLASSES; cls++) {
+    pool_list *depot = &pool_depot[cls];
+    size_t room = STRING_POOL_DEPOT_BLOCKS - depot->count;
+    pool_list_move(depot, &pool_cache[cls], room);
+  }
+  pthread_mutex_unlock(&pool_depot_lock);
+
+  for (int cls = 0; cls < STRING_POOL_CLASSES; cls++) {
+    pool_list_release(&pool_cache[cls]);
+  }
+}
+
+static void pool_thread_key_init(void) {
+  pthread_key_create(&pool_thread_key, pool_thread_exit);
+}
+
+static void pool_cache_register(void) {
+  if (!pool_cache_registered) {
+    pthread_once(&pool_thread_once, pool_thread_key_init);
+    // Any non-NULL value makes pthreads run the destructor at thread exit.
+    pthread_setspecific(pool_thread_key, pool_cache);
+    pool_cache_registered = true;
+  }
+}
+
+static void *pool_get(int cls) {
+  if (pool_cache_dead) {
+    pthread_mutex_lock(&pool_depot_lock);
+    pool_list *depot = &pool_depot[cls];
+    pool_block *block = depot->head;
+    if (block) {
+      depot->head = block->next;
+      depot->count--;
+    }
+    pthread_mutex_unlock(&pool_depot_lock);
+    return block ? block : malloc(pool_class_size(cls));
+  }
+  pool_cache_register();
+
+  pool_list *cache = &pool_cache[cls];
+
+  if (cache->head == NULL) {
+    pthread_mutex_lock(&pool_depot_lock);
+    pool_list_move(cache, &pool_depot[cls], STRING_POOL_CACHE_BLOCKS / 2);
+    pthread_mutex_unlock(&pool_depot_lock);
+  }
+
+  pool_block *block = cache->head;
+  if (block) {
+    cache->head = block->next;
+    cache->count--;
+    return block;
+  }
+  return malloc(pool_class_size(cls));
+}
+
+static void pool_put(int cls, void *ptr) {
+  if (pool_cache_dead) {
+    pool_list single = {ptr, 1};
+    ((pool_block *)ptr)->next = NULL;
+    pthread_mutex_lock(&pool_depot_lock);
+    pool_list *depot = &pool_depot[cls];
+    pool_list_move(depot, &single, STRING_POOL_DEPOT_BLOCKS - depot->count);
+    pthread_mutex_unlock(&pool_depot_lock);
+    pool_list_release(&single);
+    return;
+  }
+  pool_cache_register();
+
+  pool_list *cache = &pool_cache[cls];
+  if (cache->count >= STRING_POOL_CACHE_BLOCKS) {
+    pool_list spill = {NULL, 0};
+    pool_list_move(&spill, cache, STRING_POOL_CACHE_BLOCKS / 2);
+
+    pthread_mutex_lock(&pool_depot_lock);
+    pool_list *depot = &pool_depot[cls];
+    pool_list_move(depot, &spill, STRING_POOL_DEPOT_BLOCKS - depot->count);
+    pthread_mutex_unlock(&pool_depot_lock);
+
+    pool_list_release(&spill);
+  }
+
+  pool_block *block = ptr;
+  block->next = cache->head;
+  cache->head = block;
+  cache->count++;
+}
+
+static string *string_block_init(string *str) {
+  if (str) {
+    atomic_init(&str->refcount, 1);
+  }
+  return str;
+}
+
+// Allocate a string block able to hold capacity bytes of data.
+// The capacity field is set to the usable size of the block.
+static string *string_block_alloc(size_t capacity) {
+  string *str;
+
+  if (atomic_load_explicit(&pool_enabled, memory_order_relaxed)) {
+    int cls = pool_class(sizeof(string) + capacity);
+    if (cls >= 0) {
+      str = pool_get(cls);
+      if (str) {
+        str->capacity = pool_class_size(cls) - sizeof(string);
+      }
+      return string_block_init(str);
+    }
+  }
+
+  str = malloc(sizeof(string) + capacity);
+  if (str) {
+    str->capacity = capacity;
+  }
+  return string_block_init(str);
+}
+
+static void string_block_free(string *str) {
+  if (atomic_load_explicit(&pool_enabled, memory_order_relaxed)) {
+    size_t block_size = sizeof(string) + str->capacity;
+    int cls = pool_class(block_size);
+
+    // Only blocks that fill their class exactly can be handed out again.
+    if (cls >= 0 && pool_class_size(cls) == block_size) {
+      pool_put(cls, str);
+      return;
+    }
+  }
+  free(str);
+}
+
+void string_pool_enable(bool enable) {
+  atomic_store(&pool_enabled, enable);
+}
+
+bool string_pool_enabled(void) { return atomic_load(&pool_enabled); }
+
+void string_pool_trim(void) {
+  for (int cls = 0; cls < STRING_POOL_CLASSES; cls++) {
+    pool_list_release(&pool_cache[cls]);
+  }
+
+  pthread_mutex_lock(&pool_depot_lock);
+  for (int cls = 0; cls < STRING_POOL_CLASSES; cls++) {
+    pool_list_release(&pool_depot[cls]);
+  }
+  pthread_mutex_unlock(&pool_depot_lock);
+}
 
 string *string_alloc(const char *initial_data) {
-  size_t length = strlen(initial_data);
+  return string_alloc_n(initial_data, strlen(initial_data));
+}
 
-  string *str = malloc(sizeof(string) + length + 1);
+string *string_alloc_n(const char *data, size_t length) {
+  string *str = string_block_alloc(length + 1);
   if (str) {
     str->length = length;
-    str->capacity = length + 1;
-    strcpy(str->data, initial_data);
+    memcpy(str->data, data, length);
+    str->data[length] = '\0';
   }
   return str;
 }
 
 void string_resize(string **str, size_t new_capacity) {
+  if (string_is_shared(*str)) {
+    // Detach into a private block large enough for the request.
+    size_t capacity = (*str)->capacity;
+    if (new_capacity > capacity) {
+      capacity = new_capacity;
+    }
+
+    string *copy = string_block_alloc(capacity);
+    if (copy == NULL) {
+      printf("string_resize(): unable to allocate memory of capacity: %zu\n",
+             capacity);
+      exit(EXIT_FAILURE);
+    }
+    copy->length = (*str)->length;
+    memcpy(copy->data, (*str)->data, (*str)->length + 1);
+
+    string_destroy(*str);
+    *str = copy;
+    return;
+  }
+
   if (new_capacity <= (*str)->capacity) {
     return;
   }
 
-  string *new_str = realloc(*str, sizeof(string) + new_capacity);
+  string *new_str;
+  if (atomic_load_explicit(&pool_enabled, memory_order_relaxed) &&
+      pool_class(sizeof(string) + new_capacity) >= 0) {
+    new_str = string_block_alloc(new_capacity);
+    if (new_str) {
+      new_str->length = (*str)->length;
+      memcpy(new_str->data, (*str)->data, (*str)->length + 1);
+      string_block_free(*str);
+    }
+  } else {
+    new_str = realloc(*str, sizeof(string) + new_capacity);
+    if (new_str) {
+      new_str->capacity = new_capacity;
+    }
+  }
+
   if (new_str) {
-    new_str->capacity = new_capacity;
     *str = new_str;
   } else {
     printf("string_resize(): realloc: unable to allocate memory of capacity: "
@@ -31,12 +325,37 @@ void string_resize(string **str, size_t new_capacity) {
   }
 }
 
-void string_destroy(string *str) { free(str); }
+void string_destroy(string *str) {
+  if (atomic_load_explicit(&str->refcount, memory_order_relaxed) == 0) {
+    return; // static string, never freed
+  }
+  if (atomic_fetch_sub_explicit(&str->refcount, 1, memory_order_acq_rel) == 1) {
+    string_block_free(str);
+  }
+}
+
+string *string_share(const string *str) {
+  string *shared = (string *)str;
+  if (atomic_load_explicit(&shared->refcount, memory_order_relaxed) != 0) {
+    atomic_fetch_add_explicit(&shared->refcount, 1, memory_order_relaxed);
+  }
+  return shared;
+}
 
-void string_append(string **str, const char *append_str) {
-  size_t append_len = strlen(append_str);
-  size_t new_len = (*str)->length + append_len;
+bool string_is_shared(const string *str) {
+  return atomic_load_explicit(&((string *)str)->refcount,
+                              memory_order_acquire) != 1;
+}
+
+void string_unshare(string **str) {
+  if (string_is_shared(*str)) {
+    string_resize(str, (*str)->capacity);
+  }
+}
 
+// Grow the capacity geometrically so that new_len bytes and the terminating
+// null byte fit in the string.
+static void string_grow(string **str, size_t new_len) {
   if (new_len + 1 > (*str)->capacity) {
     size_t new_capacity = (*str)->capacity * 2;
     while (new_capacity < new_len + 1) {
@@ -45,15 +364,38 @@ void string_append(string **str, const char *append_str) {
 
     string_resize(str, new_capacity);
   }
+}
+
+void string_append(string **str, const char *append_str) {
+  string_append_n(str, append_str, strlen(append_str));
+}
+
+void string_append_n(string **str, const char *append_str, size_t append_len) {
+  string_unshare(str);
+
+  size_t new_len = (*str)->length + append_len;
+  string_grow(str, new_len);
 
   memcpy((*str)->data + (*str)->length, append_str, append_len);
   (*str)->length = new_len;
   (*str)->data[new_len] = '\0';
 }
 
-void string_clear(string *str) {
-  str->length = 0;
-  str->data[0] = '\0';
+void string_append_str(string **str, const string *append_str) {
+  if (append_str == *str) {
+    // Keep the source alive in case appending reallocates it.
+    string *source = string_share(append_str);
+    string_append_n(str, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_append_n(str, append_str->data, append_str->length);
+}
+
+void string_clear(string **str) {
+  string_unshare(str);
+  (*str)->length = 0;
+  (*str)->data[0] = '\0';
 }
 
 char string_get_char(const string *str, size_t index) {
@@ -63,33 +405,69 @@ char string_get_char(const string *str, size_t index) {
   return '\0'; // Invalid index
 }
 
+// Binary-safe substring search.
+static const char *string_memmem(const char *haystack, size_t haystack_len,
+                                 const char *needle, size_t needle_len) {
+  if (needle_len == 0) {
+    return haystack;
+  }
+  if (needle_len > haystack_len) {
+    return NULL;
+  }
+
+  const char *end = haystack + haystack_len - needle_len + 1;
+  const char *pos = haystack;
+  while ((pos = memchr(pos, needle[0], end - pos)) != NULL) {
+    if (memcmp(pos + 1, needle + 1, needle_len - 1) == 0) {
+      return pos;
+    }
+    pos++;
+  }
+  return NULL;
+}
+
 ssize_t string_find(const string *str, const char *sub_str) {
-  char *pos = strstr(str->data, sub_str);
+  return string_find_n(str, sub_str, strlen(sub_str));
+}
+
+ssize_t string_find_n(const string *str, const char *sub_str, size_t sub_len) {
+  const char *pos = string_memmem(str->data, str->length, sub_str, sub_len);
   if (pos) {
     return pos - str->data;
   }
   return -1; // Substring not found
 }
 
+ssize_t string_find_str(const string *str, const string *sub_str) {
+  return string_find_n(str, sub_str->data, sub_str->length);
+}
+
 bool string_contains(const string *str, const char *substring) {
-  return strstr(str->data, substring) != NULL;
+  return string_find_n(str, substring, strlen(substring)) != -1;
+}
+
+bool string_contains_n(const string *str, const char *substring,
+                       size_t sub_len) {
+  return string_find_n(str, substring, sub_len) != -1;
+}
+
+bool string_contains_str(const string *str, const string *substring) {
+  return string_find_n(str, substring->data, substring->length) != -1;
 }
 
 void string_insert(string **str, size_t index, const char *insert_str) {
+  string_insert_n(str, index, insert_str, strlen(insert_str));
+}
+
+void string_insert_n(string **str, size_t index, const char *insert_str,
+                     size_t insert_len) {
   if (index > (*str)->length) {
     return; // Invalid index
   }
+  string_unshare(str);
 
-  size_t insert_len = strlen(insert_str);
   size_t new_len = (*str)->length + insert_len;
-
-  if (new_len + 1 > (*str)->capacity) {
-    size_t new_capacity = (*str)->capacity * 2;
-    while (new_capacity < new_len + 1) {
-      new_capacity *= 2;
-    }
-    string_resize(str, new_capacity);
-  }
+  string_grow(str, new_len);
 
   memmove((*str)->data + index + insert_len, (*str)->data + index,
           (*str)->length - index + 1);
@@ -97,28 +475,95 @@ void string_insert(string **str, size_t index, const char *insert_str) {
   (*str)->length = new_len;
 }
 
+void string_insert_str(string **str, size_t index, const string *insert_str) {
+  if (insert_str == *str) {
+    // Keep the source alive in case inserting reallocates it.
+    string *source = string_share(insert_str);
+    string_insert_n(str, index, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_insert_n(str, index, insert_str->data, insert_str->length);
+}
+
 string *string_join(const char *strings[], size_t num_strings,
                     const char *delimiter) {
-  string *result = string_alloc(""); // joined string
+  // Measure every element once and copy with the cached lengths.
+  size_t stack_lengths[64] = {0};
+  size_t *lengths = stack_lengths;
+  if (num_strings > sizeof(stack_lengths) / sizeof(stack_lengths[0])) {
+    lengths = malloc(num_strings * sizeof(size_t));
+    if (lengths == NULL) {
+      return NULL;
+    }
+  }
+  for (size_t i = 0; i < num_strings; i++) {
+    lengths[i] = strlen(strings[i]);
+  }
+
+  string *result = string_join_n(strings, lengths, num_strings, delimiter,
+                                 strlen(delimiter));
+  if (lengths != stack_lengths) {
+    free(lengths);
+  }
+  return result;
+}
+
+string *string_join_n(const char *strings[], const size_t lengths[],
+                      size_t num_strings, const char *delimiter,
+                      size_t delimiter_len) {
+  size_t length = num_strings > 0 ? (num_strings - 1) * delimiter_len : 0;
+  for (size_t i = 0; i < num_strings; i++) {
+    length += lengths[i];
+  }
+
+  string *result = string_block_alloc(length + 1);
+  if (result == NULL) {
+    return NULL;
+  }
 
-  // ensure result string has enough capacity to avoid multiple re-allocations
-  size_t capacity = num_strings; // (number of delemiters) -1 + '\0'
+  char *end = result->data;
   for (size_t i = 0; i < num_strings; i++) {
-    capacity += strlen(strings[i]);
+    if (i > 0) {
+      memcpy(end, delimiter, delimiter_len);
+      end += delimiter_len;
+    }
+    memcpy(end, strings[i], lengths[i]);
+    end += lengths[i];
   }
-  string_resize(&result, capacity); // ensure enough capacity
+  *end = '\0';
+  result->length = length;
+  return result;
+}
 
+string *string_join_str(const string *strings[], size_t num_strings,
+                        const string *delimiter) {
+  size_t length =
+      num_strings > 0 ? (num_strings - 1) * delimiter->length : 0;
   for (size_t i = 0; i < num_strings; i++) {
-    string_append(&result, strings[i]);
+    length += strings[i]->length;
+  }
+
+  string *result = string_block_alloc(length + 1);
+  if (result == NULL) {
+    return NULL;
+  }
 
-    if (i < num_strings - 1) {
-      string_append(&result, delimiter);
+  char *end = result->data;
+  for (size_t i = 0; i < num_strings; i++) {
+    if (i > 0) {
+      memcpy(end, delimiter->data, delimiter->length);
+      end += delimiter->length;
     }
+    memcpy(end, strings[i]->data, strings[i]->length);
+    end += strings[i]->length;
   }
+  *end = '\0';
+  result->length = length;
   return result;
 }
 
-string **string_split(string *str, char delimiter, size_t *num_tokens) {
+string **string_split(const string *str, char delimiter, size_t *num_tokens) {
   size_t tokens_capacity = 8;
   string **tokens = malloc(tokens_capacity * sizeof(string *));
   if (!tokens) {
@@ -126,25 +571,36 @@ string **string_split(string *str, char delimiter, size_t *num_tokens) {
   }
 
   size_t token_count = 0;
-  char *token = strtok(str->data, &delimiter);
-  while (token != NULL) {
-    if (token_count >= tokens_capacity) {
-      tokens_capacity *= 2;
-      tokens = realloc(tokens, tokens_capacity * sizeof(string *));
-      if (!tokens) {
+  const char *token = str->data;
+  const char *end = str->data + str->length;
+  while (token < end) {
+    const char *token_end = memchr(token, delimiter, end - token);
+    if (token_end == NULL) {
+      token_end = end;
+    }
+
+    // Consecutive delimiters do not produce empty tokens.
+    if (token_end > token) {
+      if (token_count >= tokens_capacity) {
+        tokens_capacity *= 2;
+        string **new_tokens =
+            realloc(tokens, tokens_capacity * sizeof(string *));
+        if (!new_tokens) {
+          goto error;
+        }
+        tokens = new_tokens;
+      }
+
+      // Allocate a string token
+      string *stoken = string_alloc_n(token, token_end - token);
+      if (stoken == NULL) {
         goto error;
       }
-    }
 
-    // Allocate a string token
-    string *stoken = string_alloc(token);
-    if (stoken == NULL) {
-      goto error;
+      tokens[token_count] = stoken;
+      token_count++;
     }
-
-    tokens[token_count] = stoken;
-    token_count++;
-    token = strtok(NULL, &delimiter);
+    token = token_end + 1;
   }
 
   *num_tokens = token_count;
@@ -152,6 +608,9 @@ string **string_split(string *str, char delimiter, size_t *num_tokens) {
 
 error:
   perror("unable to allocate memory for string");
+  if (tokens) {
+    substring_free(tokens, token_count);
+  }
   *num_tokens = 0;
   return NULL;
 }
@@ -162,110 +621,249 @@ void substring_free(string **substrings, size_t num_substrings) {
 
   for (size_t i = 0; i < num_substrings; i++) {
     if (substrings[i]) {
-      free(substrings[i]);
+      string_destroy(substrings[i]);
     }
   }
   free(substrings);
 }
 
-void string_toupper(string *str) {
-  for (size_t i = 0; i < str->length; i++) {
-    str->data[i] = toupper(str->data[i]);
+void string_toupper(string **str) {
+  string_unshare(str);
+  string *s = *str;
+  for (size_t i = 0; i < s->length; i++) {
+    s->data[i] = toupper(s->data[i]);
   }
 }
 
-void string_tolower(string *str) {
-  for (size_t i = 0; i < str->length; i++) {
-    str->data[i] = tolower(str->data[i]);
+void string_tolower(string **str) {
+  string_unshare(str);
+  string *s = *str;
+  for (size_t i = 0; i < s->length; i++) {
+    s->data[i] = tolower(s->data[i]);
   }
 }
 
-void string_to_camelcase(string *str) {
-  char *data = str->data;
-  int dest_index = 0;
-  int capitalize = 1;
+/*
+Case conversion engine.
 
-  while (data[dest_index] != '\0') {
-    if (data[dest_index] == ' ' || data[dest_index] == '_') {
-      capitalize = 1; // capitalize the next character
-    } else if (capitalize) {
-      data[dest_index] = toupper(data[dest_index]);
-      capitalize = 0; // After capitalizing a character, reset the flag
-    }
-    dest_index++;
-  }
+Words are split on separator bytes, on lower-to-upper transitions
+("helloWorld"), before the last capital of an acronym ("HTTPServer") and,
+optionally, between letters and digits. The same routine measures and writes
+the output so the destination can be allocated at its exact size.
+*/
+#define STRING_CASE_DEFAULT_SEPARATORS " \t\n\v\f\r_-"
 
-  // Remove spaces and underscores from the string
-  int j = 0;
-  for (dest_index = 0; data[dest_index] != '\0'; dest_index++) {
-    if (data[dest_index] != ' ' && data[dest_index] != '_') {
-      data[j] = data[dest_index];
-      j++;
+typedef struct case_table {
+  bool separator[256];
+  bool split_case;
+  bool split_acronyms;
+  bool split_digits;
+} case_table;
+
+static void case_table_init(case_table *table, const string_case_rules *rules) {
+  const char *separators = STRING_CASE_DEFAULT_SEPARATORS;
+  table->split_case = true;
+  table->split_acronyms = true;
+  table->split_digits = false;
+
+  if (rules) {
+    if (rules->separators) {
+      separators = rules->separators;
     }
+    table->split_case = rules->split_case;
+    table->split_acronyms = rules->split_acronyms;
+    table->split_digits = rules->split_digits;
   }
-  data[j] = '\0';
 
-  // Update the length of the string
-  str->length = j;
+  memset(table->separator, 0, sizeof(table->separator));
+  for (const char *sep = separators; *sep; sep++) {
+    table->separator[(unsigned char)*sep] = true;
+  }
 }
 
-void string_to_titlecase(string *str) {
-  char *data = str->data;
-  size_t length = str->length;
+static bool case_is_default_separator(unsigned char c) {
+  return c != '\0' && strchr(STRING_CASE_DEFAULT_SEPARATORS, c) != NULL;
+}
 
-  if (length > 0) {
-    data[0] = toupper(data[0]);
+// Convert length bytes from src into dst (which must not overlap src) and
+// return the output length. When dst is NULL the output is only measured.
+static size_t case_convert(const char *src, size_t length, char *dst,
+                           string_case style, const case_table *table) {
+  char separator = '\0';
+  switch (style) {
+  case STRING_CASE_SNAKE:
+  case STRING_CASE_CONSTANT:
+    separator = '_';
+    break;
+  case STRING_CASE_KEBAB:
+    separator = '-';
+    break;
+  case STRING_CASE_TITLE:
+    separator = ' ';
+    break;
+  case STRING_CASE_CAMEL:
+  case STRING_CASE_PASCAL:
+    break;
   }
 
-  for (size_t i = 1; i < length; i++) {
-    if (data[i - 1] == ' ') {
-      data[i] = toupper(data[i]);
-    } else {
-      data[i] = tolower(data[i]);
+  size_t out = 0;
+  size_t words = 0;
+  size_t word_pos = 0;
+  bool in_word = false;
+  unsigned char prev = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = src[i];
+    if (table->separator[c]) {
+      in_word = false;
+      continue;
+    }
+
+    bool boundary = !in_word;
+    if (in_word) {
+      unsigned char next = i + 1 < length ? src[i + 1] : '\0';
+      if (table->split_case && isupper(c) && (islower(prev) || isdigit(prev))) {
+        boundary = true;
+      } else if (table->split_acronyms && isupper(c) && isupper(prev) &&
+                 islower(next)) {
+        boundary = true;
+      } else if (table->split_digits && isalnum(prev) && isalnum(c) &&
+                 !isdigit(prev) != !isdigit(c)) {
+        boundary = true;
+      }
+    }
+
+    if (boundary) {
+      if (words > 0 && separator) {
+        if (dst) {
+          dst[out] = separator;
+        }
+        out++;
+      }
+      words++;
+      word_pos = 0;
+      in_word = true;
     }
+
+    if (dst) {
+      bool upper;
+      switch (style) {
+      case STRING_CASE_CONSTANT:
+        upper = true;
+        break;
+      case STRING_CASE_CAMEL:
+        upper = word_pos == 0 && words > 1;
+        break;
+      case STRING_CASE_PASCAL:
+      case STRING_CASE_TITLE:
+        upper = word_pos == 0;
+        break;
+      default:
+        upper = false;
+        break;
+      }
+      dst[out] = upper ? toupper(c) : tolower(c);
+    }
+    out++;
+    word_pos++;
+    prev = c;
   }
+  return out;
 }
 
-void string_to_snakecase(string **str) {
-  if ((*str)->length == 0) {
-    return;
+static string *case_convert_alloc(const string *str, string_case style,
+                                  const case_table *table) {
+  size_t length = case_convert(str->data, str->length, NULL, style, table);
+
+  string *result = string_block_alloc(length + 1);
+  if (result) {
+    case_convert(str->data, str->length, result->data, style, table);
+    result->data[length] = '\0';
+    result->length = length;
   }
+  return result;
+}
+
+string *string_convert_case(const string *str, string_case style,
+                            const string_case_rules *rules) {
+  case_table table;
+  case_table_init(&table, rules);
+  return case_convert_alloc(str, style, &table);
+}
 
-  size_t length = (*str)->length;
-  string_resize(str, length * 2 + 1);
+bool string_convert_case_batch(const string *src[], string *dst[],
+                               size_t count, string_case style,
+                               const string_case_rules *rules) {
+  case_table table;
+  case_table_init(&table, rules);
 
-  char *data = (*str)->data;
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    dst[i] = case_convert_alloc(src[i], style, &table);
+    if (dst[i] == NULL) {
+      ok = false;
+    }
+  }
+  return ok;
+}
 
-  // Convert first character to lowercase
-  data[0] = tolower(data[0]);
+void string_to_camelcase(string **str) {
+  string_unshare(str);
 
-  size_t space_count = 0;
+  // Capitalize the first letter of every word and drop the separators.
+  char *data = (*str)->data;
+  size_t j = 0;
+  bool capitalize = true;
 
-  for (size_t i = 1; i < length; i++) {
-    // Check if current character is a space
-    if (isspace(data[i])) {
-      space_count++;
-      continue; // Skip spaces
+  for (size_t i = 0; i < (*str)->length; i++) {
+    unsigned char c = data[i];
+    if (case_is_default_separator(c)) {
+      capitalize = true;
+    } else if (capitalize) {
+      data[j++] = toupper(c);
+      capitalize = false;
+    } else {
+      data[j++] = c;
     }
+  }
+  data[j] = '\0';
 
-    // Check if current character is uppercase
-    if (isupper(data[i])) {
-      // Insert underscore before uppercase character
-      memmove(&data[i + 1 - space_count], &data[i - space_count],
-              length - i + space_count);
-      data[i - space_count] = '_';
-      length++;
+  // Update the length of the string
+  (*str)->length = j;
+}
+
+void string_to_titlecase(string **str) {
+  string_unshare(str);
+
+  char *data = (*str)->data;
+  bool word_start = true;
 
-      i++; // Skip the inserted underscore
+  for (size_t i = 0; i < (*str)->length; i++) {
+    unsigned char c = data[i];
+    if (case_is_default_separator(c)) {
+      word_start = true;
+    } else if (word_start) {
+      data[i] = toupper(c);
+      word_start = false;
+    } else {
+      data[i] = tolower(c);
     }
+  }
+}
 
-    // Convert the character to lowercase
-    data[i - space_count] = tolower(data[i]);
+void string_to_snakecase(string **str) {
+  if ((*str)->length == 0) {
+    return;
+  }
+
+  string *result = string_convert_case(*str, STRING_CASE_SNAKE, NULL);
+  if (result == NULL) {
+    printf("string_to_snakecase(): unable to allocate memory\n");
+    exit(EXIT_FAILURE);
   }
 
-  // Trim the string to the new length
-  data[length - space_count] = '\0';
-  (*str)->length = length - space_count;
+  string_destroy(*str);
+  *str = result;
 }
 
 /*
@@ -276,6 +874,8 @@ void string_remove(string **s, size_t index, size_t count) {
     return; // Invalid index
   }
 
+  string_unshare(s);
+
   size_t chars_to_remove =
       (index + count > (*s)->length) ? ((*s)->length - index) : count;
 
@@ -294,14 +894,14 @@ string *string_substr(const string *str, size_t start, size_t length) {
   size_t actual_length =
       (start + length > str->length) ? (str->length - start) : length;
 
-  string *substr = string_alloc(str->data + start);
-  substr->length = actual_length;
-  return substr;
+  return string_alloc_n(str->data + start, actual_length);
 }
 
-void string_reverse(string *s) {
-  char *data = s->data;
-  size_t length = s->length;
+void string_reverse(string **s) {
+  string_unshare(s);
+
+  char *data = (*s)->data;
+  size_t length = (*s)->length;
 
   for (int i = 0; i < length / 2; i++) {
     char temp = data[i];
@@ -311,33 +911,54 @@ void string_reverse(string *s) {
 }
 
 bool string_startswith(const string *s, const char *prefix) {
-  size_t prefix_length = strlen(prefix);
+  return string_startswith_n(s, prefix, strlen(prefix));
+}
+
+bool string_startswith_n(const string *s, const char *prefix,
+                         size_t prefix_length) {
   if (prefix_length > s->length) {
     return false;
   }
-  return strncmp(s->data, prefix, prefix_length) == 0;
+  return memcmp(s->data, prefix, prefix_length) == 0;
+}
+
+bool string_startswith_str(const string *s, const string *prefix) {
+  return string_startswith_n(s, prefix->data, prefix->length);
 }
 
 bool string_endswith(const string *s, const char *suffix) {
-  size_t suffix_length = strlen(suffix);
+  return string_endswith_n(s, suffix, strlen(suffix));
+}
+
+bool string_endswith_n(const string *s, const char *suffix,
+                       size_t suffix_length) {
   if (suffix_length > s->length) {
     return false;
   }
-  return strncmp(s->data + s->length - suffix_length, suffix, suffix_length) ==
+  return memcmp(s->data + s->length - suffix_length, suffix, suffix_length) ==
          0;
 }
 
+bool string_endswith_str(const string *s, const string *suffix) {
+  return string_endswith_n(s, suffix->data, suffix->length);
+}
+
 // Function to replace the first occurrence of a substring in a string
 void string_replace(string **str, const char *find_str,
                     const char *replace_str) {
-  size_t find_len = strlen(find_str);
-  size_t replace_len = strlen(replace_str);
+  string_replace_n(str, find_str, strlen(find_str), replace_str,
+                   strlen(replace_str));
+}
 
-  char *pos = strstr((*str)->data, find_str);
+void string_replace_n(string **str, const char *find_str, size_t find_len,
+                      const char *replace_str, size_t replace_len) {
+  const char *pos =
+      string_memmem((*str)->data, (*str)->length, find_str, find_len);
   if (pos) {
     size_t start_index = pos - (*str)->data;
     size_t new_len = (*str)->length - find_len + replace_len;
 
+    string_unshare(str);
     if (replace_len != find_len) {
       string_resize(str, new_len + 1);
     }
@@ -350,33 +971,92 @@ void string_replace(string **str, const char *find_str,
   }
 }
 
+void string_replace_str(string **str, const string *find_str,
+                        const string *replace_str) {
+  // Keep the arguments alive if they alias the string being modified.
+  string *find = string_share(find_str);
+  string *replace = string_share(replace_str);
+  string_replace_n(str, find->data, find->length, replace->data,
+                   replace->length);
+  string_destroy(replace);
+  string_destroy(find);
+}
+
 // Function to replace all occurrences of a substring in a string
 void string_replace_all(string **str, const char *find_str,
                         const char *replace_str) {
-  size_t find_len = strlen(find_str);
-  size_t replace_len = strlen(replace_str);
+  string_replace_all_n(str, find_str, strlen(find_str), replace_str,
+                       strlen(replace_str));
+}
 
-  size_t start_index = 0;
-  char *pos = strstr((*str)->data + start_index, find_str);
-  while (pos) {
-    start_index = pos - (*str)->data;
-    size_t new_len = (*str)->length - find_len + replace_len;
+void string_replace_all_n(string **str, const char *find_str, size_t find_len,
+                          const char *replace_str, size_t replace_len) {
+  if (find_len == 0) {
+    return;
+  }
 
-    if (replace_len != find_len) {
-      string_resize(str, new_len + 1);
+  // Count the matches first so the result is sized exactly once.
+  size_t count = 0;
+  const char *data = (*str)->data;
+  const char *end = data + (*str)->length;
+  const char *pos = data;
+  while ((pos = string_memmem(pos, end - pos, find_str, find_len)) != NULL) {
+    count++;
+    pos += find_len;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  size_t new_len = (*str)->length - count * find_len + count * replace_len;
+
+  string *result;
+  if (replace_len <= find_len) {
+    // The result never overtakes the source: compact in place.
+    string_unshare(str);
+    result = *str;
+  } else {
+    result = string_block_alloc(new_len + 1);
+    if (result == NULL) {
+      printf("string_replace_all(): unable to allocate memory of capacity: "
+             "%zu\n",
+             new_len + 1);
+      exit(EXIT_FAILURE);
     }
+  }
 
-    memmove((*str)->data + start_index + replace_len,
-            (*str)->data + start_index + find_len,
-            (*str)->length - start_index - find_len + 1);
-    memcpy((*str)->data + start_index, replace_str, replace_len);
-    (*str)->length = new_len;
+  const char *src = (*str)->data;
+  const char *src_end = src + (*str)->length;
+  char *dst = result->data;
+  while ((pos = string_memmem(src, src_end - src, find_str, find_len)) !=
+         NULL) {
+    memmove(dst, src, pos - src);
+    dst += pos - src;
+    memcpy(dst, replace_str, replace_len);
+    dst += replace_len;
+    src = pos + find_len;
+  }
+  memmove(dst, src, src_end - src);
+  result->data[new_len] = '\0';
+  result->length = new_len;
 
-    start_index += replace_len;
-    pos = strstr((*str)->data + start_index, find_str);
+  if (result != *str) {
+    string_destroy(*str);
+    *str = result;
   }
 }
 
+void string_replace_all_str(string **str, const string *find_str,
+                            const string *replace_str) {
+  // Keep the arguments alive if they alias the string being modified.
+  string *find = string_share(find_str);
+  string *replace = string_share(replace_str);
+  string_replace_all_n(str, find->data, find->length, replace->data,
+                       replace->length);
+  string_destroy(replace);
+  string_destroy(find);
+}
+
 bool string_match(const string *str, const char *regex) {
   regex_t compiled_regex;
 
@@ -427,21 +1107,23 @@ char *regex_sub_match(const char *str, const char *regex, int capture_group) {
 }
 
 // Remove leading and trailing white space from string
-void string_trim(string *str) {
-  if (str->length == 0) {
+void string_trim(string **str) {
+  if ((*str)->length == 0) {
     return;
   }
+  string_unshare(str);
+  string *s = *str;
 
   size_t start = 0;
-  size_t end = str->length - 1;
+  size_t end = s->length - 1;
 
   // Find the first non-whitespace character from the start
-  while (start <= end && isspace(str->data[start])) {
+  while (start <= end && isspace(s->data[start])) {
     start++;
   }
 
   // Find the last non-whitespace character from the end
-  while (end > start && isspace(str->data[end])) {
+  while (end > start && isspace(s->data[end])) {
     end--;
   }
 
@@ -453,44 +1135,48 @@ void string_trim(string *str) {
     string_clear(str);
   } else {
     // Shift the non-whitespace characters to the beginning
-    memmove(str->data, str->data + start, new_length);
-    str->data[new_length] = '\0';
-    str->length = new_length;
+    memmove(s->data, s->data + start, new_length);
+    s->data[new_length] = '\0';
+    s->length = new_length;
   }
 }
 
 // Remove leading white space from string
-void string_ltrim(string *str) {
-  if (str->length == 0) {
+void string_ltrim(string **str) {
+  if ((*str)->length == 0) {
     return;
   }
+  string_unshare(str);
+  string *s = *str;
 
   size_t start = 0;
 
   // Find the first non-whitespace character from the start
-  while (start < str->length && isspace(str->data[start])) {
+  while (start < s->length && isspace(s->data[start])) {
     start++;
   }
 
   // Calculate the new length after trimming
-  size_t new_length = str->length - start;
+  size_t new_length = s->length - start;
 
   // Shift the non-whitespace characters to the beginning
-  memmove(str->data, str->data + start, new_length);
-  str->data[new_length] = '\0';
-  str->length = new_length;
+  memmove(s->data, s->data + start, new_length);
+  s->data[new_length] = '\0';
+  s->length = new_length;
 }
 
 // Remove trailing white space from string
-void string_rtrim(string *str) {
-  if (str == NULL || str->length == 0) {
+void string_rtrim(string **str) {
+  if (*str == NULL || (*str)->length == 0) {
     return;
   }
+  string_unshare(str);
+  string *s = *str;
 
-  size_t end = str->length - 1;
+  size_t end = s->length - 1;
 
   // Find the last non-whitespace character from the end
-  while (end > 0 && isspace(str->data[end])) {
+  while (end > 0 && isspace(s->data[end])) {
     end--;
   }
 
@@ -501,7 +1187,5328 @@ void string_rtrim(string *str) {
   if (new_length == 0) {
     string_clear(str);
   } else {
-    str->data[new_length] = '\0';
-    str->length = new_length;
+    s->data[new_length] = '\0';
+    s->length = new_length;
+  }
+}
+
+/*
+String builder.
+
+Segments start at STRING_BUILDER_MIN_SEGMENT bytes (or the size hint) and
+double up to STRING_BUILDER_MAX_SEGMENT, so a large output needs a logarithmic
+number of allocations and no byte is moved until the final flatten.
+*/
+#define STRING_BUILDER_MIN_SEGMENT 4096
+#define STRING_BUILDER_MAX_SEGMENT (4 * 1024 * 1024)
+
+void string_builder_init(string_builder *builder, size_t size_hint) {
+  builder->head = NULL;
+  builder->tail = NULL;
+  builder->length = 0;
+  builder->segment_size = STRING_BUILDER_MIN_SEGMENT;
+
+  if (size_hint > 0) {
+    string_builder_reserve(builder, size_hint);
+  }
+}
+
+// Append a new segment able to hold at least min_capacity bytes.
+static void string_builder_add_segment(string_builder *builder,
+                                       size_t min_capacity) {
+  size_t capacity = builder->segment_size;
+  if (capacity < min_capacity) {
+    capacity = min_capacity;
+  }
+
+  string_segment *segment = malloc(sizeof(string_segment) + capacity);
+  if (segment == NULL) {
+    printf("string_builder(): unable to allocate segment of capacity: %zu\n",
+           capacity);
+    exit(EXIT_FAILURE);
+  }
+  segment->length = 0;
+  segment->capacity = capacity;
+
+  // Insert after the tail, ahead of segments retained by a reset.
+  if (builder->tail) {
+    segment->next = builder->tail->next;
+    builder->tail->next = segment;
+  } else {
+    segment->next = NULL;
+    builder->head = segment;
+  }
+  builder->tail = segment;
+
+  if (builder->segment_size < STRING_BUILDER_MAX_SEGMENT) {
+    builder->segment_size *= 2;
+  }
+}
+
+void string_builder_reserve(string_builder *builder, size_t additional) {
+  string_segment *tail = builder->tail;
+  if (tail && tail->capacity - tail->length >= additional) {
+    return;
+  }
+
+  if (tail && tail->next && tail->next->capacity >= additional) {
+    builder->tail = tail->next; // reuse a retained segment
+    return;
+  }
+  string_builder_add_segment(builder, additional);
+}
+
+void string_builder_append(string_builder *builder, const char *str) {
+  string_builder_append_n(builder, str, strlen(str));
+}
+
+void string_builder_append_n(string_builder *builder, const char *data,
+                             size_t length) {
+  builder->length += length;
+
+  while (length > 0) {
+    string_segment *tail = builder->tail;
+    if (tail == NULL || tail->length == tail->capacity) {
+      if (tail && tail->next) {
+        builder->tail = tail->next; // reuse a retained segment
+      } else {
+        string_builder_add_segment(builder, length);
+      }
+      continue;
+    }
+
+    size_t room = tail->capacity - tail->length;
+    size_t chunk = length < room ? length : room;
+    memcpy(tail->data + tail->length, data, chunk);
+    tail->length += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void string_builder_append_str(string_builder *builder, const string *str) {
+  string_builder_append_n(builder, str->data, str->length);
+}
+
+string *string_builder_to_string(const string_builder *builder) {
+  string *result = string_block_alloc(builder->length + 1);
+  if (result == NULL) {
+    return NULL;
+  }
+
+  char *end = result->data;
+  for (string_segment *segment = builder->head; segment;
+       segment = segment->next) {
+    memcpy(end, segment->data, segment->length);
+    end += segment->length;
+  }
+  *end = '\0';
+  result->length = builder->length;
+  return result;
+}
+
+size_t string_builder_iovec(const string_builder *builder, struct iovec *iov,
+                            size_t max_iov) {
+  size_t count = 0;
+  for (string_segment *segment = builder->head; segment;
+       segment = segment->next) {
+    if (segment->length == 0) {
+      continue;
+    }
+    if (count < max_iov) {
+      iov[count].iov_base = segment->data;
+      iov[count].iov_len = segment->length;
+    }
+    count++;
+  }
+  return count;
+}
+
+void string_builder_reset(string_builder *builder) {
+  for (string_segment *segment = builder->head; segment;
+       segment = segment->next) {
+    segment->length = 0;
+  }
+  builder->tail = builder->head;
+  builder->length = 0;
+}
+
+void string_builder_destroy(string_builder *builder) {
+  string_segment *segment = builder->head;
+  while (segment) {
+    string_segment *next = segment->next;
+    free(segment);
+    segment = next;
+  }
+  builder->head = NULL;
+  builder->tail = NULL;
+  builder->length = 0;
+}
+
+/*
+Edit distance.
+
+Levenshtein distances use the bit-parallel formulation of Myers' algorithm
+by Hyyrö: every column of the dynamic programming matrix is encoded as two
+bit vectors of vertical +1/-1 deltas, so one text byte is processed in a
+handful of word operations per 64 pattern bytes. Patterns longer than 64
+bytes are split into 64-bit words that pass their horizontal deltas down as
+carries.
+*/
+typedef enum myers_mode {
+  MYERS_GLOBAL, // distance between the pattern and the whole text
+  MYERS_SEARCH, // best match of the pattern anywhere in the text
+  MYERS_PREFIX, // best match of the pattern against a prefix of the text
+} myers_mode;
+
+typedef struct myers_pattern {
+  size_t length;           // pattern length, at least 1
+  size_t words;            // number of 64-bit words per column
+  uint64_t *peq;           // match masks, indexed [byte * words + word]
+  uint64_t inline_peq[256]; // storage for single-word patterns
+} myers_pattern;
+
+static bool myers_pattern_init(myers_pattern *p, const char *pattern,
+                               size_t length, bool reverse) {
+  p->length = length;
+  p->words = (length + 63) / 64;
+
+  if (p->words == 1) {
+    p->peq = p->inline_peq;
+    memset(p->peq, 0, sizeof(p->inline_peq));
+  } else {
+    p->peq = calloc(256 * p->words, sizeof(uint64_t));
+    if (p->peq == NULL) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = pattern[reverse ? length - 1 - i : i];
+    p->peq[c * p->words + i / 64] |= (uint64_t)1 << (i % 64);
+  }
+  return true;
+}
+
+static void myers_pattern_free(myers_pattern *p) {
+  if (p->peq != p->inline_peq) {
+    free(p->peq);
+  }
+}
+
+// Global distance for a single-word pattern.
+static size_t myers_distance64(const uint64_t *peq, size_t m,
+                               const unsigned char *text, size_t n,
+                               size_t max_distance) {
+  uint64_t vp = ~(uint64_t)0;
+  uint64_t vn = 0;
+  uint64_t last = (uint64_t)1 << (m - 1);
+  size_t score = m;
+
+  for (size_t j = 0; j < n; j++) {
+    uint64_t x = peq[text[j]];
+    uint64_t d0 = (((x & vp) + vp) ^ vp) | x | vn;
+    uint64_t hp = vn | ~(d0 | vp);
+    uint64_t hn = d0 & vp;
+
+    score += (hp & last) != 0;
+    score -= (hn & last) != 0;
+
+    // Each remaining column lowers the score by at most one.
+    if (score > max_distance && score - max_distance > n - j - 1) {
+      return SIZE_MAX;
+    }
+
+    hp = (hp << 1) | 1;
+    hn <<= 1;
+    vp = hn | ~(d0 | hp);
+    vn = hp & d0;
+  }
+  return score <= max_distance ? score : SIZE_MAX;
+}
+
+// Run the pattern over the text, reading it backwards from text[n - 1] when
+// reverse_text is set. MYERS_GLOBAL returns the distance to the whole text.
+// The other modes return the lowest score over all end positions and store
+// the first position reaching it (as a number of text bytes consumed) in
+// best_end; MYERS_SEARCH extends that position while the score holds. SIZE_MAX is returned when the result exceeds max_distance.
+static size_t myers_run(const myers_pattern *p, const unsigned char *text,
+                        size_t n, bool reverse_text, myers_mode mode,
+                        size_t max_distance, size_t *best_end) {
+  size_t words = p->words;
+  uint64_t *vp = malloc(2 * words * sizeof(uint64_t));
+  if (vp == NULL) {
+    return SIZE_MAX;
+  }
+  uint64_t *vn = vp + words;
+  for (size_t w = 0; w < words; w++) {
+    vp[w] = ~(uint64_t)0;
+    vn[w] = 0;
+  }
+
+  uint64_t last = (uint64_t)1 << ((p->length - 1) % 64);
+  uint64_t row0 = mode == MYERS_SEARCH ? 0 : 1;
+  size_t score = p->length;
+  size_t best = score;
+  size_t best_pos = 0;
+
+  for (size_t j = 0; j < n; j++) {
+    unsigned char c = reverse_text ? text[n - 1 - j] : text[j];
+    const uint64_t *eq = p->peq + c * words;
+    uint64_t hp_carry = row0;
+    uint64_t hn_carry = 0;
+
+    for (size_t w = 0; w < words; w++) {
+      uint64_t x = eq[w] | hn_carry;
+      uint64_t d0 = (((x & vp[w]) + vp[w]) ^ vp[w]) | x | vn[w];
+      uint64_t hp = vn[w] | ~(d0 | vp[w]);
+      uint64_t hn = d0 & vp[w];
+
+      uint64_t hp_in = hp_carry;
+      uint64_t hn_in = hn_carry;
+      if (w < words - 1) {
+        hp_carry = hp >> 63;
+        hn_carry = hn >> 63;
+      } else {
+        score += (hp & last) != 0;
+        score -= (hn & last) != 0;
+      }
+
+      hp = (hp << 1) | hp_in;
+      hn = (hn << 1) | hn_in;
+      vp[w] = hn | ~(d0 | hp);
+      vn[w] = hp & d0;
+    }
+
+    if (mode == MYERS_GLOBAL) {
+      if (score > max_distance && score - max_distance > n - j - 1) {
+        score = SIZE_MAX;
+        break;
+      }
+    } else if (score < best) {
+      best = score;
+      best_pos = j + 1;
+    } else if (score == best && best_pos == j && mode == MYERS_SEARCH) {
+      best_pos = j + 1; // extend the best match while it stays as good
+    } else if (best == 0 && mode == MYERS_SEARCH) {
+      break;
+    }
+  }
+  free(vp);
+
+  if (mode != MYERS_GLOBAL) {
+    score = best;
+    *best_end = best_pos;
+  }
+  return score <= max_distance ? score : SIZE_MAX;
+}
+
+size_t string_levenshtein(const string *a, const string *b,
+                          size_t max_distance) {
+  // The shorter string becomes the pattern so that fewer words are needed.
+  if (a->length > b->length) {
+    const string *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  if (b->length - a->length > max_distance) {
+    return SIZE_MAX;
+  }
+  if (a->length == 0) {
+    return b->length;
+  }
+
+  myers_pattern p;
+  if (!myers_pattern_init(&p, a->data, a->length, false)) {
+    return SIZE_MAX;
+  }
+
+  size_t distance;
+  if (p.words == 1) {
+    distance = myers_distance64(p.peq, a->length,
+                                (const unsigned char *)b->data, b->length,
+                                max_distance);
+  } else {
+    distance = myers_run(&p, (const unsigned char *)b->data, b->length, false,
+                         MYERS_GLOBAL, max_distance, NULL);
+  }
+  myers_pattern_free(&p);
+  return distance;
+}
+
+// Optimal string alignment distance with three rolling rows, for patterns
+// too long for a single word.
+static size_t osa_distance_dp(const unsigned char *a, size_t m,
+                              const unsigned char *b, size_t n,
+                              size_t max_distance) {
+  size_t *rows = malloc(3 * (m + 1) * sizeof(size_t));
+  if (rows == NULL) {
+    return SIZE_MAX;
+  }
+  size_t *prev2 = rows;
+  size_t *prev = rows + m + 1;
+  size_t *cur = rows + 2 * (m + 1);
+
+  for (size_t i = 0; i <= m; i++) {
+    prev[i] = i;
+  }
+
+  for (size_t j = 1; j <= n; j++) {
+    cur[0] = j;
+    size_t row_min = cur[0];
+
+    for (size_t i = 1; i <= m; i++) {
+      size_t cost = a[i - 1] != b[j - 1];
+      size_t d = prev[i - 1] + cost;
+      if (prev[i] + 1 < d) {
+        d = prev[i] + 1;
+      }
+      if (cur[i - 1] + 1 < d) {
+        d = cur[i - 1] + 1;
+      }
+      if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] &&
+          prev2[i - 2] + 1 < d) {
+        d = prev2[i - 2] + 1;
+      }
+      cur[i] = d;
+      if (d < row_min) {
+        row_min = d;
+      }
+    }
+
+    if (row_min > max_distance) {
+      free(rows);
+      return SIZE_MAX;
+    }
+
+    size_t *tmp = prev2;
+    prev2 = prev;
+    prev = cur;
+    cur = tmp;
+  }
+
+  size_t distance = prev[m];
+  free(rows);
+  return distance <= max_distance ? distance : SIZE_MAX;
+}
+
+size_t string_damerau(const string *a, const string *b, size_t max_distance) {
+  if (a->length > b->length) {
+    const string *tmp = a;
+    a = b;
+    b = tmp;
+  }
+  if (b->length - a->length > max_distance) {
+    return SIZE_MAX;
+  }
+  if (a->length == 0) {
+    return b->length;
+  }
+
+  const unsigned char *text = (const unsigned char *)b->data;
+  size_t m = a->length;
+  size_t n = b->length;
+  if (m > 64) {
+    return osa_distance_dp((const unsigned char *)a->data, m, text, n,
+                           max_distance);
+  }
+
+  myers_pattern p;
+  myers_pattern_init(&p, a->data, m, false);
+
+  // Hyyrö's extension: a transposition is a diagonal zero two steps back
+  // where the swapped bytes match.
+  uint64_t vp = ~(uint64_t)0;
+  uint64_t vn = 0;
+  uint64_t d0 = 0;
+  uint64_t pm_prev = 0;
+  uint64_t last = (uint64_t)1 << (m - 1);
+  size_t score = m;
+
+  for (size_t j = 0; j < n; j++) {
+    uint64_t pm = p.peq[text[j]];
+    uint64_t tr = (((~d0) & pm) << 1) & pm_prev;
+    d0 = (((pm & vp) + vp) ^ vp) | pm | vn | tr;
+    uint64_t hp = vn | ~(d0 | vp);
+    uint64_t hn = d0 & vp;
+
+    score += (hp & last) != 0;
+    score -= (hn & last) != 0;
+    if (score > max_distance && score - max_distance > n - j - 1) {
+      return SIZE_MAX;
+    }
+
+    hp = (hp << 1) | 1;
+    hn <<= 1;
+    vp = hn | ~(d0 | hp);
+    vn = hp & d0;
+    pm_prev = pm;
+  }
+  return score <= max_distance ? score : SIZE_MAX;
+}
+
+ssize_t string_find_approx(const string *str, const string *pattern,
+                           size_t max_edits, string_approx_match *match) {
+  size_t m = pattern->length;
+  string_approx_match result = {0, 0, 0};
+
+  if (m > 0) {
+    myers_pattern p;
+    if (!myers_pattern_init(&p, pattern->data, m, false)) {
+      return -1;
+    }
+
+    size_t end = 0;
+    size_t distance = myers_run(&p, (const unsigned char *)str->data,
+                                str->length, false, MYERS_SEARCH, max_edits,
+                                &end);
+    myers_pattern_free(&p);
+    if (distance == SIZE_MAX) {
+      return -1;
+    }
+
+    // Anchor the reversed pattern at the end of the match to find where the
+    // best alignment starts.
+    size_t window = m + distance;
+    if (window > end) {
+      window = end;
+    }
+
+    size_t length = 0;
+    if (!myers_pattern_init(&p, pattern->data, m, true)) {
+      return -1;
+    }
+    myers_run(&p, (const unsigned char *)str->data + end - window, window,
+              true, MYERS_PREFIX, distance, &length);
+    myers_pattern_free(&p);
+
+    result.start = end - length;
+    result.length = length;
+    result.distance = distance;
+  }
+
+  if (match) {
+    *match = result;
+  }
+  return result.start;
+}
+
+#ifdef STRING_X86
+// Score four candidates at a time, one per 64-bit lane. Lanes whose
+// candidate is exhausted keep their state.
+__attribute__((target("avx2"))) static void
+levenshtein_batch_avx2(const uint64_t *peq, size_t m,
+                       const string *candidates[], size_t distances[]) {
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  const __m256i one = _mm256_set1_epi64x(1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i last = _mm256_set1_epi64x((int64_t)((uint64_t)1 << (m - 1)));
+
+  __m256i vp = ones;
+  __m256i vn = zero;
+  __m256i score = _mm256_set1_epi64x((int64_t)m);
+
+  size_t max_len = 0;
+  for (int k = 0; k < 4; k++) {
+    if (candidates[k]->length > max_len) {
+      max_len = candidates[k]->length;
+    }
+  }
+  __m256i lengths = _mm256_set_epi64x(
+      (int64_t)candidates[3]->length, (int64_t)candidates[2]->length,
+      (int64_t)candidates[1]->length, (int64_t)candidates[0]->length);
+
+  for (size_t j = 0; j < max_len; j++) {
+    uint64_t eq[4];
+    for (int k = 0; k < 4; k++) {
+      eq[k] = j < candidates[k]->length
+                  ? peq[(unsigned char)candidates[k]->data[j]]
+                  : 0;
+    }
+    __m256i x = _mm256_loadu_si256((const __m256i *)eq);
+    __m256i active = _mm256_cmpgt_epi64(lengths, _mm256_set1_epi64x(j));
+
+    __m256i d0 = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_xor_si256(
+                _mm256_add_epi64(_mm256_and_si256(x, vp), vp), vp),
+            x),
+        vn);
+    __m256i hp = _mm256_or_si256(vn, _mm256_xor_si256(_mm256_or_si256(d0, vp),
+                                                      ones));
+    __m256i hn = _mm256_and_si256(d0, vp);
+
+    // cmpeq yields -1 for lanes where the last row bit is clear.
+    __m256i hp_set = _mm256_xor_si256(
+        _mm256_cmpeq_epi64(_mm256_and_si256(hp, last), zero), ones);
+    __m256i hn_set = _mm256_xor_si256(
+        _mm256_cmpeq_epi64(_mm256_and_si256(hn, last), zero), ones);
+    __m256i delta = _mm256_sub_epi64(hn_set, hp_set);
+    score = _mm256_add_epi64(score, _mm256_and_si256(delta, active));
+
+    hp = _mm256_or_si256(_mm256_slli_epi64(hp, 1), one);
+    hn = _mm256_slli_epi64(hn, 1);
+    __m256i new_vp = _mm256_or_si256(
+        hn, _mm256_xor_si256(_mm256_or_si256(d0, hp), ones));
+    __m256i new_vn = _mm256_and_si256(hp, d0);
+
+    vp = _mm256_blendv_epi8(vp, new_vp, active);
+    vn = _mm256_blendv_epi8(vn, new_vn, active);
+  }
+
+  uint64_t scores[4];
+  _mm256_storeu_si256((__m256i *)scores, score);
+  for (int k = 0; k < 4; k++) {
+    distances[k] = scores[k];
+  }
+}
+#endif
+
+void string_levenshtein_batch(const string *query, const string *candidates[],
+                              size_t count, size_t max_distance,
+                              size_t distances[]) {
+  size_t m = query->length;
+  if (m == 0 || m > 64) {
+    for (size_t i = 0; i < count; i++) {
+      distances[i] = string_levenshtein(query, candidates[i], max_distance);
+    }
+    return;
+  }
+
+  myers_pattern p;
+  myers_pattern_init(&p, query->data, m, false);
+
+  size_t i = 0;
+#ifdef STRING_X86
+  if (__builtin_cpu_supports("avx2")) {
+    for (; i + 4 <= count; i += 4) {
+      levenshtein_batch_avx2(p.peq, m, candidates + i, distances + i);
+      for (size_t k = i; k < i + 4; k++) {
+        if (distances[k] > max_distance) {
+          distances[k] = SIZE_MAX;
+        }
+      }
+    }
+  }
+#endif
+
+  for (; i < count; i++) {
+    const string *candidate = candidates[i];
+    size_t diff = candidate->length > m ? candidate->length - m
+                                        : m - candidate->length;
+    if (diff > max_distance) {
+      distances[i] = SIZE_MAX;
+    } else {
+      distances[i] =
+          myers_distance64(p.peq, m, (const unsigned char *)candidate->data,
+                           candidate->length, max_distance);
+    }
+  }
+}
+
+int string_compare(const string *a, const string *b) {
+  size_t length = a->length < b->length ? a->length : b->length;
+  int result = memcmp(a->data, b->data, length);
+  if (result != 0) {
+    return result;
+  }
+  return (a->length > b->length) - (a->length < b->length);
+}
+
+#ifdef STRING_X86
+// Fold ASCII capitals in 16 bytes to lowercase.
+static __m128i ascii_fold16(__m128i bytes) {
+  // Shift 'A'..'Z' to the bottom of the signed range to test it with one
+  // comparison.
+  __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8('A' - 128));
+  __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+  return _mm_add_epi8(bytes, _mm_and_si128(upper, _mm_set1_epi8(32)));
+}
+#endif
+
+int string_compare_ci(const string *a, const string *b) {
+  size_t length = a->length < b->length ? a->length : b->length;
+  size_t i = 0;
+
+#ifdef STRING_X86
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = ascii_fold16(_mm_loadu_si128((const __m128i *)(a->data + i)));
+    __m128i y = ascii_fold16(_mm_loadu_si128((const __m128i *)(b->data + i)));
+    unsigned diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+    if (diff) {
+      i += __builtin_ctz(diff);
+      break;
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    int x = tolower((unsigned char)a->data[i]);
+    int y = tolower((unsigned char)b->data[i]);
+    if (x != y) {
+      return x - y;
+    }
+  }
+  return (a->length > b->length) - (a->length < b->length);
+}
+
+int string_compare_natural(const string *a, const string *b) {
+  const unsigned char *x = (const unsigned char *)a->data;
+  const unsigned char *y = (const unsigned char *)b->data;
+  size_t i = 0, j = 0;
+
+  while (i < a->length && j < b->length) {
+    if (isdigit(x[i]) && isdigit(y[j])) {
+      // Compare digit runs by value: skip leading zeros, then the longer
+      // run is larger, then the first differing digit decides.
+      while (i < a->length && x[i] == '0') {
+        i++;
+      }
+      while (j < b->length && y[j] == '0') {
+        j++;
+      }
+      size_t x_end = i, y_end = j;
+      while (x_end < a->length && isdigit(x[x_end])) {
+        x_end++;
+      }
+      while (y_end < b->length && isdigit(y[y_end])) {
+        y_end++;
+      }
+
+      size_t x_digits = x_end - i, y_digits = y_end - j;
+      if (x_digits != y_digits) {
+        return x_digits < y_digits ? -1 : 1;
+      }
+      int result = memcmp(x + i, y + j, x_digits);
+      if (result != 0) {
+        return result;
+      }
+      i = x_end;
+      j = y_end;
+    } else {
+      if (x[i] != y[j]) {
+        return x[i] - y[j];
+      }
+      i++;
+      j++;
+    }
+  }
+  return (i < a->length) - (j < b->length);
+}
+
+/*
+Sorting.
+
+string_sort is a multikey quicksort over cached 8-byte keys: seven bytes of
+the string at the current depth, big-endian, followed by the number of bytes
+left (capped at 8). Comparing keys orders strings by their next seven bytes
+and puts a string that ends before one that continues, so equal keys with a
+count below 8 identify equal strings and only the group of equal continuing
+keys needs to look deeper. Each level reads every string once to refresh its
+key instead of rescanning common prefixes on every comparison.
+*/
+#define STRING_SORT_KEY_BYTES 7
+#define STRING_SORT_INSERTION_MAX 16
+#define STRING_SORT_PARALLEL_MIN 65536
+
+typedef struct sort_entry {
+  uint64_t key;
+  string *str;
+} sort_entry;
+
+static uint64_t sort_key(const string *str, size_t depth) {
+  uint64_t key = 0;
+  size_t remaining = str->length > depth ? str->length - depth : 0;
+  size_t count = remaining < STRING_SORT_KEY_BYTES ? remaining
+                                                   : STRING_SORT_KEY_BYTES;
+  const unsigned char *data = (const unsigned char *)str->data + depth;
+
+  for (size_t i = 0; i < count; i++) {
+    key |= (uint64_t)data[i] << (8 * (7 - i));
+  }
+  return key | (remaining < 8 ? remaining : 8);
+}
+
+static int compare_from(const string *a, const string *b, size_t depth) {
+  size_t length = a->length < b->length ? a->length : b->length;
+  int result = memcmp(a->data + depth, b->data + depth, length - depth);
+  if (result != 0) {
+    return result;
+  }
+  return (a->length > b->length) - (a->length < b->length);
+}
+
+static void sort_swap(sort_entry *a, sort_entry *b) {
+  sort_entry tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// Order two entries whose keys are valid for the same depth.
+static int sort_entry_compare(const sort_entry *a, const sort_entry *b,
+                              size_t depth) {
+  if (a->key != b->key) {
+    return a->key < b->key ? -1 : 1;
+  }
+  if ((a->key & 0xFF) < 8) {
+    return 0; // both strings end within this key
+  }
+  return compare_from(a->str, b->str, depth + STRING_SORT_KEY_BYTES);
+}
+
+static void multikey_quicksort(sort_entry *entries, size_t count,
+                               size_t depth, bool keys_valid) {
+  if (!keys_valid) {
+    for (size_t i = 0; i < count; i++) {
+      entries[i].key = sort_key(entries[i].str, depth);
+    }
+  }
+
+  while (count > STRING_SORT_INSERTION_MAX) {
+    // Median of three pivot.
+    uint64_t a = entries[0].key;
+    uint64_t b = entries[count / 2].key;
+    uint64_t c = entries[count - 1].key;
+    uint64_t pivot = a < b ? (b < c ? b : (a < c ? c : a))
+                           : (a < c ? a : (b < c ? c : b));
+
+    // Dutch national flag partition into <, == and > the pivot.
+    size_t lt = 0, i = 0, gt = count;
+    while (i < gt) {
+      if (entries[i].key < pivot) {
+        sort_swap(&entries[lt++], &entries[i++]);
+      } else if (entries[i].key > pivot) {
+        sort_swap(&entries[i], &entries[--gt]);
+      } else {
+        i++;
+      }
+    }
+
+    multikey_quicksort(entries, lt, depth, true);
+    multikey_quicksort(entries + gt, count - gt, depth, true);
+
+    // Strings in the middle share the pivot key; only continuing ones need
+    // to be compared further.
+    if ((pivot & 0xFF) < 8) {
+      return;
+    }
+    entries += lt;
+    count = gt - lt;
+    depth += STRING_SORT_KEY_BYTES;
+    for (size_t k = 0; k < count; k++) {
+      entries[k].key = sort_key(entries[k].str, depth);
+    }
+  }
+
+  for (size_t i = 1; i < count; i++) {
+    sort_entry entry = entries[i];
+    size_t j = i;
+    while (j > 0 && sort_entry_compare(&entries[j - 1], &entry, depth) > 0) {
+      entries[j] = entries[j - 1];
+      j--;
+    }
+    entries[j] = entry;
   }
 }
+
+void string_sort(string **strings, size_t count) {
+  sort_entry *entries = malloc(count * sizeof(sort_entry));
+  if (entries == NULL) {
+    string_sort_with(strings, count, string_compare);
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    entries[i].str = strings[i];
+  }
+  multikey_quicksort(entries, count, 0, false);
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = entries[i].str;
+  }
+  free(entries);
+}
+
+static void merge_runs(string **dst, string **left, size_t left_count,
+                       string **right, size_t right_count,
+                       int (*compare)(const string *, const string *)) {
+  size_t i = 0, j = 0, k = 0;
+  while (i < left_count && j < right_count) {
+    if (compare(right[j], left[i]) < 0) {
+      dst[k++] = right[j++];
+    } else {
+      dst[k++] = left[i++];
+    }
+  }
+  while (i < left_count) {
+    dst[k++] = left[i++];
+  }
+  while (j < right_count) {
+    dst[k++] = right[j++];
+  }
+}
+
+// Stable merge sort of strings into itself, using tmp as scratch space.
+static void merge_sort(string **strings, string **tmp, size_t count,
+                       int (*compare)(const string *, const string *)) {
+  if (count <= STRING_SORT_INSERTION_MAX) {
+    for (size_t i = 1; i < count; i++) {
+      string *str = strings[i];
+      size_t j = i;
+      while (j > 0 && compare(strings[j - 1], str) > 0) {
+        strings[j] = strings[j - 1];
+        j--;
+      }
+      strings[j] = str;
+    }
+    return;
+  }
+
+  size_t half = count / 2;
+  merge_sort(strings, tmp, half, compare);
+  merge_sort(strings + half, tmp + half, count - half, compare);
+  if (compare(strings[half - 1], strings[half]) <= 0) {
+    return; // already in order
+  }
+
+  memcpy(tmp, strings, count * sizeof(string *));
+  merge_runs(strings, tmp, half, tmp + half, count - half, compare);
+}
+
+void string_sort_with(string **strings, size_t count,
+                      int (*compare)(const string *, const string *)) {
+  string **tmp = malloc(count * sizeof(string *));
+  if (tmp == NULL) {
+    printf("string_sort_with(): unable to allocate memory\n");
+    exit(EXIT_FAILURE);
+  }
+  merge_sort(strings, tmp, count, compare);
+  free(tmp);
+}
+
+// Number of CPUs that extra threads can actually run on.
+static size_t online_cpus(void) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  return online > 0 ? (size_t)online : 1;
+}
+
+// Start fn(arg) on a new thread, or run it on the calling thread if no thread
+// can be created. Returns true if *id has to be joined.
+static bool thread_start(pthread_t *id, void *(*fn)(void *), void *arg) {
+  if (pthread_create(id, NULL, fn, arg) == 0) {
+    return true;
+  }
+  fn(arg);
+  return false;
+}
+
+typedef struct sort_task {
+  string **strings;
+  size_t count;
+} sort_task;
+
+static void *sort_task_run(void *arg) {
+  sort_task *task = arg;
+  string_sort(task->strings, task->count);
+  return NULL;
+}
+
+typedef struct merge_task {
+  string **dst;
+  string **left;
+  size_t left_count;
+  string **right;
+  size_t right_count;
+} merge_task;
+
+static void *merge_task_run(void *arg) {
+  merge_task *task = arg;
+  merge_runs(task->dst, task->left, task->left_count, task->right,
+             task->right_count, string_compare);
+  return NULL;
+}
+
+void string_sort_parallel(string **strings, size_t count, size_t threads) {
+  // Threads beyond the CPU count only add merge passes.
+  if (threads > online_cpus()) {
+    threads = online_cpus();
+  }
+  if (threads > count / (STRING_SORT_PARALLEL_MIN / 2)) {
+    threads = count / (STRING_SORT_PARALLEL_MIN / 2);
+  }
+  if (threads <= 1) {
+    string_sort(strings, count);
+    return;
+  }
+
+  pthread_t *ids = malloc(threads * sizeof(pthread_t));
+  bool *started = malloc(threads * sizeof(bool));
+  sort_task *runs = malloc(threads * sizeof(sort_task));
+  merge_task *merges = malloc(threads * sizeof(merge_task));
+  string **tmp = malloc(count * sizeof(string *));
+  if (!ids || !started || !runs || !merges || !tmp) {
+    free(ids);
+    free(started);
+    free(runs);
+    free(merges);
+    free(tmp);
+    string_sort(strings, count);
+    return;
+  }
+
+  // Sort one run per thread.
+  for (size_t t = 0; t < threads; t++) {
+    size_t begin = count * t / threads;
+    size_t end = count * (t + 1) / threads;
+    runs[t].strings = strings + begin;
+    runs[t].count = end - begin;
+    started[t] = thread_start(&ids[t], sort_task_run, &runs[t]);
+  }
+  for (size_t t = 0; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(ids[t], NULL);
+    }
+  }
+
+  // Merge neighbouring runs pairwise, one thread per pair, ping-ponging
+  // between the input array and the scratch buffer.
+  string **src = strings;
+  string **dst = tmp;
+  size_t num_runs = threads;
+  while (num_runs > 1) {
+    size_t pairs = 0;
+    for (size_t r = 0; r < num_runs; r += 2) {
+      string **out = dst + (runs[r].strings - src);
+      if (r + 1 < num_runs) {
+        merges[pairs] = (merge_task){out, runs[r].strings, runs[r].count,
+                                     runs[r + 1].strings, runs[r + 1].count};
+        started[pairs] =
+            thread_start(&ids[pairs], merge_task_run, &merges[pairs]);
+        runs[r / 2] = (sort_task){out, runs[r].count + runs[r + 1].count};
+      } else {
+        memcpy(out, runs[r].strings, runs[r].count * sizeof(string *));
+        runs[r / 2] = (sort_task){out, runs[r].count};
+      }
+      pairs += r + 1 < num_runs;
+    }
+    for (size_t p = 0; p < pairs; p++) {
+      if (started[p]) {
+        pthread_join(ids[p], NULL);
+      }
+    }
+
+    num_runs = (num_runs + 1) / 2;
+    string **swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != strings) {
+    memcpy(strings, src, count * sizeof(string *));
+  }
+  free(tmp);
+  free(merges);
+  free(runs);
+  free(started);
+  free(ids);
+}
+
+/*
+CSV/TSV parsing.
+
+Input is classified 64 bytes at a time into bitmaps of quotes, delimiters and
+newlines (with SSE2 compares on x86). A prefix XOR over the quote bitmap
+marks the bytes inside quoted fields, which masks out the delimiters and
+newlines they contain; the remaining structural bits are walked with
+count-trailing-zeros to emit one field view per delimiter.
+*/
+#define CSV_BLOCK 64
+#define CSV_PARALLEL_MIN (1024 * 1024) // Bytes per thread worth a thread.
+
+void string_csv_init(string_csv *csv, char delimiter, char quote) {
+  csv->delimiter = delimiter;
+  csv->quote = quote;
+  csv->fields = NULL;
+  csv->num_fields = 0;
+  csv->fields_capacity = 0;
+  csv->records = NULL;
+  csv->num_records = 0;
+  csv->records_capacity = 0;
+}
+
+void string_csv_destroy(string_csv *csv) {
+  free(csv->fields);
+  free(csv->records);
+  string_csv_init(csv, csv->delimiter, csv->quote);
+}
+
+static bool csv_reserve(void **array, size_t *capacity, size_t needed,
+                        size_t element_size) {
+  if (needed <= *capacity) {
+    return true;
+  }
+
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  void *new_array = realloc(*array, new_capacity * element_size);
+  if (new_array == NULL) {
+    return false;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+// Bitmap of the bytes in a 64-byte block equal to c.
+static uint64_t csv_match(const char *block, char c) {
+#ifdef STRING_X86
+  __m128i needle = _mm_set1_epi8(c);
+  uint64_t bits = 0;
+  for (int i = 0; i < 4; i++) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+    uint64_t mask = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle));
+    bits |= mask << (16 * i);
+  }
+  return bits;
+#else
+  uint64_t bits = 0;
+  for (int i = 0; i < CSV_BLOCK; i++) {
+    bits |= (uint64_t)(block[i] == c) << i;
+  }
+  return bits;
+#endif
+}
+
+// Set every bit from each quote up to (not including) the next one.
+static uint64_t csv_prefix_xor(uint64_t bits) {
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+}
+
+static bool csv_add_field(string_csv *csv, const char *data, size_t start,
+                          size_t end, bool record_end) {
+  if (!csv_reserve((void **)&csv->fields, &csv->fields_capacity,
+                   csv->num_fields + 1, sizeof(string_csv_field))) {
+    return false;
+  }
+
+  // Drop the carriage return of a CRLF line ending.
+  if (record_end && end > start && data[end - 1] == '\r') {
+    end--;
+  }
+
+  string_csv_field *field = &csv->fields[csv->num_fields++];
+  field->data = data + start;
+  field->length = end - start;
+  field->escaped = false;
+
+  if (csv->quote && field->length >= 2 && field->data[0] == csv->quote &&
+      field->data[field->length - 1] == csv->quote) {
+    field->data++;
+    field->length -= 2;
+    field->escaped = memchr(field->data, csv->quote, field->length) != NULL;
+  }
+  return true;
+}
+
+static bool csv_end_record(string_csv *csv) {
+  // records[] holds the first field of every record plus a final sentinel.
+  if (!csv_reserve((void **)&csv->records, &csv->records_capacity,
+                   csv->num_records + 2, sizeof(size_t))) {
+    return false;
+  }
+  csv->num_records++;
+  csv->records[csv->num_records] = csv->num_fields;
+  return true;
+}
+
+size_t string_csv_parse_n(string_csv *csv, const char *data, size_t length,
+                          bool final) {
+  csv->num_fields = 0;
+  csv->num_records = 0;
+  if (!csv_reserve((void **)&csv->records, &csv->records_capacity, 1,
+                   sizeof(size_t))) {
+    return 0;
+  }
+  csv->records[0] = 0;
+
+  uint64_t in_quotes = 0; // all ones while the previous block ended quoted
+  size_t field_start = 0;
+  size_t consumed = 0;
+  char tail[CSV_BLOCK];
+
+  for (size_t base = 0; base < length; base += CSV_BLOCK) {
+    const char *block = data + base;
+    if (length - base < CSV_BLOCK) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, block, length - base);
+      block = tail;
+    }
+
+    uint64_t inside = 0;
+    if (csv->quote) {
+      inside = csv_prefix_xor(csv_match(block, csv->quote)) ^ in_quotes;
+      in_quotes = (uint64_t)0 - (inside >> 63);
+    }
+
+    uint64_t newlines = csv_match(block, '\n') & ~inside;
+    uint64_t structural = (csv_match(block, csv->delimiter) & ~inside) |
+                          newlines;
+    if (length - base < CSV_BLOCK) {
+      structural &= ((uint64_t)1 << (length - base)) - 1;
+    }
+
+    while (structural) {
+      int bit = __builtin_ctzll(structural);
+      size_t pos = base + bit;
+      bool record_end = (newlines >> bit) & 1;
+
+      if (!csv_add_field(csv, data, field_start, pos, record_end) ||
+          (record_end && !csv_end_record(csv))) {
+        return consumed;
+      }
+      field_start = pos + 1;
+      if (record_end) {
+        consumed = field_start;
+      }
+      structural &= structural - 1;
+    }
+  }
+
+  // A last record without a line ending, possibly ending in a delimiter and
+  // so in an empty field.
+  if (final && consumed < length) {
+    if (csv_add_field(csv, data, field_start, length, true) &&
+        csv_end_record(csv)) {
+      consumed = length;
+    }
+  }
+
+  // Forget the fields of a trailing incomplete record.
+  csv->num_fields = csv->records[csv->num_records];
+  return consumed;
+}
+
+size_t string_csv_parse(string_csv *csv, const string *str, bool final) {
+  return string_csv_parse_n(csv, str->data, str->length, final);
+}
+
+const string_csv_field *string_csv_record(const string_csv *csv, size_t index,
+                                          size_t *num_fields) {
+  if (index >= csv->num_records) {
+    *num_fields = 0;
+    return NULL;
+  }
+  *num_fields = csv->records[index + 1] - csv->records[index];
+  return csv->fields + csv->records[index];
+}
+
+string *string_csv_field_string(const string_csv *csv,
+                                const string_csv_field *field) {
+  string *str = string_alloc_n(field->data, field->length);
+  if (str && field->escaped) {
+    // Collapse doubled quotes.
+    char *dst = str->data;
+    for (size_t i = 0; i < field->length; i++) {
+      *dst++ = field->data[i];
+      if (field->data[i] == csv->quote && i + 1 < field->length &&
+          field->data[i + 1] == csv->quote) {
+        i++;
+      }
+    }
+    *dst = '\0';
+    str->length = dst - str->data;
+  }
+  return str;
+}
+
+typedef struct csv_chunk {
+  string_csv csv;
+  const char *data;
+  size_t start;
+  size_t end;
+  size_t quotes;
+  size_t consumed;
+  bool final;
+} csv_chunk;
+
+static void *csv_count_quotes(void *arg) {
+  csv_chunk *chunk = arg;
+  const char *pos = chunk->data + chunk->start;
+  const char *end = chunk->data + chunk->end;
+  size_t count = 0;
+
+  for (; pos + CSV_BLOCK <= end; pos += CSV_BLOCK) {
+    count += __builtin_popcountll(csv_match(pos, chunk->csv.quote));
+  }
+  for (; pos < end; pos++) {
+    count += *pos == chunk->csv.quote;
+  }
+  chunk->quotes = count;
+  return NULL;
+}
+
+static void *csv_parse_chunk(void *arg) {
+  csv_chunk *chunk = arg;
+  chunk->consumed =
+      string_csv_parse_n(&chunk->csv, chunk->data + chunk->start,
+                         chunk->end - chunk->start, chunk->final);
+  return NULL;
+}
+
+bool string_csv_parse_parallel(string_csv *csv, const char *data,
+                               size_t length, size_t threads) {
+  if (threads > online_cpus()) {
+    threads = online_cpus();
+  }
+  if (threads <= 1 || length < threads * CSV_PARALLEL_MIN) {
+    return string_csv_parse_n(csv, data, length, true) == length;
+  }
+
+  csv_chunk *chunks = calloc(threads, sizeof(csv_chunk));
+  pthread_t *ids = malloc(threads * sizeof(pthread_t));
+  bool *started = calloc(threads, sizeof(bool));
+  if (!chunks || !ids || !started) {
+    free(chunks);
+    free(ids);
+    free(started);
+    return false;
+  }
+
+  // Pass 1: count the quotes in evenly sized chunks to learn whether each
+  // chunk starts inside a quoted field.
+  for (size_t t = 0; t < threads; t++) {
+    string_csv_init(&chunks[t].csv, csv->delimiter, csv->quote);
+    chunks[t].data = data;
+    chunks[t].start = length * t / threads;
+    chunks[t].end = length * (t + 1) / threads;
+    if (csv->quote) {
+      started[t] = thread_start(&ids[t], csv_count_quotes, &chunks[t]);
+    }
+  }
+  for (size_t t = 0; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(ids[t], NULL);
+    }
+  }
+
+  // Move every chunk start to the first record boundary after it.
+  bool quoted = false;
+  for (size_t t = 1; t < threads; t++) {
+    quoted ^= chunks[t - 1].quotes & 1;
+
+    size_t pos = length * t / threads;
+    bool inside = quoted;
+    while (pos < length && (inside || data[pos] != '\n')) {
+      if (csv->quote && data[pos] == csv->quote) {
+        inside = !inside;
+      }
+      pos++;
+    }
+    size_t boundary = pos < length ? pos + 1 : length;
+    if (boundary < chunks[t - 1].start) {
+      boundary = chunks[t - 1].start;
+    }
+    chunks[t - 1].end = boundary;
+    chunks[t].start = boundary;
+  }
+  for (size_t t = 0; t < threads; t++) {
+    chunks[t].final = chunks[t].end == length;
+  }
+  chunks[threads - 1].end = length;
+
+  // Pass 2: parse the chunks independently.
+  for (size_t t = 0; t < threads; t++) {
+    started[t] = thread_start(&ids[t], csv_parse_chunk, &chunks[t]);
+  }
+  for (size_t t = 0; t < threads; t++) {
+    if (started[t]) {
+      pthread_join(ids[t], NULL);
+    }
+  }
+
+  // Concatenate the per-chunk indexes. Every chunk must have been parsed to
+  // its end, or records are missing from the middle of the index.
+  bool ok = true;
+  size_t total_fields = 0, total_records = 0;
+  for (size_t t = 0; t < threads; t++) {
+    ok = ok && chunks[t].consumed == chunks[t].end - chunks[t].start;
+    total_fields += chunks[t].csv.num_fields;
+    total_records += chunks[t].csv.num_records;
+  }
+
+  ok = ok && csv_reserve((void **)&csv->fields, &csv->fields_capacity,
+                        total_fields, sizeof(string_csv_field)) &&
+            csv_reserve((void **)&csv->records, &csv->records_capacity,
+                        total_records + 1, sizeof(size_t));
+  if (ok) {
+    csv->num_fields = 0;
+    csv->num_records = 0;
+    csv->records[0] = 0;
+    for (size_t t = 0; t < threads; t++) {
+      string_csv *part = &chunks[t].csv;
+      if (part->num_fields > 0) {
+        memcpy(csv->fields + csv->num_fields, part->fields,
+               part->num_fields * sizeof(string_csv_field));
+      }
+      for (size_t r = 1; r <= part->num_records; r++) {
+        csv->records[csv->num_records + r] =
+            csv->num_fields + part->records[r];
+      }
+      csv->num_fields += part->num_fields;
+      csv->num_records += part->num_records;
+    }
+  } else {
+    csv->num_fields = 0;
+    csv->num_records = 0;
+  }
+
+  for (size_t t = 0; t < threads; t++) {
+    string_csv_destroy(&chunks[t].csv);
+  }
+  free(started);
+  free(ids);
+  free(chunks);
+  return ok;
+}
+
+/*
+Escape codecs.
+
+Encoders find the next byte that needs escaping 16 bytes at a time with SSE2
+and copy the clean run before it with memcpy. A counting pass over the same
+runs sizes the destination exactly before anything is written. Decoders never
+produce more bytes than they read, so the destination is sized by the input
+length.
+*/
+typedef enum codec_class {
+  CODEC_JSON, // '"', '\\' and control characters
+  CODEC_HTML, // '&', '<', '>', '"' and '\''
+  CODEC_URL,  // everything except A-Z a-z 0-9 - . _ ~
+} codec_class;
+
+static const char hex_upper[] = "0123456789ABCDEF";
+
+static bool codec_special(codec_class cls, unsigned char c) {
+  switch (cls) {
+  case CODEC_JSON:
+    return c < 0x20 || c == '"' || c == '\\';
+  case CODEC_HTML:
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+  case CODEC_URL:
+    return !(isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') ||
+           c >= 0x80;
+  }
+  return false;
+}
+
+#ifdef STRING_X86
+// Bytes of x within [lo, hi], as a byte mask.
+static __m128i codec_in_range(__m128i x, unsigned char lo, unsigned char hi) {
+  __m128i offset = _mm_sub_epi8(x, _mm_set1_epi8((char)lo));
+  __m128i limit = _mm_set1_epi8((char)(hi - lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(offset, limit), offset);
+}
+
+static unsigned codec_mask16(codec_class cls, __m128i x) {
+  __m128i special;
+  switch (cls) {
+  case CODEC_JSON:
+    special = _mm_or_si128(
+        codec_in_range(x, 0x00, 0x1F),
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('"')),
+                     _mm_cmpeq_epi8(x, _mm_set1_epi8('\\'))));
+    break;
+  case CODEC_HTML:
+    special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('&')),
+                     _mm_cmpeq_epi8(x, _mm_set1_epi8('<'))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('>')),
+                                  _mm_cmpeq_epi8(x, _mm_set1_epi8('"'))),
+                     _mm_cmpeq_epi8(x, _mm_set1_epi8('\''))));
+    break;
+  default: {
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    __m128i unreserved = _mm_or_si128(
+        _mm_or_si128(codec_in_range(lower, 'a', 'z'),
+                     codec_in_range(x, '0', '9')),
+        _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('-')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('.'))),
+            _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('_')),
+                         _mm_cmpeq_epi8(x, _mm_set1_epi8('~')))));
+    return _mm_movemask_epi8(unreserved) ^ 0xFFFF;
+  }
+  }
+  return _mm_movemask_epi8(special);
+}
+#endif
+
+// Length of the leading run of bytes that are copied unchanged.
+static size_t codec_clean_run(codec_class cls, const char *data,
+                              size_t length) {
+  size_t i = 0;
+#ifdef STRING_X86
+  for (; i + 16 <= length; i += 16) {
+    unsigned mask =
+        codec_mask16(cls, _mm_loadu_si128((const __m128i *)(data + i)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  while (i < length && !codec_special(cls, data[i])) {
+    i++;
+  }
+  return i;
+}
+
+// Write the escaped form of c to out (if not NULL) and return its length.
+static size_t codec_escape_byte(codec_class cls, unsigned char c, char *out) {
+  const char *text = NULL;
+  char buf[6];
+
+  switch (cls) {
+  case CODEC_JSON:
+    switch (c) {
+    case '"':
+      text = "\\\"";
+      break;
+    case '\\':
+      text = "\\\\";
+      break;
+    case '\b':
+      text = "\\b";
+      break;
+    case '\f':
+      text = "\\f";
+      break;
+    case '\n':
+      text = "\\n";
+      break;
+    case '\r':
+      text = "\\r";
+      break;
+    case '\t':
+      text = "\\t";
+      break;
+    default:
+      memcpy(buf, "\\u00", 4);
+      buf[4] = hex_upper[c >> 4];
+      buf[5] = hex_upper[c & 15];
+      if (out) {
+        memcpy(out, buf, 6);
+      }
+      return 6;
+    }
+    break;
+  case CODEC_HTML:
+    switch (c) {
+    case '&':
+      text = "&amp;";
+      break;
+    case '<':
+      text = "&lt;";
+      break;
+    case '>':
+      text = "&gt;";
+      break;
+    case '"':
+      text = "&quot;";
+      break;
+    default:
+      text = "&#39;";
+      break;
+    }
+    break;
+  case CODEC_URL:
+    if (out) {
+      out[0] = '%';
+      out[1] = hex_upper[c >> 4];
+      out[2] = hex_upper[c & 15];
+    }
+    return 3;
+  }
+
+  size_t length = strlen(text);
+  if (out) {
+    memcpy(out, text, length);
+  }
+  return length;
+}
+
+static void codec_escape(string **dst, const char *src, size_t length,
+                         codec_class cls) {
+  // Measure the output exactly.
+  size_t out_len = 0;
+  for (size_t i = 0; i < length;) {
+    size_t run = codec_clean_run(cls, src + i, length - i);
+    out_len += run;
+    i += run;
+    if (i < length) {
+      out_len += codec_escape_byte(cls, src[i++], NULL);
+    }
+  }
+
+  string_unshare(dst);
+  string_resize(dst, (*dst)->length + out_len + 1);
+
+  char *out = (*dst)->data + (*dst)->length;
+  for (size_t i = 0; i < length;) {
+    size_t run = codec_clean_run(cls, src + i, length - i);
+    memcpy(out, src + i, run);
+    out += run;
+    i += run;
+    if (i < length) {
+      out += codec_escape_byte(cls, src[i++], out);
+    }
+  }
+  *out = '\0';
+  (*dst)->length += out_len;
+}
+
+static int hex_value(unsigned char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// Parse count hex digits, returning -1 if any is invalid.
+static long parse_hex(const char *src, size_t count) {
+  long value = 0;
+  for (size_t i = 0; i < count; i++) {
+    int digit = hex_value(src[i]);
+    if (digit < 0) {
+      return -1;
+    }
+    value = value * 16 + digit;
+  }
+  return value;
+}
+
+static size_t utf8_encode(uint32_t cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = 0xC0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = 0xE0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3F);
+    out[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  out[0] = 0xF0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3F);
+  out[2] = 0x80 | ((cp >> 6) & 0x3F);
+  out[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+// Make room for length more bytes and return where they go.
+static char *codec_reserve(string **dst, size_t length) {
+  string_unshare(dst);
+  string_resize(dst, (*dst)->length + length + 1);
+  return (*dst)->data + (*dst)->length;
+}
+
+static void codec_finish(string **dst, char *end) {
+  *end = '\0';
+  (*dst)->length = end - (*dst)->data;
+}
+
+static bool codec_fail(string **dst, size_t length) {
+  (*dst)->data[length] = '\0';
+  (*dst)->length = length;
+  return false;
+}
+
+void string_json_escape_n(string **dst, const char *src, size_t length) {
+  codec_escape(dst, src, length, CODEC_JSON);
+}
+
+void string_json_escape(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    string_json_escape_n(dst, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_json_escape_n(dst, src->data, src->length);
+}
+
+bool string_json_unescape_n(string **dst, const char *src, size_t length) {
+  size_t original = (*dst)->length;
+  char *out = codec_reserve(dst, length);
+
+  for (size_t i = 0; i < length;) {
+    size_t run = codec_clean_run(CODEC_JSON, src + i, length - i);
+    memcpy(out, src + i, run);
+    out += run;
+    i += run;
+    if (i == length) {
+      break;
+    }
+
+    // Raw quotes and control characters are not allowed in JSON strings.
+    if (src[i] != '\\' || i + 1 == length) {
+      return codec_fail(dst, original);
+    }
+
+    char c = src[i + 1];
+    i += 2;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '/':
+      *out++ = c;
+      break;
+    case 'b':
+      *out++ = '\b';
+      break;
+    case 'f':
+      *out++ = '\f';
+      break;
+    case 'n':
+      *out++ = '\n';
+      break;
+    case 'r':
+      *out++ = '\r';
+      break;
+    case 't':
+      *out++ = '\t';
+      break;
+    case 'u': {
+      long cp = i + 4 <= length ? parse_hex(src + i, 4) : -1;
+      if (cp < 0 || (cp >= 0xDC00 && cp <= 0xDFFF)) {
+        return codec_fail(dst, original);
+      }
+      i += 4;
+
+      if (cp >= 0xD800 && cp <= 0xDBFF) {
+        // A high surrogate must be followed by an escaped low surrogate.
+        long low = i + 6 <= length && src[i] == '\\' && src[i + 1] == 'u'
+                       ? parse_hex(src + i + 2, 4)
+                       : -1;
+        if (low < 0xDC00 || low > 0xDFFF) {
+          return codec_fail(dst, original);
+        }
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        i += 6;
+      }
+      out += utf8_encode(cp, out);
+      break;
+    }
+    default:
+      return codec_fail(dst, original);
+    }
+  }
+
+  codec_finish(dst, out);
+  return true;
+}
+
+bool string_json_unescape(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    bool ok = string_json_unescape_n(dst, source->data, source->length);
+    string_destroy(source);
+    return ok;
+  }
+  return string_json_unescape_n(dst, src->data, src->length);
+}
+
+void string_html_escape_n(string **dst, const char *src, size_t length) {
+  codec_escape(dst, src, length, CODEC_HTML);
+}
+
+void string_html_escape(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    string_html_escape_n(dst, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_html_escape_n(dst, src->data, src->length);
+}
+
+// Decode the entity at src (which starts with '&') into out. Returns the
+// number of input bytes used, or 0 if the entity is not recognised.
+static size_t html_decode_entity(const char *src, size_t length, char *out,
+                                 size_t *out_len) {
+  static const struct {
+    const char *name;
+    char value;
+  } named[] = {{"&amp;", '&'},  {"&lt;", '<'},   {"&gt;", '>'},
+               {"&quot;", '"'}, {"&apos;", '\''}};
+
+  for (size_t k = 0; k < sizeof(named) / sizeof(named[0]); k++) {
+    size_t name_len = strlen(named[k].name);
+    if (name_len <= length && memcmp(src, named[k].name, name_len) == 0) {
+      *out = named[k].value;
+      *out_len = 1;
+      return name_len;
+    }
+  }
+
+  if (length < 4 || src[1] != '#') {
+    return 0;
+  }
+
+  // Numeric character reference: &#DDDD; or &#xHHHH;
+  bool hex = src[2] == 'x' || src[2] == 'X';
+  size_t i = hex ? 3 : 2;
+  size_t digits_start = i;
+  uint32_t cp = 0;
+  while (i < length && i - digits_start < 8) {
+    int digit = hex ? hex_value(src[i]) : (isdigit((unsigned char)src[i])
+                                              ? src[i] - '0'
+                                              : -1);
+    if (digit < 0) {
+      break;
+    }
+    cp = cp * (hex ? 16 : 10) + digit;
+    i++;
+  }
+
+  if (i == digits_start || i >= length || src[i] != ';' || cp == 0 ||
+      cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+    return 0;
+  }
+  *out_len = utf8_encode(cp, out);
+  return i + 1;
+}
+
+bool string_html_unescape_n(string **dst, const char *src, size_t length) {
+  char *out = codec_reserve(dst, length);
+  bool valid = true;
+
+  for (size_t i = 0; i < length;) {
+    const char *amp = memchr(src + i, '&', length - i);
+    size_t run = amp ? (size_t)(amp - (src + i)) : length - i;
+    memcpy(out, src + i, run);
+    out += run;
+    i += run;
+    if (i == length) {
+      break;
+    }
+
+    size_t out_len = 0;
+    size_t used = html_decode_entity(src + i, length - i, out, &out_len);
+    if (used == 0) {
+      // Unknown entities are kept as they are.
+      *out++ = '&';
+      i++;
+      valid = false;
+    } else {
+      out += out_len;
+      i += used;
+    }
+  }
+
+  codec_finish(dst, out);
+  return valid;
+}
+
+bool string_html_unescape(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    bool ok = string_html_unescape_n(dst, source->data, source->length);
+    string_destroy(source);
+    return ok;
+  }
+  return string_html_unescape_n(dst, src->data, src->length);
+}
+
+void string_url_encode_n(string **dst, const char *src, size_t length) {
+  codec_escape(dst, src, length, CODEC_URL);
+}
+
+void string_url_encode(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    string_url_encode_n(dst, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_url_encode_n(dst, src->data, src->length);
+}
+
+bool string_url_decode_n(string **dst, const char *src, size_t length) {
+  size_t original = (*dst)->length;
+  char *out = codec_reserve(dst, length);
+
+  for (size_t i = 0; i < length;) {
+    const char *percent = memchr(src + i, '%', length - i);
+    size_t run = percent ? (size_t)(percent - (src + i)) : length - i;
+    memcpy(out, src + i, run);
+    out += run;
+    i += run;
+    if (i == length) {
+      break;
+    }
+
+    long value = i + 3 <= length ? parse_hex(src + i + 1, 2) : -1;
+    if (value < 0) {
+      return codec_fail(dst, original);
+    }
+    *out++ = (char)value;
+    i += 3;
+  }
+
+  codec_finish(dst, out);
+  return true;
+}
+
+bool string_url_decode(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    bool ok = string_url_decode_n(dst, source->data, source->length);
+    string_destroy(source);
+    return ok;
+  }
+  return string_url_decode_n(dst, src->data, src->length);
+}
+
+/*
+Base64 and hex codecs.
+
+Output is written straight into the destination's capacity, which is sized
+once up front. Base64 runs 24 input bytes (encode) or 32 characters (decode)
+per step with AVX2 when the CPU supports it, 12 or 16 with SSSE3 otherwise,
+and finishes the tail with scalar code. A decode block containing anything
+outside the alphabet, including padding, drops to the scalar path, which
+either handles it or rejects the input. Hex uses SSE2 throughout.
+*/
+static const char base64_standard[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64_url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static const char *base64_table(string_base64_alphabet alphabet) {
+  return alphabet == STRING_BASE64_URL ? base64_url : base64_standard;
+}
+
+// The 6-bit value of c in the table, or -1 if c is not part of it.
+static int base64_value(const char *table, unsigned char c) {
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A';
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 26;
+  }
+  if (c >= '0' && c <= '9') {
+    return c - '0' + 52;
+  }
+  if (c == (unsigned char)table[62]) {
+    return 62;
+  }
+  if (c == (unsigned char)table[63]) {
+    return 63;
+  }
+  return -1;
+}
+
+#ifdef STRING_X86
+// Spread each 3-byte group over a 32-bit lane as [b1, b0, b2, b1], split it
+// into four 6-bit indices and map the indices to ASCII with one shuffle.
+__attribute__((target("ssse3"))) static __m128i
+base64_enc_ascii128(__m128i indices, const char *table) {
+  __m128i shift = _mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, table[62] - 62, table[63] - 63,
+      'A', 0, 0);
+  __m128i key = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+  __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+  key = _mm_or_si128(key, _mm_and_si128(upper, _mm_set1_epi8(13)));
+  return _mm_add_epi8(_mm_shuffle_epi8(shift, key), indices);
+}
+
+__attribute__((target("ssse3"))) static size_t
+base64_encode_ssse3(const unsigned char *src, size_t length, const char *table,
+                    char *out) {
+  const __m128i spread =
+      _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  size_t i = 0;
+  for (; i + 16 <= length; i += 12, out += 16) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+    in = _mm_shuffle_epi8(in, spread);
+    __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                                 _mm_set1_epi32(0x04000040));
+    __m128i lo =
+        _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                        _mm_set1_epi32(0x01000010));
+    _mm_storeu_si128((__m128i *)out,
+                     base64_enc_ascii128(_mm_or_si128(hi, lo), table));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+base64_encode_avx2(const unsigned char *src, size_t length, const char *table,
+                   char *out) {
+  const __m256i spread = _mm256_setr_epi8(
+      1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+      4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i shift = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, table[62] - 62, table[63] - 63,
+      'A', 0, 0, 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, table[62] - 62,
+      table[63] - 63, 'A', 0, 0);
+  size_t i = 0;
+  for (; i + 28 <= length; i += 24, out += 32) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + i))),
+        _mm_loadu_si128((const __m128i *)(src + i + 12)), 1);
+    in = _mm256_shuffle_epi8(in, spread);
+    __m256i hi =
+        _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                           _mm256_set1_epi32(0x04000040));
+    __m256i lo =
+        _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                           _mm256_set1_epi32(0x01000010));
+    __m256i indices = _mm256_or_si256(hi, lo);
+    __m256i key = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+    key = _mm256_or_si256(key, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i *)out,
+                        _mm256_add_epi8(_mm256_shuffle_epi8(shift, key),
+                                        indices));
+  }
+  return i;
+}
+
+// Map 16 characters to their 6-bit values. Returns false if any character is
+// outside the alphabet.
+__attribute__((target("ssse3"))) static bool
+base64_dec_values128(__m128i in, const char *table, __m128i *values) {
+  __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), in));
+  __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), in));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)),
+                                _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), in));
+  __m128i c62 = _mm_cmpeq_epi8(in, _mm_set1_epi8(table[62]));
+  __m128i c63 = _mm_cmpeq_epi8(in, _mm_set1_epi8(table[63]));
+  __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                               _mm_or_si128(digit, _mm_or_si128(c62, c63)));
+  if (_mm_movemask_epi8(valid) != 0xFFFF) {
+    return false;
+  }
+
+  __m128i offset = _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')),
+                   _mm_and_si128(lower, _mm_set1_epi8(26 - 'a'))),
+      _mm_or_si128(
+          _mm_and_si128(digit, _mm_set1_epi8(52 - '0')),
+          _mm_or_si128(_mm_and_si128(c62, _mm_set1_epi8(62 - table[62])),
+                       _mm_and_si128(c63, _mm_set1_epi8(63 - table[63])))));
+  *values = _mm_add_epi8(in, offset);
+  return true;
+}
+
+// Pack four 6-bit values per 32-bit lane into three bytes at the lane's
+// bottom, in output order.
+__attribute__((target("ssse3"))) static __m128i base64_dec_pack128(__m128i v) {
+  v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+  v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(
+      v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3"))) static size_t
+base64_decode_ssse3(const char *src, size_t length, const char *table,
+                    char *out, size_t *written) {
+  size_t i = 0;
+  *written = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i values;
+    if (!base64_dec_values128(_mm_loadu_si128((const __m128i *)(src + i)),
+                              table, &values)) {
+      break;
+    }
+    __m128i packed = base64_dec_pack128(values);
+    _mm_storel_epi64((__m128i *)(out + *written), packed);
+    uint32_t last = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+    memcpy(out + *written + 8, &last, 4);
+    *written += 12;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t
+base64_decode_avx2(const char *src, size_t length, const char *table,
+                   char *out, size_t *written) {
+  const __m256i pack_bytes = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4,
+      10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  size_t i = 0;
+  *written = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i upper =
+        _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+    __m256i lower =
+        _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+    __m256i digit =
+        _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+    __m256i c62 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(table[62]));
+    __m256i c63 = _mm256_cmpeq_epi8(in, _mm256_set1_epi8(table[63]));
+    __m256i valid =
+        _mm256_or_si256(_mm256_or_si256(upper, lower),
+                        _mm256_or_si256(digit, _mm256_or_si256(c62, c63)));
+    if (_mm256_movemask_epi8(valid) != -1) {
+      break;
+    }
+
+    __m256i offset = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')),
+                        _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a'))),
+        _mm256_or_si256(
+            _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')),
+            _mm256_or_si256(
+                _mm256_and_si256(c62, _mm256_set1_epi8(62 - table[62])),
+                _mm256_and_si256(c63, _mm256_set1_epi8(63 - table[63])))));
+    __m256i v = _mm256_add_epi8(in, offset);
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, pack_bytes);
+    // Move the 12 bytes of each lane next to each other.
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128((__m128i *)(out + *written), _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *)(out + *written + 16),
+                     _mm256_extracti128_si256(v, 1));
+    *written += 24;
+  }
+  return i;
+}
+#endif
+
+// Encode the whole 3-byte groups of src. Returns the number of bytes used.
+static size_t base64_encode_groups(const unsigned char *src, size_t length,
+                                   const char *table, char *out) {
+  size_t i = 0;
+#ifdef STRING_X86
+  if (__builtin_cpu_supports("avx2")) {
+    i = base64_encode_avx2(src, length, table, out);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    i = base64_encode_ssse3(src, length, table, out);
+  }
+  out += i / 3 * 4;
+#endif
+  for (; i + 3 <= length; i += 3, out += 4) {
+    uint32_t group = (uint32_t)src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+    out[0] = table[group >> 18];
+    out[1] = table[(group >> 12) & 63];
+    out[2] = table[(group >> 6) & 63];
+    out[3] = table[group & 63];
+  }
+  return i;
+}
+
+// Encode the final one or two bytes, padding for the standard alphabet.
+static size_t base64_encode_tail(const unsigned char *src, size_t length,
+                                 string_base64_alphabet alphabet, char *out) {
+  const char *table = base64_table(alphabet);
+  uint32_t group = (uint32_t)src[0] << 16 | (length > 1 ? src[1] << 8 : 0);
+  size_t n = 0;
+  out[n++] = table[group >> 18];
+  out[n++] = table[(group >> 12) & 63];
+  if (length > 1) {
+    out[n++] = table[(group >> 6) & 63];
+  }
+  if (alphabet == STRING_BASE64_STANDARD) {
+    while (n < 4) {
+      out[n++] = '=';
+    }
+  }
+  return n;
+}
+
+void string_base64_encode_n(string **dst, const void *src, size_t length,
+                            string_base64_alphabet alphabet) {
+  const unsigned char *bytes = src;
+  char *out = codec_reserve(dst, (length + 2) / 3 * 4);
+  size_t used = base64_encode_groups(bytes, length, base64_table(alphabet), out);
+  out += used / 3 * 4;
+  if (used < length) {
+    out += base64_encode_tail(bytes + used, length - used, alphabet, out);
+  }
+  codec_finish(dst, out);
+}
+
+void string_base64_encode(string **dst, const string *src,
+                          string_base64_alphabet alphabet) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    string_base64_encode_n(dst, source->data, source->length, alphabet);
+    string_destroy(source);
+    return;
+  }
+  string_base64_encode_n(dst, src->data, src->length, alphabet);
+}
+
+// Decode whole 4-character quanta of src into out. Padding may only end the
+// last quantum, and the bits it leaves unused must be zero. Sets *written to
+// the bytes produced and *padded if the last quantum was padded.
+static bool base64_decode_quanta(const char *src, size_t length,
+                                 const char *table, char *out, size_t *written,
+                                 bool *padded) {
+  size_t i = 0;
+  size_t n = 0;
+  *padded = false;
+#ifdef STRING_X86
+  if (__builtin_cpu_supports("avx2")) {
+    i = base64_decode_avx2(src, length, table, out, &n);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    i = base64_decode_ssse3(src, length, table, out, &n);
+  }
+#endif
+
+  for (; i < length; i += 4) {
+    int a = base64_value(table, src[i]);
+    int b = base64_value(table, src[i + 1]);
+    int c = base64_value(table, src[i + 2]);
+    int d = base64_value(table, src[i + 3]);
+    if (a < 0 || b < 0) {
+      return false;
+    }
+
+    if (c < 0 || d < 0) {
+      // Only "xx==" or "xxx=" at the very end.
+      bool two = src[i + 2] == '=' && src[i + 3] == '=' && (b & 15) == 0;
+      bool three = c >= 0 && src[i + 3] == '=' && (c & 3) == 0;
+      if (i + 4 != length || !(two || three)) {
+        return false;
+      }
+      out[n++] = a << 2 | b >> 4;
+      if (three) {
+        out[n++] = (b & 15) << 4 | c >> 2;
+      }
+      *padded = true;
+      break;
+    }
+
+    uint32_t group = a << 18 | b << 12 | c << 6 | d;
+    out[n++] = group >> 16;
+    out[n++] = group >> 8;
+    out[n++] = group;
+  }
+
+  *written = n;
+  return true;
+}
+
+// Decode an unpadded final quantum of two or three characters.
+static bool base64_decode_unpadded(const char *src, size_t length,
+                                   const char *table, char *out,
+                                   size_t *written) {
+  int a = base64_value(table, src[0]);
+  int b = length > 1 ? base64_value(table, src[1]) : -1;
+  int c = length > 2 ? base64_value(table, src[2]) : 0;
+  if (a < 0 || b < 0 || c < 0) {
+    return false;
+  }
+  if (length == 2 ? (b & 15) != 0 : (c & 3) != 0) {
+    return false;
+  }
+  out[0] = a << 2 | b >> 4;
+  if (length == 3) {
+    out[1] = (b & 15) << 4 | c >> 2;
+  }
+  *written = length - 1;
+  return true;
+}
+
+bool string_base64_decode_n(string **dst, const char *src, size_t length,
+                            string_base64_alphabet alphabet) {
+  const char *table = base64_table(alphabet);
+  size_t original = (*dst)->length;
+  size_t partial = length % 4;
+  if (partial == 1 || (partial && alphabet == STRING_BASE64_STANDARD)) {
+    return false;
+  }
+
+  char *out = codec_reserve(dst, length / 4 * 3 + 2);
+  size_t written;
+  bool padded;
+  if (!base64_decode_quanta(src, length - partial, table, out, &written,
+                            &padded)) {
+    return codec_fail(dst, original);
+  }
+  out += written;
+
+  if (partial) {
+    if (padded || !base64_decode_unpadded(src + length - partial, partial,
+                                          table, out, &written)) {
+      return codec_fail(dst, original);
+    }
+    out += written;
+  }
+
+  codec_finish(dst, out);
+  return true;
+}
+
+bool string_base64_decode(string **dst, const string *src,
+                          string_base64_alphabet alphabet) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    bool ok =
+        string_base64_decode_n(dst, source->data, source->length, alphabet);
+    string_destroy(source);
+    return ok;
+  }
+  return string_base64_decode_n(dst, src->data, src->length, alphabet);
+}
+
+void string_base64_stream_init(string_base64_stream *stream,
+                               string_base64_alphabet alphabet) {
+  stream->alphabet = alphabet;
+  stream->num_pending = 0;
+  stream->finished = false;
+}
+
+void string_base64_encode_update(string_base64_stream *stream, string **dst,
+                                 const void *src, size_t length) {
+  const unsigned char *bytes = src;
+  const char *table = base64_table(stream->alphabet);
+  char *out = codec_reserve(dst, (stream->num_pending + length) / 3 * 4);
+
+  // Complete the group left over from the previous chunk.
+  while (stream->num_pending > 0 && stream->num_pending < 3 && length > 0) {
+    stream->pending[stream->num_pending++] = *bytes++;
+    length--;
+  }
+  if (stream->num_pending == 3) {
+    out += base64_encode_groups((const unsigned char *)stream->pending, 3,
+                                table, out) / 3 * 4;
+    stream->num_pending = 0;
+  }
+
+  size_t used = base64_encode_groups(bytes, length, table, out);
+  out += used / 3 * 4;
+  memcpy(stream->pending, bytes + used, length - used);
+  stream->num_pending += length - used;
+  codec_finish(dst, out);
+}
+
+void string_base64_encode_final(string_base64_stream *stream, string **dst) {
+  if (stream->num_pending > 0) {
+    char *out = codec_reserve(dst, 4);
+    out += base64_encode_tail((const unsigned char *)stream->pending,
+                              stream->num_pending, stream->alphabet, out);
+    codec_finish(dst, out);
+  }
+  stream->num_pending = 0;
+}
+
+bool string_base64_decode_update(string_base64_stream *stream, string **dst,
+                                 const char *src, size_t length) {
+  const char *table = base64_table(stream->alphabet);
+  if (length == 0) {
+    return true;
+  }
+  if (stream->finished) {
+    return false; // Data after padding.
+  }
+
+  // A rejected chunk leaves the stream as it was for the next call.
+  string_base64_stream saved = *stream;
+  size_t original = (*dst)->length;
+  char *out = codec_reserve(dst, (stream->num_pending + length) / 4 * 3);
+  size_t written;
+
+  while (stream->num_pending > 0 && stream->num_pending < 4 && length > 0) {
+    stream->pending[stream->num_pending++] = *src++;
+    length--;
+  }
+  if (stream->num_pending == 4) {
+    if (!base64_decode_quanta(stream->pending, 4, table, out, &written,
+                              &stream->finished)) {
+      goto fail;
+    }
+    out += written;
+    stream->num_pending = 0;
+  }
+
+  size_t whole = length - length % 4;
+  if (whole > 0) {
+    if (stream->finished ||
+        !base64_decode_quanta(src, whole, table, out, &written,
+                              &stream->finished)) {
+      goto fail;
+    }
+    out += written;
+  }
+  if (length > whole && stream->finished) {
+    goto fail;
+  }
+  memcpy(stream->pending, src + whole, length - whole);
+  stream->num_pending += length - whole;
+
+  codec_finish(dst, out);
+  return true;
+
+fail:
+  *stream = saved;
+  return codec_fail(dst, original);
+}
+
+bool string_base64_decode_final(string_base64_stream *stream, string **dst) {
+  size_t pending = stream->num_pending;
+  stream->num_pending = 0;
+  if (pending == 0) {
+    return true;
+  }
+  if (pending == 1 || stream->alphabet == STRING_BASE64_STANDARD) {
+    return false;
+  }
+
+  char *out = codec_reserve(dst, 2);
+  size_t written;
+  if (!base64_decode_unpadded(stream->pending, pending,
+                              base64_table(stream->alphabet), out, &written)) {
+    return codec_fail(dst, (*dst)->length);
+  }
+  codec_finish(dst, out + written);
+  stream->finished = true;
+  return true;
+}
+
+void string_hex_encode_n(string **dst, const void *src, size_t length) {
+  const unsigned char *bytes = src;
+  char *out = codec_reserve(dst, length * 2);
+  size_t i = 0;
+
+#ifdef STRING_X86
+  for (; i + 16 <= length; i += 16, out += 32) {
+    __m128i in = _mm_loadu_si128((const __m128i *)(bytes + i));
+    __m128i mask = _mm_set1_epi8(15);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+    __m128i lo = _mm_and_si128(in, mask);
+    __m128i first = _mm_unpacklo_epi8(hi, lo);
+    __m128i second = _mm_unpackhi_epi8(hi, lo);
+
+    // '0' + n, plus the gap up to 'a' for n > 9.
+    __m128i nine = _mm_set1_epi8(9);
+    __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+    first = _mm_add_epi8(
+        _mm_add_epi8(first, _mm_set1_epi8('0')),
+        _mm_and_si128(_mm_cmpgt_epi8(first, nine), gap));
+    second = _mm_add_epi8(
+        _mm_add_epi8(second, _mm_set1_epi8('0')),
+        _mm_and_si128(_mm_cmpgt_epi8(second, nine), gap));
+    _mm_storeu_si128((__m128i *)out, first);
+    _mm_storeu_si128((__m128i *)(out + 16), second);
+  }
+#endif
+
+  static const char digits[] = "0123456789abcdef";
+  for (; i < length; i++) {
+    *out++ = digits[bytes[i] >> 4];
+    *out++ = digits[bytes[i] & 15];
+  }
+  codec_finish(dst, out);
+}
+
+void string_hex_encode(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    string_hex_encode_n(dst, source->data, source->length);
+    string_destroy(source);
+    return;
+  }
+  string_hex_encode_n(dst, src->data, src->length);
+}
+
+#ifdef STRING_X86
+// Map 16 hex digits to their values. Returns false on any other character.
+static bool hex_values128(__m128i in, __m128i *values) {
+  __m128i digit = _mm_sub_epi8(in, _mm_set1_epi8('0'));
+  __m128i is_digit = codec_in_range(in, '0', '9');
+  __m128i letter =
+      _mm_sub_epi8(_mm_or_si128(in, _mm_set1_epi8(0x20)), _mm_set1_epi8('a' - 10));
+  __m128i is_letter =
+      codec_in_range(_mm_or_si128(in, _mm_set1_epi8(0x20)), 'a', 'f');
+  if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xFFFF) {
+    return false;
+  }
+  *values = _mm_or_si128(_mm_and_si128(is_digit, digit),
+                         _mm_and_si128(is_letter, letter));
+  return true;
+}
+#endif
+
+bool string_hex_decode_n(string **dst, const char *src, size_t length) {
+  size_t original = (*dst)->length;
+  if (length % 2 != 0) {
+    return false;
+  }
+
+  char *out = codec_reserve(dst, length / 2);
+  size_t i = 0;
+
+#ifdef STRING_X86
+  for (; i + 32 <= length; i += 32, out += 16) {
+    __m128i first, second;
+    if (!hex_values128(_mm_loadu_si128((const __m128i *)(src + i)), &first) ||
+        !hex_values128(_mm_loadu_si128((const __m128i *)(src + i + 16)),
+                       &second)) {
+      return codec_fail(dst, original);
+    }
+    // Each 16-bit lane holds (high digit, low digit).
+    __m128i low_byte = _mm_set1_epi16(0xFF);
+    first = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(first, low_byte), 4),
+                         _mm_srli_epi16(first, 8));
+    second = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(second, low_byte), 4),
+                          _mm_srli_epi16(second, 8));
+    _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(first, second));
+  }
+#endif
+
+  for (; i < length; i += 2) {
+    int hi = hex_value(src[i]);
+    int lo = hex_value(src[i + 1]);
+    if (hi < 0 || lo < 0) {
+      return codec_fail(dst, original);
+    }
+    *out++ = hi << 4 | lo;
+  }
+
+  codec_finish(dst, out);
+  return true;
+}
+
+bool string_hex_decode(string **dst, const string *src) {
+  if (src == *dst) {
+    // Keep the source alive in case writing reallocates it.
+    string *source = string_share(src);
+    bool ok = string_hex_decode_n(dst, source->data, source->length);
+    string_destroy(source);
+    return ok;
+  }
+  return string_hex_decode_n(dst, src->data, src->length);
+}
+
+/*
+Vectored output.
+
+Strings are gathered into iovec batches of at most IOV_MAX entries and each
+batch is written with writev, resuming after partial writes. A string_writer
+can instead queue the batches on an io_uring as linked WRITEV requests, so
+one io_uring_enter flushes up to queue_depth batches in order. A short write
+breaks the link chain; the rest of that submission is then finished with
+writev. When io_uring is unavailable the writer uses writev throughout.
+*/
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Fill iov with the non-empty strings from strings[*next]. Returns the
+// number of entries used and the number of bytes they hold in *bytes.
+static size_t write_gather(string **strings, size_t count, size_t *next,
+                           struct iovec *iov, size_t max_iov, size_t *bytes) {
+  size_t n = 0;
+  *bytes = 0;
+  for (; *next < count && n < max_iov; (*next)++) {
+    string *str = strings[*next];
+    if (str->length > 0) {
+      iov[n].iov_base = str->data;
+      iov[n].iov_len = str->length;
+      *bytes += str->length;
+      n++;
+    }
+  }
+  return n;
+}
+
+// Skip the first `done` bytes of iov. Returns the new start of the array.
+static struct iovec *write_advance(struct iovec *iov, size_t *iovcnt,
+                                   size_t done) {
+  while (*iovcnt > 0 && done >= iov->iov_len) {
+    done -= iov->iov_len;
+    iov++;
+    (*iovcnt)--;
+  }
+  if (*iovcnt > 0) {
+    iov->iov_base = (char *)iov->iov_base + done;
+    iov->iov_len -= done;
+  }
+  return iov;
+}
+
+// Write all of iov, retrying on partial writes and EINTR. Modifies iov.
+static int write_iov_all(int fd, struct iovec *iov, size_t iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(fd, iov, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    iov = write_advance(iov, &iovcnt, written);
+  }
+  return 0;
+}
+
+ssize_t string_write_all(int fd, string **strings, size_t count) {
+  struct iovec iov[IOV_MAX];
+  size_t next = 0;
+  size_t total = 0;
+
+  while (next < count) {
+    size_t bytes;
+    size_t n = write_gather(strings, count, &next, iov, IOV_MAX, &bytes);
+    if (write_iov_all(fd, iov, n) < 0) {
+      return -1;
+    }
+    total += bytes;
+  }
+  return total;
+}
+
+#ifdef STRING_URING
+#define STRING_URING_MAX_DEPTH 64
+
+struct string_uring {
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map;
+  size_t sq_map_size;
+  void *cq_map;
+  size_t cq_map_size;
+  size_t sqes_size;
+  // Scratch for one submission, with one slot per request.
+  size_t *iovcnt;
+  size_t *bytes;
+  int *results;
+  struct iovec **iov_start;
+  struct iovec *iov; // Grown to the iovecs a submission actually needs.
+  size_t iov_capacity;
+};
+
+static void uring_free(struct string_uring *ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_map && ring->cq_map != ring->sq_map) {
+    munmap(ring->cq_map, ring->cq_map_size);
+  }
+  if (ring->sq_map) {
+    munmap(ring->sq_map, ring->sq_map_size);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  free(ring->iovcnt);
+  free(ring->bytes);
+  free(ring->results);
+  free(ring->iov_start);
+  free(ring->iov);
+  free(ring);
+}
+
+static struct string_uring *uring_create(unsigned entries) {
+  struct string_uring *ring = calloc(1, sizeof(struct string_uring));
+  if (!ring) {
+    return NULL;
+  }
+
+  if (entries > STRING_URING_MAX_DEPTH) {
+    entries = STRING_URING_MAX_DEPTH;
+  }
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+  ring->entries = params.sq_entries;
+
+  ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_map_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size) {
+      ring->sq_map_size = ring->cq_map_size;
+    }
+  }
+
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_map == MAP_FAILED) {
+    ring->sq_map = NULL;
+    uring_free(ring);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_map = ring->sq_map;
+  } else {
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_map == MAP_FAILED) {
+      ring->cq_map = NULL;
+      uring_free(ring);
+      return NULL;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    uring_free(ring);
+    return NULL;
+  }
+
+  ring->iovcnt = malloc(ring->entries * sizeof(size_t));
+  ring->bytes = malloc(ring->entries * sizeof(size_t));
+  ring->results = malloc(ring->entries * sizeof(int));
+  ring->iov_start = malloc(ring->entries * sizeof(struct iovec *));
+  if (!ring->iovcnt || !ring->bytes || !ring->results || !ring->iov_start) {
+    uring_free(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return ring;
+}
+
+// Submit `count` linked WRITEV requests and wait for all of them. Stores
+// each request's result in ring->results. Returns false if the ring failed.
+static bool uring_write(struct string_uring *ring, int fd, unsigned count) {
+  const size_t *iovcnt = ring->iovcnt;
+  int *results = ring->results;
+  unsigned tail = *ring->sq_tail;
+  unsigned mask = *ring->sq_mask;
+  for (unsigned k = 0; k < count; k++, tail++) {
+    unsigned index = tail & mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)ring->iov_start[k];
+    sqe->len = iovcnt[k];
+    sqe->off = (uint64_t)-1; // Current file position.
+    sqe->flags = k + 1 < count ? IOSQE_IO_LINK : 0;
+    sqe->user_data = k;
+    ring->sq_array[index] = index;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned to_submit = count;
+  unsigned completed = 0;
+  while (completed < count) {
+    long ret = syscall(__NR_io_uring_enter, ring->fd, to_submit,
+                       count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if ((unsigned)ret != to_submit) {
+      return false;
+    }
+    to_submit = 0;
+
+    unsigned head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      results[cqe->user_data] = cqe->res;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+// Make room for n iovecs in the ring's scratch array.
+static bool uring_reserve_iov(struct string_uring *ring, size_t n) {
+  if (n <= ring->iov_capacity) {
+    return true;
+  }
+  struct iovec *iov = realloc(ring->iov, n * sizeof(struct iovec));
+  if (!iov) {
+    return false;
+  }
+  ring->iov = iov;
+  ring->iov_capacity = n;
+  return true;
+}
+
+static ssize_t writer_write_uring(string_writer *writer, string **strings,
+                                  size_t count) {
+  struct string_uring *ring = writer->ring;
+  size_t *iovcnt = ring->iovcnt;
+  size_t *bytes = ring->bytes;
+  int *results = ring->results;
+  size_t next = 0;
+  size_t total = 0;
+
+  while (next < count) {
+    // Each string takes at most one iovec.
+    size_t want = count - next;
+    if (want > (size_t)ring->entries * IOV_MAX) {
+      want = (size_t)ring->entries * IOV_MAX;
+    }
+    if (!uring_reserve_iov(ring, want)) {
+      errno = ENOMEM;
+      return -1;
+    }
+
+    unsigned requests = 0;
+    size_t used = 0;
+    while (next < count && requests < ring->entries && used < want) {
+      size_t room = want - used < IOV_MAX ? want - used : IOV_MAX;
+      ring->iov_start[requests] = ring->iov + used;
+      iovcnt[requests] = write_gather(strings, count, &next, ring->iov + used,
+                                      room, &bytes[requests]);
+      used += iovcnt[requests];
+      if (iovcnt[requests] > 0) {
+        requests++;
+      }
+    }
+    if (requests == 0) {
+      break;
+    }
+
+    if (!uring_write(ring, writer->fd, requests)) {
+      // The ring is in an unknown state: stop using it. Nothing from this
+      // submission is known to be written, so fail rather than guess.
+      uring_free(ring);
+      writer->ring = NULL;
+      errno = EIO;
+      return -1;
+    }
+
+    // Finish with writev from the first request that fell short.
+    for (unsigned k = 0; k < requests; k++) {
+      int res = results[k];
+      if (res >= 0 && (size_t)res == bytes[k]) {
+        continue;
+      }
+      if (res < 0 && res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+        errno = -res;
+        return -1;
+      }
+
+      size_t n = iovcnt[k];
+      struct iovec *iov =
+          write_advance(ring->iov_start[k], &n, res > 0 ? res : 0);
+      if (write_iov_all(writer->fd, iov, n) < 0) {
+        return -1;
+      }
+      for (unsigned j = k + 1; j < requests; j++) {
+        if (write_iov_all(writer->fd, ring->iov_start[j], iovcnt[j]) < 0) {
+          return -1;
+        }
+      }
+      break;
+    }
+
+    for (unsigned k = 0; k < requests; k++) {
+      total += bytes[k];
+    }
+  }
+  return total;
+}
+#endif
+
+void string_writer_init(string_writer *writer, int fd, unsigned queue_depth) {
+  writer->fd = fd;
+  writer->ring = NULL;
+#ifdef STRING_URING
+  if (queue_depth > 0) {
+    writer->ring = uring_create(queue_depth);
+  }
+#else
+  (void)queue_depth;
+#endif
+}
+
+bool string_writer_uses_uring(const string_writer *writer) {
+  return writer->ring != NULL;
+}
+
+ssize_t string_writer_write(string_writer *writer, string **strings,
+                            size_t count) {
+#ifdef STRING_URING
+  if (writer->ring) {
+    return writer_write_uring(writer, strings, count);
+  }
+#endif
+  return string_write_all(writer->fd, strings, count);
+}
+
+void string_writer_destroy(string_writer *writer) {
+#ifdef STRING_URING
+  if (writer->ring) {
+    uring_free(writer->ring);
+  }
+#endif
+  writer->ring = NULL;
+}
+
+/*
+Compressed cold strings.
+
+Values are compressed in the LZ4 block format: a greedy single-pass matcher
+with a 4096-entry hash table, 64 KiB window and 4-byte minimum match. That
+trades some ratio for compression and decompression speeds in the GB/s
+range. The decoder checks every length and offset, so corrupt data is
+rejected rather than overrunning buffers. Values that do not shrink stay
+uncompressed.
+*/
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12 // A match may not start in the last 12 bytes.
+#define LZ4_HASH_BITS 12
+#define LZ4_MAX_OFFSET 65535
+
+static _Atomic uint64_t cold_compressions;
+static _Atomic uint64_t cold_rejected;
+static _Atomic uint64_t cold_decompressions;
+static _Atomic uint64_t cold_compress_ns;
+static _Atomic uint64_t cold_decompress_ns;
+static _Atomic uint64_t cold_original_bytes;
+static _Atomic uint64_t cold_compressed_bytes;
+
+static uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// CPU time consumed by the calling thread.
+static uint64_t thread_cpu_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t lz4_read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, 4);
+  return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length extension (a run of 255s and a final byte) for length,
+// which has already had 15 taken off. Returns NULL if it does not fit.
+static unsigned char *lz4_write_length(unsigned char *op,
+                                       const unsigned char *end,
+                                       size_t length) {
+  for (; length >= 255; length -= 255) {
+    if (op == end) {
+      return NULL;
+    }
+    *op++ = 255;
+  }
+  if (op == end) {
+    return NULL;
+  }
+  *op++ = length;
+  return op;
+}
+
+// Emit one sequence: literals followed by a match (match_len 0 for the
+// final, literal-only sequence). Returns NULL if it does not fit.
+static unsigned char *lz4_write_sequence(unsigned char *op,
+                                         const unsigned char *end,
+                                         const unsigned char *literals,
+                                         size_t literal_len, size_t offset,
+                                         size_t match_len) {
+  if (op == end) {
+    return NULL;
+  }
+  unsigned char *token = op++;
+  *token = (literal_len >= 15 ? 15 : literal_len) << 4;
+  if (literal_len >= 15 && !(op = lz4_write_length(op, end, literal_len - 15))) {
+    return NULL;
+  }
+  if ((size_t)(end - op) < literal_len) {
+    return NULL;
+  }
+  memcpy(op, literals, literal_len);
+  op += literal_len;
+
+  if (match_len == 0) {
+    return op;
+  }
+  if (end - op < 2) {
+    return NULL;
+  }
+  *op++ = offset & 0xFF;
+  *op++ = offset >> 8;
+  size_t extra = match_len - LZ4_MIN_MATCH;
+  *token |= extra >= 15 ? 15 : extra;
+  if (extra >= 15) {
+    op = lz4_write_length(op, end, extra - 15);
+  }
+  return op;
+}
+
+// Compress src into dst. Returns the compressed length, or 0 if it would
+// exceed capacity.
+static size_t lz4_compress(const unsigned char *src, size_t length,
+                           unsigned char *dst, size_t capacity) {
+  uint32_t table[1 << LZ4_HASH_BITS] = {0};
+  const unsigned char *end = dst + capacity;
+  unsigned char *op = dst;
+  size_t anchor = 0;
+
+  if (length > LZ4_MATCH_LIMIT) {
+    size_t limit = length - LZ4_MATCH_LIMIT;
+    size_t match_end_limit = length - LZ4_LAST_LITERALS;
+    size_t ip = 0;
+
+    while (ip < limit) {
+      uint32_t sequence = lz4_read32(src + ip);
+      uint32_t h = lz4_hash(sequence);
+      size_t candidate = table[h];
+      table[h] = ip;
+
+      if (candidate >= ip || ip - candidate > LZ4_MAX_OFFSET ||
+          lz4_read32(src + candidate) != sequence) {
+        // Skip faster through data that is not matching.
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && candidate > 0 &&
+             src[ip - 1] == src[candidate - 1]) {
+        ip--;
+        candidate--;
+      }
+      size_t match_len = LZ4_MIN_MATCH;
+      while (ip + match_len < match_end_limit &&
+             src[candidate + match_len] == src[ip + match_len]) {
+        match_len++;
+      }
+
+      op = lz4_write_sequence(op, end, src + anchor, ip - anchor,
+                              ip - candidate, match_len);
+      if (!op) {
+        return 0;
+      }
+      ip += match_len;
+      anchor = ip;
+      if (ip < limit) {
+        table[lz4_hash(lz4_read32(src + ip - 2))] = ip - 2;
+      }
+    }
+  }
+
+  op = lz4_write_sequence(op, end, src + anchor, length - anchor, 0, 0);
+  return op ? (size_t)(op - dst) : 0;
+}
+
+// Read a length extension. Returns false if it runs past the input.
+static bool lz4_read_length(const unsigned char **ip, const unsigned char *end,
+                            size_t *length) {
+  unsigned char byte;
+  do {
+    if (*ip == end) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Decompress exactly length bytes into dst. Returns false on corrupt input.
+static bool lz4_decompress(const unsigned char *src, size_t src_len,
+                           unsigned char *dst, size_t length) {
+  const unsigned char *ip = src;
+  const unsigned char *ip_end = src + src_len;
+  unsigned char *op = dst;
+  unsigned char *op_end = dst + length;
+
+  while (ip < ip_end) {
+    unsigned token = *ip++;
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !lz4_read_length(&ip, ip_end, &literal_len)) {
+      return false;
+    }
+    if ((size_t)(ip_end - ip) < literal_len ||
+        (size_t)(op_end - op) < literal_len) {
+      return false;
+    }
+    memcpy(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+    if (ip == ip_end) {
+      break; // The last sequence has no match.
+    }
+
+    if (ip_end - ip < 2) {
+      return false;
+    }
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !lz4_read_length(&ip, ip_end, &match_len)) {
+      return false;
+    }
+    match_len += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) ||
+        (size_t)(op_end - op) < match_len) {
+      return false;
+    }
+
+    const unsigned char *match = op - offset;
+    if (offset >= match_len) {
+      memcpy(op, match, match_len);
+      op += match_len;
+    } else {
+      // Overlapping copy repeats the last `offset` bytes.
+      for (size_t i = 0; i < match_len; i++) {
+        *op++ = match[i];
+      }
+    }
+  }
+  return op == op_end;
+}
+
+// Length of the value, which may have changed in place while uncompressed.
+static size_t cold_length(const string_cold *cold) {
+  return cold->compressed ? cold->length : cold->value->length;
+}
+
+void string_cold_init(string_cold *cold, string *value) {
+  cold->value = value;
+  cold->compressed = NULL;
+  cold->compressed_length = 0;
+  cold->length = value->length;
+  cold->last_access = monotonic_ns();
+}
+
+bool string_cold_compress(string_cold *cold) {
+  if (cold->compressed) {
+    return true;
+  }
+  // Others would keep the value alive, so compressing saves nothing.
+  if (string_is_shared(cold->value) || cold->value->refcount == 0 ||
+      cold->value->length == 0) {
+    return false;
+  }
+
+  cold->length = cold->value->length;
+  uint64_t start = thread_cpu_ns();
+  unsigned char *buffer = malloc(cold->length);
+  if (!buffer) {
+    perror("malloc");
+    return false;
+  }
+  size_t compressed_len = lz4_compress((unsigned char *)cold->value->data,
+                                       cold->length, buffer, cold->length - 1);
+  atomic_fetch_add_explicit(&cold_compress_ns, thread_cpu_ns() - start,
+                            memory_order_relaxed);
+  if (compressed_len == 0) {
+    free(buffer);
+    atomic_fetch_add_explicit(&cold_rejected, 1, memory_order_relaxed);
+    return false;
+  }
+
+  unsigned char *shrunk = realloc(buffer, compressed_len);
+  cold->compressed = shrunk ? shrunk : buffer;
+  cold->compressed_length = compressed_len;
+  string_destroy(cold->value);
+  cold->value = NULL;
+
+  atomic_fetch_add_explicit(&cold_compressions, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&cold_original_bytes, cold->length,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&cold_compressed_bytes, compressed_len,
+                            memory_order_relaxed);
+  return true;
+}
+
+bool string_cold_is_compressed(const string_cold *cold) {
+  return cold->compressed != NULL;
+}
+
+// Drop the compressed copy and account for it.
+static void cold_release(string_cold *cold) {
+  atomic_fetch_sub_explicit(&cold_original_bytes, cold->length,
+                            memory_order_relaxed);
+  atomic_fetch_sub_explicit(&cold_compressed_bytes, cold->compressed_length,
+                            memory_order_relaxed);
+  free(cold->compressed);
+  cold->compressed = NULL;
+  cold->compressed_length = 0;
+}
+
+const string *string_cold_get(string_cold *cold) {
+  cold->last_access = monotonic_ns();
+  if (!cold->compressed) {
+    return cold->value;
+  }
+
+  uint64_t start = thread_cpu_ns();
+  string *value = string_block_alloc(cold->length + 1);
+  if (!value) {
+    printf("string_cold_get(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!lz4_decompress(cold->compressed, cold->compressed_length,
+                      (unsigned char *)value->data, cold->length)) {
+    printf("string_cold_get(): corrupt compressed data\n");
+    exit(EXIT_FAILURE);
+  }
+  value->data[cold->length] = '\0';
+  value->length = cold->length;
+  atomic_fetch_add_explicit(&cold_decompress_ns, thread_cpu_ns() - start,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&cold_decompressions, 1, memory_order_relaxed);
+
+  cold_release(cold);
+  cold->value = value;
+  return value;
+}
+
+bool string_cold_read(const string_cold *cold, char *scratch, size_t size) {
+  if (size < cold_length(cold) + 1) {
+    return false;
+  }
+  if (!cold->compressed) {
+    memcpy(scratch, cold->value->data, cold->value->length + 1);
+    return true;
+  }
+
+  uint64_t start = thread_cpu_ns();
+  if (!lz4_decompress(cold->compressed, cold->compressed_length,
+                      (unsigned char *)scratch, cold->length)) {
+    printf("string_cold_read(): corrupt compressed data\n");
+    exit(EXIT_FAILURE);
+  }
+  scratch[cold->length] = '\0';
+  atomic_fetch_add_explicit(&cold_decompress_ns, thread_cpu_ns() - start,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&cold_decompressions, 1, memory_order_relaxed);
+  return true;
+}
+
+size_t string_cold_footprint(const string_cold *cold) {
+  return cold->compressed ? cold->compressed_length
+                          : sizeof(string) + cold->value->capacity;
+}
+
+size_t string_cold_sweep(string_cold items[], size_t count,
+                         const string_cold_policy *policy) {
+  uint64_t now = monotonic_ns();
+  uint64_t idle_ns = policy->idle_seconds * 1e9;
+  size_t compressed = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    string_cold *cold = &items[i];
+    if (cold->compressed || cold->value->length < policy->min_length ||
+        now - cold->last_access < idle_ns) {
+      continue;
+    }
+    if (policy->should_compress &&
+        !policy->should_compress(cold, policy->user_data)) {
+      continue;
+    }
+    compressed += string_cold_compress(cold);
+  }
+  return compressed;
+}
+
+void string_cold_destroy(string_cold *cold) {
+  if (cold->compressed) {
+    cold_release(cold);
+  } else if (cold->value) {
+    string_destroy(cold->value);
+  }
+  cold->value = NULL;
+}
+
+void string_cold_stats_get(string_cold_stats *stats) {
+  stats->compressions = atomic_load(&cold_compressions);
+  stats->rejected = atomic_load(&cold_rejected);
+  stats->decompressions = atomic_load(&cold_decompressions);
+  stats->compress_ns = atomic_load(&cold_compress_ns);
+  stats->decompress_ns = atomic_load(&cold_decompress_ns);
+  stats->original_bytes = atomic_load(&cold_original_bytes);
+  stats->compressed_bytes = atomic_load(&cold_compressed_bytes);
+}
+
+void string_cold_stats_reset(void) {
+  atomic_store(&cold_compressions, 0);
+  atomic_store(&cold_rejected, 0);
+  atomic_store(&cold_decompressions, 0);
+  atomic_store(&cold_compress_ns, 0);
+  atomic_store(&cold_decompress_ns, 0);
+}
+
+/*
+Suffix array and FM-index.
+
+The suffix array is built with SA-IS over the text plus a sentinel, so row 0
+is always the empty suffix. Pattern queries binary-search it, comparing
+against the text.
+
+The FM-index stores the Burrows-Wheeler transform in a wavelet matrix: eight
+bit vectors (one per bit of the byte, most significant first) with a rank
+directory every 512 bits. Every STRING_INDEX_SAMPLE_RATE-th text position is
+sampled so that locate walks at most that many LF steps per occurrence. The
+whole structure takes about 1.3 bytes per text byte and does not need the
+text.
+*/
+#define STRING_INDEX_SAMPLE_RATE 32
+#define SAIS_EMPTY UINT32_MAX
+
+// Symbol i of the input: bytes shifted up by one with a 0 sentinel at the
+// end at the top level, names in the recursion.
+#define SAIS_SYMBOL(i)                                                         \
+  (s32 ? s32[i] : (i) == n - 1 ? 0 : (uint32_t)s8[i] + 1)
+#define SAIS_IS_LMS(i) ((i) > 0 && types[i] && !types[(i) - 1])
+
+static void sais_buckets(const unsigned char *s8, const uint32_t *s32,
+                         size_t n, size_t k, uint32_t *buckets, bool ends) {
+  memset(buckets, 0, k * sizeof(uint32_t));
+  for (size_t i = 0; i < n; i++) {
+    buckets[SAIS_SYMBOL(i)]++;
+  }
+  uint32_t sum = 0;
+  for (size_t c = 0; c < k; c++) {
+    sum += buckets[c];
+    buckets[c] = ends ? sum : sum - buckets[c];
+  }
+}
+
+static void sais_induce(const unsigned char *s8, const uint32_t *s32,
+                        const unsigned char *types, uint32_t *sa, size_t n,
+                        size_t k, uint32_t *buckets) {
+  sais_buckets(s8, s32, n, k, buckets, false);
+  for (size_t i = 0; i < n; i++) {
+    if (sa[i] != SAIS_EMPTY && sa[i] > 0 && !types[sa[i] - 1]) {
+      size_t j = sa[i] - 1;
+      sa[buckets[SAIS_SYMBOL(j)]++] = j;
+    }
+  }
+  sais_buckets(s8, s32, n, k, buckets, true);
+  for (size_t i = n; i-- > 0;) {
+    if (sa[i] != SAIS_EMPTY && sa[i] > 0 && types[sa[i] - 1]) {
+      size_t j = sa[i] - 1;
+      sa[--buckets[SAIS_SYMBOL(j)]] = j;
+    }
+  }
+}
+
+// Suffix array of a string of n symbols in [0, k) whose last symbol is a
+// unique 0. Exactly one of s8 and s32 is set.
+static void sais(const unsigned char *s8, const uint32_t *s32, uint32_t *sa,
+                 size_t n, size_t k) {
+  unsigned char *types = malloc(n); // 1 for S-type suffixes.
+  uint32_t *buckets = malloc(k * sizeof(uint32_t));
+  if (!types || !buckets) {
+    printf("string_index_build(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  types[n - 1] = 1;
+  for (size_t i = n - 1; i-- > 0;) {
+    uint32_t a = SAIS_SYMBOL(i);
+    uint32_t b = SAIS_SYMBOL(i + 1);
+    types[i] = a < b || (a == b && types[i + 1]);
+  }
+
+  // Sort the LMS substrings.
+  sais_buckets(s8, s32, n, k, buckets, true);
+  for (size_t i = 0; i < n; i++) {
+    sa[i] = SAIS_EMPTY;
+  }
+  for (size_t i = 1; i < n; i++) {
+    if (SAIS_IS_LMS(i)) {
+      sa[--buckets[SAIS_SYMBOL(i)]] = i;
+    }
+  }
+  sais_induce(s8, s32, types, sa, n, k, buckets);
+
+  // Name them, storing names at sa[n1 + pos / 2].
+  size_t n1 = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (SAIS_IS_LMS(sa[i])) {
+      sa[n1++] = sa[i];
+    }
+  }
+  for (size_t i = n1; i < n; i++) {
+    sa[i] = SAIS_EMPTY;
+  }
+  size_t names = 0;
+  size_t prev = SAIS_EMPTY;
+  for (size_t i = 0; i < n1; i++) {
+    size_t pos = sa[i];
+    bool differ = prev == SAIS_EMPTY;
+    for (size_t d = 0; !differ; d++) {
+      if (SAIS_SYMBOL(pos + d) != SAIS_SYMBOL(prev + d) ||
+          types[pos + d] != types[prev + d]) {
+        differ = true;
+      } else if (d > 0 && (SAIS_IS_LMS(pos + d) || SAIS_IS_LMS(prev + d))) {
+        break;
+      }
+    }
+    if (differ) {
+      names++;
+      prev = pos;
+    }
+    sa[n1 + pos / 2] = names - 1;
+  }
+  for (size_t i = n, j = n; i-- > n1;) {
+    if (sa[i] != SAIS_EMPTY) {
+      sa[--j] = sa[i];
+    }
+  }
+
+  // Sort the reduced string, recursing if names repeat.
+  uint32_t *s1 = sa + n - n1;
+  if (names < n1) {
+    sais(NULL, s1, sa, n1, names);
+  } else {
+    for (size_t i = 0; i < n1; i++) {
+      sa[s1[i]] = i;
+    }
+  }
+
+  // Induce the full order from the sorted LMS suffixes.
+  for (size_t i = 1, j = 0; i < n; i++) {
+    if (SAIS_IS_LMS(i)) {
+      s1[j++] = i;
+    }
+  }
+  for (size_t i = 0; i < n1; i++) {
+    sa[i] = s1[sa[i]];
+  }
+  for (size_t i = n1; i < n; i++) {
+    sa[i] = SAIS_EMPTY;
+  }
+  sais_buckets(s8, s32, n, k, buckets, true);
+  for (size_t i = n1; i-- > 0;) {
+    size_t j = sa[i];
+    sa[i] = SAIS_EMPTY;
+    sa[--buckets[SAIS_SYMBOL(j)]] = j;
+  }
+  sais_induce(s8, s32, types, sa, n, k, buckets);
+
+  free(buckets);
+  free(types);
+}
+
+// Bit vector with a rank directory of one counter per 512 bits.
+typedef struct rank_bits {
+  uint64_t *words;
+  uint64_t *blocks;
+  size_t num_words;
+} rank_bits;
+
+static void rank_bits_alloc(rank_bits *bits, size_t size) {
+  bits->num_words = size / 64 + 1;
+  bits->words = calloc(bits->num_words, sizeof(uint64_t));
+  bits->blocks = calloc(bits->num_words / 8 + 1, sizeof(uint64_t));
+  if (!bits->words || !bits->blocks) {
+    printf("string_index: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void rank_bits_finish(rank_bits *bits) {
+  uint64_t total = 0;
+  for (size_t w = 0; w < bits->num_words; w++) {
+    if (w % 8 == 0) {
+      bits->blocks[w / 8] = total;
+    }
+    total += __builtin_popcountll(bits->words[w]);
+  }
+}
+
+static bool rank_bits_get(const rank_bits *bits, size_t i) {
+  return bits->words[i / 64] >> (i % 64) & 1;
+}
+
+// Number of set bits before position i.
+static size_t rank_bits_rank(const rank_bits *bits, size_t i) {
+  size_t w = i / 64;
+  size_t count = bits->blocks[w / 8];
+  for (size_t k = w & ~(size_t)7; k < w; k++) {
+    count += __builtin_popcountll(bits->words[k]);
+  }
+  return count + __builtin_popcountll(bits->words[w] &
+                                      (((uint64_t)1 << (i % 64)) - 1));
+}
+
+static void rank_bits_free(rank_bits *bits) {
+  free(bits->words);
+  free(bits->blocks);
+}
+
+struct string_fm {
+  size_t rows;            // Text length plus one for the sentinel.
+  size_t primary;         // Row whose BWT symbol is the sentinel.
+  size_t counts[257];     // Rows sorting before each byte value.
+  size_t zeros[8];        // Zero bits at each wavelet level.
+  rank_bits levels[8];    // Wavelet matrix over the BWT.
+  rank_bits sampled;      // Rows whose text position is sampled.
+  uint32_t *samples;      // Text positions of sampled rows, in row order.
+  size_t num_samples;
+};
+
+// Occurrences of byte c in BWT rows [0, i).
+static size_t fm_rank(const struct string_fm *fm, unsigned char c, size_t i) {
+  size_t start = 0;
+  size_t end = i;
+  for (int level = 0; level < 8; level++) {
+    const rank_bits *bits = &fm->levels[level];
+    if (c >> (7 - level) & 1) {
+      start = fm->zeros[level] + rank_bits_rank(bits, start);
+      end = fm->zeros[level] + rank_bits_rank(bits, end);
+    } else {
+      start -= rank_bits_rank(bits, start);
+      end -= rank_bits_rank(bits, end);
+    }
+  }
+  // The sentinel is stored as a 0 byte.
+  return end - start - (c == 0 && fm->primary < i);
+}
+
+// BWT symbol of row i.
+static unsigned char fm_symbol(const struct string_fm *fm, size_t i) {
+  unsigned char c = 0;
+  for (int level = 0; level < 8; level++) {
+    const rank_bits *bits = &fm->levels[level];
+    bool bit = rank_bits_get(bits, i);
+    c = c << 1 | bit;
+    i = bit ? fm->zeros[level] + rank_bits_rank(bits, i)
+            : i - rank_bits_rank(bits, i);
+  }
+  return c;
+}
+
+// Step from row i to the row of the suffix one position earlier.
+static size_t fm_lf(const struct string_fm *fm, size_t i) {
+  unsigned char c = fm_symbol(fm, i);
+  return fm->counts[c] + fm_rank(fm, c, i);
+}
+
+static size_t fm_locate(const struct string_fm *fm, size_t row) {
+  size_t steps = 0;
+  while (!rank_bits_get(&fm->sampled, row)) {
+    if (++steps == STRING_INDEX_SAMPLE_RATE) {
+      return fm->rows - 1; // Only a corrupt index gets here.
+    }
+    row = fm_lf(fm, row);
+  }
+  return fm->samples[rank_bits_rank(&fm->sampled, row)] + steps;
+}
+
+static struct string_fm *fm_alloc(size_t rows) {
+  struct string_fm *fm = calloc(1, sizeof(struct string_fm));
+  if (!fm) {
+    printf("string_index: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  fm->rows = rows;
+  for (int level = 0; level < 8; level++) {
+    rank_bits_alloc(&fm->levels[level], rows);
+  }
+  rank_bits_alloc(&fm->sampled, rows);
+  return fm;
+}
+
+static struct string_fm *fm_build(const unsigned char *text, size_t length,
+                                  const uint32_t *sa) {
+  size_t rows = length + 1;
+  struct string_fm *fm = fm_alloc(rows);
+  unsigned char *bwt = malloc(rows);
+  unsigned char *next = malloc(rows);
+  if (!bwt || !next) {
+    printf("string_index_build(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  size_t histogram[256] = {0};
+  for (size_t i = 0; i < length; i++) {
+    histogram[text[i]]++;
+  }
+  fm->counts[0] = 1;
+  for (int c = 0; c < 256; c++) {
+    fm->counts[c + 1] = fm->counts[c] + histogram[c];
+  }
+
+  for (size_t r = 0; r < rows; r++) {
+    if (sa[r] == 0) {
+      fm->primary = r;
+      bwt[r] = 0;
+    } else {
+      bwt[r] = text[sa[r] - 1];
+    }
+    if (sa[r] % STRING_INDEX_SAMPLE_RATE == 0) {
+      fm->sampled.words[r / 64] |= (uint64_t)1 << (r % 64);
+      fm->num_samples++;
+    }
+  }
+  rank_bits_finish(&fm->sampled);
+
+  fm->samples = malloc(fm->num_samples * sizeof(uint32_t));
+  if (!fm->samples) {
+    printf("string_index_build(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t r = 0, k = 0; r < rows; r++) {
+    if (sa[r] % STRING_INDEX_SAMPLE_RATE == 0) {
+      fm->samples[k++] = sa[r];
+    }
+  }
+
+  // Each level stably moves the zero bits of the current symbols first.
+  for (int level = 0; level < 8; level++) {
+    rank_bits *bits = &fm->levels[level];
+    size_t zeros = 0;
+    for (size_t r = 0; r < rows; r++) {
+      if (bwt[r] >> (7 - level) & 1) {
+        bits->words[r / 64] |= (uint64_t)1 << (r % 64);
+      } else {
+        zeros++;
+      }
+    }
+    rank_bits_finish(bits);
+    fm->zeros[level] = zeros;
+
+    size_t zero_pos = 0;
+    size_t one_pos = zeros;
+    for (size_t r = 0; r < rows; r++) {
+      next[bwt[r] >> (7 - level) & 1 ? one_pos++ : zero_pos++] = bwt[r];
+    }
+    unsigned char *tmp = bwt;
+    bwt = next;
+    next = tmp;
+  }
+
+  free(next);
+  free(bwt);
+  return fm;
+}
+
+static void fm_free(struct string_fm *fm) {
+  for (int level = 0; level < 8; level++) {
+    rank_bits_free(&fm->levels[level]);
+  }
+  rank_bits_free(&fm->sampled);
+  free(fm->samples);
+  free(fm);
+}
+
+/*
+Find-first keeps the smallest text position of every block of
+STRING_INDEX_RMQ_BLOCK rows, and a sparse table over the minima of
+superblocks of STRING_INDEX_RMQ_BLOCK blocks. A query reads O(1) table
+entries, at most two partial superblocks of block minima and at most two
+partial blocks of rows, however many rows the pattern matches. The minima
+take 4 bytes per block, about an eighth of a byte per text byte with the
+sparse table.
+*/
+#define STRING_INDEX_RMQ_BLOCK 32
+
+struct string_rmq {
+  size_t num_blocks;
+  uint32_t *block_min; // Smallest text position in each block of rows.
+  size_t num_super;
+  size_t levels;
+  uint32_t *table;     // Level j holds minima of 2^j superblocks.
+};
+
+static struct string_rmq *rmq_alloc(size_t rows) {
+  struct string_rmq *rmq = calloc(1, sizeof(struct string_rmq));
+  if (!rmq) {
+    printf("string_index: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  rmq->num_blocks = (rows + STRING_INDEX_RMQ_BLOCK - 1) / STRING_INDEX_RMQ_BLOCK;
+  rmq->block_min = malloc(rmq->num_blocks * sizeof(uint32_t));
+  if (!rmq->block_min) {
+    printf("string_index: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return rmq;
+}
+
+// Build the sparse table once block_min is filled in.
+static void rmq_finish(struct string_rmq *rmq) {
+  size_t n = (rmq->num_blocks + STRING_INDEX_RMQ_BLOCK - 1) /
+             STRING_INDEX_RMQ_BLOCK;
+  rmq->num_super = n;
+  rmq->levels = 1;
+  while ((size_t)1 << rmq->levels <= n) {
+    rmq->levels++;
+  }
+  rmq->table = malloc(rmq->levels * n * sizeof(uint32_t));
+  if (!rmq->table) {
+    printf("string_index: memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < n; i++) {
+    uint32_t best = UINT32_MAX;
+    size_t end = (i + 1) * STRING_INDEX_RMQ_BLOCK;
+    for (size_t b = i * STRING_INDEX_RMQ_BLOCK; b < end && b < rmq->num_blocks;
+         b++) {
+      if (rmq->block_min[b] < best) {
+        best = rmq->block_min[b];
+      }
+    }
+    rmq->table[i] = best;
+  }
+  for (size_t j = 1; j < rmq->levels; j++) {
+    const uint32_t *prev = rmq->table + (j - 1) * n;
+    uint32_t *level = rmq->table + j * n;
+    size_t half = (size_t)1 << (j - 1);
+    for (size_t i = 0; i + 2 * half <= n; i++) {
+      level[i] = prev[i] < prev[i + half] ? prev[i] : prev[i + half];
+    }
+  }
+}
+
+// Smallest block minimum over blocks [first, last), first < last.
+static size_t rmq_blocks(const struct string_rmq *rmq, size_t first,
+                         size_t last) {
+  size_t lo = (first + STRING_INDEX_RMQ_BLOCK - 1) / STRING_INDEX_RMQ_BLOCK;
+  size_t hi = last / STRING_INDEX_RMQ_BLOCK;
+  size_t best = SIZE_MAX;
+  if (lo >= hi) {
+    lo = hi = last;
+  } else {
+    size_t j = 63 - __builtin_clzll(hi - lo);
+    const uint32_t *level = rmq->table + j * rmq->num_super;
+    best = level[lo];
+    if (level[hi - ((size_t)1 << j)] < best) {
+      best = level[hi - ((size_t)1 << j)];
+    }
+    lo *= STRING_INDEX_RMQ_BLOCK;
+    hi *= STRING_INDEX_RMQ_BLOCK;
+  }
+  for (size_t b = first; b < lo; b++) {
+    if (rmq->block_min[b] < best) {
+      best = rmq->block_min[b];
+    }
+  }
+  for (size_t b = hi; b < last; b++) {
+    if (rmq->block_min[b] < best) {
+      best = rmq->block_min[b];
+    }
+  }
+  return best;
+}
+
+static void rmq_free(struct string_rmq *rmq) {
+  free(rmq->block_min);
+  free(rmq->table);
+  free(rmq);
+}
+
+bool string_index_build(string_index *index, const string *text,
+                        unsigned parts) {
+  index->text = NULL;
+  index->length = text->length;
+  index->sa = NULL;
+  index->fm = NULL;
+  index->rmq = NULL;
+  if (text->length >= UINT32_MAX || !(parts & STRING_INDEX_ALL)) {
+    return false;
+  }
+
+  size_t rows = text->length + 1;
+  uint32_t *sa = malloc(rows * sizeof(uint32_t));
+  if (!sa) {
+    perror("malloc");
+    return false;
+  }
+  if (rows == 1) {
+    sa[0] = 0; // SA-IS needs at least one character before the sentinel.
+  } else {
+    sais((const unsigned char *)text->data, NULL, sa, rows, 257);
+  }
+
+  index->rmq = rmq_alloc(rows);
+  for (size_t b = 0; b < index->rmq->num_blocks; b++) {
+    index->rmq->block_min[b] = UINT32_MAX;
+  }
+  for (size_t r = 0; r < rows; r++) {
+    uint32_t *min = &index->rmq->block_min[r / STRING_INDEX_RMQ_BLOCK];
+    if (sa[r] < *min) {
+      *min = sa[r];
+    }
+  }
+  rmq_finish(index->rmq);
+
+  if (parts & STRING_INDEX_FM) {
+    index->fm = fm_build((const unsigned char *)text->data, text->length, sa);
+  }
+  if (parts & STRING_INDEX_SUFFIX_ARRAY) {
+    index->text = string_share(text);
+    index->sa = sa;
+  } else {
+    free(sa);
+  }
+  return true;
+}
+
+// Compare the suffix at pos with the pattern, treating a suffix that has the
+// pattern as a prefix as equal.
+static int index_compare(const string_index *index, size_t pos,
+                         const char *pattern, size_t length) {
+  size_t available = index->length - pos;
+  size_t n = available < length ? available : length;
+  int cmp = memcmp(index->text->data + pos, pattern, n);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return available < length ? -1 : 0;
+}
+
+// Find the rows [*first, *last) whose suffixes start with the pattern.
+static void index_range(const string_index *index, const char *pattern,
+                        size_t length, size_t *first, size_t *last) {
+  size_t rows = index->length + 1;
+  if (index->sa) {
+    size_t lo = 0;
+    size_t hi = rows;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index_compare(index, index->sa[mid], pattern, length) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    *first = lo;
+    hi = rows;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index_compare(index, index->sa[mid], pattern, length) <= 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    *last = lo;
+    return;
+  }
+
+  // Backward search.
+  const struct string_fm *fm = index->fm;
+  size_t lo = 0;
+  size_t hi = rows;
+  for (size_t k = length; k-- > 0 && lo < hi;) {
+    unsigned char c = pattern[k];
+    lo = fm->counts[c] + fm_rank(fm, c, lo);
+    hi = fm->counts[c] + fm_rank(fm, c, hi);
+  }
+  *first = lo;
+  *last = lo < hi ? hi : lo;
+}
+
+static size_t index_position(const string_index *index, size_t row) {
+  return index->sa ? index->sa[row] : fm_locate(index->fm, row);
+}
+
+size_t string_index_count(const string_index *index, const char *pattern,
+                          size_t length) {
+  size_t first, last;
+  index_range(index, pattern, length, &first, &last);
+  return last - first;
+}
+
+ssize_t string_index_find(const string_index *index, const char *pattern,
+                          size_t length) {
+  size_t first, last;
+  index_range(index, pattern, length, &first, &last);
+  if (first == last) {
+    return -1;
+  }
+  // Whole blocks come from the range minima; only the rows of the partial
+  // blocks at either end are located one by one.
+  size_t lo = (first + STRING_INDEX_RMQ_BLOCK - 1) / STRING_INDEX_RMQ_BLOCK;
+  size_t hi = last / STRING_INDEX_RMQ_BLOCK;
+  size_t best = SIZE_MAX;
+  if (lo >= hi) {
+    lo = hi = last;
+  } else {
+    best = rmq_blocks(index->rmq, lo, hi);
+    lo *= STRING_INDEX_RMQ_BLOCK;
+    hi *= STRING_INDEX_RMQ_BLOCK;
+  }
+  for (size_t row = first; row < lo; row++) {
+    size_t pos = index_position(index, row);
+    if (pos < best) {
+      best = pos;
+    }
+  }
+  for (size_t row = hi; row < last; row++) {
+    size_t pos = index_position(index, row);
+    if (pos < best) {
+      best = pos;
+    }
+  }
+  return best;
+}
+
+static int compare_positions(const void *a, const void *b) {
+  size_t x = *(const size_t *)a;
+  size_t y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+size_t string_index_locate(const string_index *index, const char *pattern,
+                           size_t length, size_t positions[],
+                           size_t max_positions) {
+  size_t first, last;
+  index_range(index, pattern, length, &first, &last);
+  size_t count = last - first;
+  size_t n = count < max_positions ? count : max_positions;
+  for (size_t k = 0; k < n; k++) {
+    positions[k] = index_position(index, first + k);
+  }
+  qsort(positions, n, sizeof(size_t), compare_positions);
+  return count;
+}
+
+/*
+Index files start with a fixed header followed by the parts that are
+present, in native byte order: the text and suffix array, then the FM-index
+fields and bit vectors, then the block minima used by find.
+*/
+#define STRING_INDEX_MAGIC "STRIDX02"
+
+typedef struct index_header {
+  char magic[8];
+  uint64_t parts;
+  uint64_t length;
+  uint64_t sample_rate;
+} index_header;
+
+static bool index_write(FILE *file, const void *data, size_t size) {
+  return fwrite(data, 1, size, file) == size;
+}
+
+static bool index_read(FILE *file, void *data, size_t size) {
+  return fread(data, 1, size, file) == size;
+}
+
+static bool rank_bits_write(FILE *file, const rank_bits *bits) {
+  return index_write(file, bits->words, bits->num_words * sizeof(uint64_t));
+}
+
+static bool rank_bits_read(FILE *file, rank_bits *bits) {
+  if (!index_read(file, bits->words, bits->num_words * sizeof(uint64_t))) {
+    return false;
+  }
+  rank_bits_finish(bits);
+  return true;
+}
+
+bool string_index_save(const string_index *index, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  index_header header = {STRING_INDEX_MAGIC,
+                         (index->sa ? STRING_INDEX_SUFFIX_ARRAY : 0) |
+                             (index->fm ? STRING_INDEX_FM : 0),
+                         index->length, STRING_INDEX_SAMPLE_RATE};
+  bool ok = index_write(file, &header, sizeof(header));
+  size_t rows = index->length + 1;
+  if (ok && index->sa) {
+    ok = index_write(file, index->text->data, index->length) &&
+         index_write(file, index->sa, rows * sizeof(uint32_t));
+  }
+  if (ok && index->fm) {
+    const struct string_fm *fm = index->fm;
+    uint64_t primary = fm->primary;
+    uint64_t num_samples = fm->num_samples;
+    ok = index_write(file, &primary, sizeof(primary)) &&
+         index_write(file, &num_samples, sizeof(num_samples)) &&
+         index_write(file, fm->counts, sizeof(fm->counts)) &&
+         index_write(file, fm->zeros, sizeof(fm->zeros)) &&
+         rank_bits_write(file, &fm->sampled) &&
+         index_write(file, fm->samples, fm->num_samples * sizeof(uint32_t));
+    for (int level = 0; ok && level < 8; level++) {
+      ok = rank_bits_write(file, &fm->levels[level]);
+    }
+  }
+  if (ok) {
+    ok = index_write(file, index->rmq->block_min,
+                     index->rmq->num_blocks * sizeof(uint32_t));
+  }
+
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+  return ok;
+}
+
+bool string_index_load(string_index *index, const char *path) {
+  index->text = NULL;
+  index->sa = NULL;
+  index->fm = NULL;
+  index->rmq = NULL;
+  index->length = 0;
+
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror("fopen");
+    return false;
+  }
+
+  index_header header;
+  bool ok = index_read(file, &header, sizeof(header)) &&
+            memcmp(header.magic, STRING_INDEX_MAGIC, 8) == 0 &&
+            header.sample_rate == STRING_INDEX_SAMPLE_RATE &&
+            header.length < UINT32_MAX && (header.parts & STRING_INDEX_ALL) &&
+            !(header.parts & ~(uint64_t)STRING_INDEX_ALL);
+  size_t rows = header.length + 1;
+  if (ok) {
+    index->length = header.length;
+  }
+
+  if (ok && (header.parts & STRING_INDEX_SUFFIX_ARRAY)) {
+    string *text = string_block_alloc(header.length + 1);
+    index->sa = malloc(rows * sizeof(uint32_t));
+    if (!text || !index->sa) {
+      printf("string_index_load(): memory allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    text->length = header.length;
+    text->data[header.length] = '\0';
+    index->text = text;
+    ok = index_read(file, text->data, header.length) &&
+         index_read(file, index->sa, rows * sizeof(uint32_t));
+    for (size_t r = 0; ok && r < rows; r++) {
+      ok = index->sa[r] < rows;
+    }
+  }
+
+  if (ok && (header.parts & STRING_INDEX_FM)) {
+    struct string_fm *fm = fm_alloc(rows);
+    index->fm = fm;
+    uint64_t primary, num_samples;
+    ok = index_read(file, &primary, sizeof(primary)) &&
+         index_read(file, &num_samples, sizeof(num_samples)) &&
+         primary < rows && num_samples <= rows &&
+         index_read(file, fm->counts, sizeof(fm->counts)) &&
+         index_read(file, fm->zeros, sizeof(fm->zeros)) &&
+         rank_bits_read(file, &fm->sampled);
+    if (ok) {
+      fm->primary = primary;
+      fm->num_samples = num_samples;
+      fm->samples = malloc(num_samples * sizeof(uint32_t) + 1);
+      ok = fm->samples &&
+           index_read(file, fm->samples, num_samples * sizeof(uint32_t)) &&
+           rank_bits_rank(&fm->sampled, rows) == num_samples;
+    }
+    for (size_t k = 0; ok && k < num_samples; k++) {
+      ok = fm->samples[k] < rows &&
+           fm->samples[k] % STRING_INDEX_SAMPLE_RATE == 0;
+    }
+    for (int level = 0; ok && level < 8; level++) {
+      ok = rank_bits_read(file, &fm->levels[level]) &&
+           rank_bits_rank(&fm->levels[level], rows) + fm->zeros[level] == rows;
+    }
+    // With the sentinel in the primary row and per-symbol totals matching
+    // the counts, LF always lands inside [0, rows).
+    ok = ok && fm->counts[0] == 1 && fm->counts[256] == rows &&
+         fm_symbol(fm, primary) == 0;
+    for (int c = 0; ok && c < 256; c++) {
+      ok = fm->counts[c] <= fm->counts[c + 1] &&
+           fm->counts[c] + fm_rank(fm, c, rows) == fm->counts[c + 1];
+    }
+  }
+
+  if (ok) {
+    index->rmq = rmq_alloc(rows);
+    ok = index_read(file, index->rmq->block_min,
+                    index->rmq->num_blocks * sizeof(uint32_t));
+    for (size_t b = 0; ok && b < index->rmq->num_blocks; b++) {
+      ok = index->rmq->block_min[b] < rows;
+    }
+    if (ok) {
+      rmq_finish(index->rmq);
+    }
+  }
+
+  if (fgetc(file) != EOF) {
+    ok = false; // Trailing data: not a file this code wrote.
+  }
+  fclose(file);
+  if (!ok) {
+    string_index_destroy(index);
+  }
+  return ok;
+}
+
+size_t string_index_memory(const string_index *index) {
+  size_t rows = index->length + 1;
+  size_t total = 0;
+  if (index->sa) {
+    total += index->length + rows * sizeof(uint32_t);
+  }
+  if (index->fm) {
+    const struct string_fm *fm = index->fm;
+    size_t words = rows / 64 + 1;
+    size_t bits = words * sizeof(uint64_t) + (words / 8 + 1) * sizeof(uint64_t);
+    total += sizeof(*fm) + 9 * bits + fm->num_samples * sizeof(uint32_t);
+  }
+  if (index->rmq) {
+    const struct string_rmq *rmq = index->rmq;
+    total += sizeof(*rmq) + rmq->num_blocks * sizeof(uint32_t) +
+             rmq->levels * rmq->num_super * sizeof(uint32_t);
+  }
+  return total;
+}
+
+void string_index_destroy(string_index *index) {
+  if (index->text) {
+    string_destroy(index->text);
+  }
+  free(index->sa);
+  if (index->fm) {
+    fm_free(index->fm);
+  }
+  if (index->rmq) {
+    rmq_free(index->rmq);
+  }
+  index->text = NULL;
+  index->sa = NULL;
+  index->fm = NULL;
+  index->rmq = NULL;
+}
+
+/*
+Precompiled needle search.
+
+The algorithm is picked once from the needle length: memchr for a single
+byte; for needles up to STRING_FINDER_SHORT bytes, a packed compare of the
+needle's first and last bytes against 32 (AVX2) or 16 (SSE2) positions at a
+time, verifying candidates with memcmp; and Boyer-Moore-Horspool with
+precomputed shift tables for longer needles, where skips of up to the needle
+length pay off.
+*/
+#define STRING_FINDER_SHORT 32
+
+void string_finder_init(string_finder *finder, const char *needle,
+                        size_t length) {
+  finder->needle = malloc(length + 1);
+  if (!finder->needle) {
+    printf("string_finder_init(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(finder->needle, needle, length);
+  finder->needle[length] = '\0';
+  finder->length = length;
+  finder->shift = NULL;
+  finder->rshift = NULL;
+
+  if (length <= STRING_FINDER_SHORT) {
+    return;
+  }
+
+  finder->shift = malloc(256 * sizeof(size_t));
+  finder->rshift = malloc(256 * sizeof(size_t));
+  if (!finder->shift || !finder->rshift) {
+    printf("string_finder_init(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int c = 0; c < 256; c++) {
+    finder->shift[c] = length;
+    finder->rshift[c] = length;
+  }
+  // Distance from the last occurrence (excluding the final byte) to the end,
+  // and from the start to the first occurrence (excluding the first byte).
+  for (size_t i = 0; i + 1 < length; i++) {
+    finder->shift[(unsigned char)needle[i]] = length - 1 - i;
+  }
+  for (size_t i = length - 1; i > 0; i--) {
+    finder->rshift[(unsigned char)needle[i]] = i;
+  }
+}
+
+#ifdef STRING_X86
+__attribute__((target("avx2"))) static ssize_t
+finder_find_avx2(const char *haystack, size_t length, const char *needle,
+                 size_t m, size_t *resume) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= length; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(haystack + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(haystack + i + m - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (memcmp(haystack + pos, needle, m) == 0) {
+        return pos;
+      }
+    }
+  }
+  *resume = i;
+  return -1;
+}
+
+__attribute__((target("avx2"))) static ssize_t
+finder_rfind_avx2(const char *haystack, size_t length, const char *needle,
+                  size_t m, size_t *resume) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  // Candidate starts are [0, end); blocks cover [end - 32, end).
+  size_t end = length - m + 1;
+  for (; end >= 32; end -= 32) {
+    size_t i = end - 32;
+    __m256i a = _mm256_loadu_si256((const __m256i *)(haystack + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(haystack + i + m - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(haystack + i + bit, needle, m) == 0) {
+        return i + bit;
+      }
+      mask &= ~((uint32_t)1 << bit);
+    }
+  }
+  *resume = end;
+  return -1;
+}
+
+static ssize_t finder_find_sse2(const char *haystack, size_t length,
+                                const char *needle, size_t m, size_t *resume) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= length; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (memcmp(haystack + pos, needle, m) == 0) {
+        return pos;
+      }
+    }
+  }
+  *resume = i;
+  return -1;
+}
+
+static ssize_t finder_rfind_sse2(const char *haystack, size_t length,
+                                 const char *needle, size_t m,
+                                 size_t *resume) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t end = length - m + 1;
+  for (; end >= 16; end -= 16) {
+    size_t i = end - 16;
+    __m128i a = _mm_loadu_si128((const __m128i *)(haystack + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(haystack + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = 31 - __builtin_clz(mask);
+      if (memcmp(haystack + i + bit, needle, m) == 0) {
+        return i + bit;
+      }
+      mask &= ~(1u << bit);
+    }
+  }
+  *resume = end;
+  return -1;
+}
+#endif
+
+ssize_t string_finder_find_n(const string_finder *finder, const char *haystack,
+                             size_t length) {
+  const char *needle = finder->needle;
+  size_t m = finder->length;
+  if (m == 0) {
+    return 0;
+  }
+  if (m > length) {
+    return -1;
+  }
+  if (m == 1) {
+    const char *found = memchr(haystack, needle[0], length);
+    return found ? found - haystack : -1;
+  }
+
+  if (finder->shift) {
+    size_t i = 0;
+    unsigned char tail = needle[m - 1];
+    while (i + m <= length) {
+      unsigned char c = haystack[i + m - 1];
+      if (c == tail && memcmp(haystack + i, needle, m - 1) == 0) {
+        return i;
+      }
+      i += finder->shift[c];
+    }
+    return -1;
+  }
+
+  size_t i = 0;
+#ifdef STRING_X86
+  ssize_t found = __builtin_cpu_supports("avx2")
+                      ? finder_find_avx2(haystack, length, needle, m, &i)
+                      : finder_find_sse2(haystack, length, needle, m, &i);
+  if (found >= 0) {
+    return found;
+  }
+#endif
+  const char *rest = string_memmem(haystack + i, length - i, needle, m);
+  return rest ? rest - haystack : -1;
+}
+
+ssize_t string_finder_find(const string_finder *finder,
+                           const string *haystack) {
+  return string_finder_find_n(finder, haystack->data, haystack->length);
+}
+
+ssize_t string_finder_rfind_n(const string_finder *finder,
+                              const char *haystack, size_t length) {
+  const char *needle = finder->needle;
+  size_t m = finder->length;
+  if (m == 0) {
+    return length;
+  }
+  if (m > length) {
+    return -1;
+  }
+
+  if (finder->shift) {
+    size_t i = length - m;
+    unsigned char head = needle[0];
+    for (;;) {
+      unsigned char c = haystack[i];
+      if (c == head && memcmp(haystack + i + 1, needle + 1, m - 1) == 0) {
+        return i;
+      }
+      if (i < finder->rshift[c]) {
+        return -1;
+      }
+      i -= finder->rshift[c];
+    }
+  }
+
+  // Candidate starts left to check, scanning down from end - 1.
+  size_t end = length - m + 1;
+#ifdef STRING_X86
+  ssize_t found = __builtin_cpu_supports("avx2")
+                      ? finder_rfind_avx2(haystack, length, needle, m, &end)
+                      : finder_rfind_sse2(haystack, length, needle, m, &end);
+  if (found >= 0) {
+    return found;
+  }
+#endif
+  while (end-- > 0) {
+    if (haystack[end] == needle[0] &&
+        memcmp(haystack + end, needle, m) == 0) {
+      return end;
+    }
+  }
+  return -1;
+}
+
+ssize_t string_finder_rfind(const string_finder *finder,
+                            const string *haystack) {
+  return string_finder_rfind_n(finder, haystack->data, haystack->length);
+}
+
+size_t string_finder_find_all_n(const string_finder *finder,
+                                const char *haystack, size_t length,
+                                size_t positions[], size_t max_positions) {
+  size_t count = 0;
+  size_t step = finder->length ? finder->length : 1;
+  size_t start = 0;
+  while (start <= length) {
+    ssize_t found =
+        string_finder_find_n(finder, haystack + start, length - start);
+    if (found < 0) {
+      break;
+    }
+    if (count < max_positions) {
+      positions[count] = start + found;
+    }
+    count++;
+    start += found + step;
+  }
+  return count;
+}
+
+size_t string_finder_find_all(const string_finder *finder,
+                              const string *haystack, size_t positions[],
+                              size_t max_positions) {
+  return string_finder_find_all_n(finder, haystack->data, haystack->length,
+                                  positions, max_positions);
+}
+
+void string_finder_destroy(string_finder *finder) {
+  free(finder->needle);
+  free(finder->shift);
+  free(finder->rshift);
+  finder->needle = NULL;
+  finder->shift = NULL;
+  finder->rshift = NULL;
+}
+
+/*
+Memory-mapped string tables.
+
+A table file is laid out so that it can be used in place once mapped:
+
+  header   (fixed size, see table_header)
+  offsets  uint64_t per entry: file offset of the entry
+  entries  string headers with refcount 0 (static), each followed by its
+           bytes and a terminating null, padded to 8 bytes
+  buckets  optional open-addressing hash index: uint64_t per bucket holding
+           entry index + 1, or 0 when empty
+
+Since entries are complete static strings, views into the mapping can be
+passed to any function taking a const string *. Everything after the header
+is covered by a checksum, which string_table_open checks on request; the
+cheap structural checks are always done. Files are written to a temporary
+name and renamed into place, so readers never map a partial file.
+*/
+#define STRING_TABLE_MAGIC "STRTABLE"
+#define STRING_TABLE_VERSION 1
+#define STRING_TABLE_BYTE_ORDER 0x01020304u
+
+typedef struct table_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;  // STRING_TABLE_BYTE_ORDER as written.
+  uint32_t word_size;   // sizeof(size_t) as written.
+  uint32_t header_size; // sizeof(string) as written.
+  uint64_t count;
+  uint64_t num_buckets; // 0 without a hash index.
+  uint64_t offsets_offset;
+  uint64_t buckets_offset;
+  uint64_t file_size;
+  uint64_t checksum; // Of bytes [sizeof(table_header), file_size).
+} table_header;
+
+static size_t table_align(size_t offset) {
+  return (offset + 7) & ~(size_t)7;
+}
+
+static uint64_t table_hash(const char *key, size_t length) {
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (size_t i = 0; i < length; i++) {
+    h = (h ^ (unsigned char)key[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+// Word-at-a-time checksum; length is a multiple of 8.
+static uint64_t table_checksum(const unsigned char *data, size_t length) {
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ (word * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+bool string_table_write(const char *path, const string *strings[],
+                        size_t count, bool hash_index) {
+  size_t path_len = strlen(path);
+  char *tmp_path = malloc(path_len + 5);
+  if (!tmp_path) {
+    perror("malloc");
+    return false;
+  }
+  memcpy(tmp_path, path, path_len);
+  memcpy(tmp_path + path_len, ".tmp", 5);
+
+  FILE *file = fopen(tmp_path, "wb+");
+  if (!file) {
+    perror("fopen");
+    free(tmp_path);
+    return false;
+  }
+
+  table_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STRING_TABLE_MAGIC, 8);
+  header.version = STRING_TABLE_VERSION;
+  header.byte_order = STRING_TABLE_BYTE_ORDER;
+  header.word_size = sizeof(size_t);
+  header.header_size = sizeof(string);
+  header.count = count;
+  header.offsets_offset = sizeof(table_header);
+
+  // Offsets, then entries.
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  uint64_t offset = table_align(header.offsets_offset + count * 8);
+  for (size_t i = 0; ok && i < count; i++) {
+    ok = fwrite(&offset, 8, 1, file) == 1;
+    offset += table_align(sizeof(string) + strings[i]->length + 1);
+  }
+  static const char padding[8] = {0};
+  size_t pad = table_align(header.offsets_offset + count * 8) -
+               (header.offsets_offset + count * 8);
+  ok = ok && fwrite(padding, 1, pad, file) == pad;
+
+  for (size_t i = 0; ok && i < count; i++) {
+    string entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.length = strings[i]->length;
+    entry.capacity = strings[i]->length + 1;
+    atomic_init(&entry.refcount, 0);
+    size_t size = sizeof(string) + entry.length + 1;
+    pad = table_align(size) - size + 1; // Terminator plus padding.
+    ok = fwrite(&entry, sizeof(entry), 1, file) == 1 &&
+         fwrite(strings[i]->data, 1, entry.length, file) == entry.length &&
+         fwrite(padding, 1, pad, file) == pad;
+  }
+
+  if (ok && hash_index) {
+    size_t buckets = 16;
+    while (buckets < count * 2) {
+      buckets *= 2;
+    }
+    uint64_t *table = calloc(buckets, sizeof(uint64_t));
+    if (!table) {
+      perror("calloc");
+      ok = false;
+    } else {
+      for (size_t i = 0; i < count; i++) {
+        size_t b = table_hash(strings[i]->data, strings[i]->length) &
+                   (buckets - 1);
+        while (table[b]) {
+          b = (b + 1) & (buckets - 1);
+        }
+        table[b] = i + 1;
+      }
+      header.num_buckets = buckets;
+      header.buckets_offset = offset;
+      ok = fwrite(table, sizeof(uint64_t), buckets, file) == buckets;
+      offset += buckets * sizeof(uint64_t);
+      free(table);
+    }
+  }
+  header.file_size = offset;
+
+  // Checksum what was written, then fill in the header.
+  ok = ok && fflush(file) == 0;
+  if (ok) {
+    void *map = mmap(NULL, offset, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (map == MAP_FAILED) {
+      ok = false;
+    } else {
+      header.checksum = table_checksum(
+          (const unsigned char *)map + sizeof(table_header),
+          offset - sizeof(table_header));
+      munmap(map, offset);
+    }
+  }
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, file) == 1;
+  if (fclose(file) != 0) {
+    ok = false;
+  }
+
+  if (ok && rename(tmp_path, path) != 0) {
+    perror("rename");
+    ok = false;
+  }
+  if (!ok) {
+    remove(tmp_path);
+  }
+  free(tmp_path);
+  return ok;
+}
+
+// Check the header and that every section lies within the file.
+static bool table_check_header(const table_header *header, size_t file_size) {
+  if (file_size < sizeof(table_header) ||
+      memcmp(header->magic, STRING_TABLE_MAGIC, 8) != 0 ||
+      header->version != STRING_TABLE_VERSION ||
+      header->byte_order != STRING_TABLE_BYTE_ORDER ||
+      header->word_size != sizeof(size_t) ||
+      header->header_size != sizeof(string) ||
+      header->file_size != file_size || file_size % 8 != 0) {
+    return false;
+  }
+  uint64_t max_entries = (file_size - sizeof(table_header)) / 8;
+  if (header->count > max_entries ||
+      header->offsets_offset != sizeof(table_header)) {
+    return false;
+  }
+  if (header->num_buckets) {
+    return (header->num_buckets & (header->num_buckets - 1)) == 0 &&
+           header->num_buckets > header->count &&
+           header->num_buckets <= max_entries &&
+           header->buckets_offset % 8 == 0 &&
+           header->buckets_offset <= file_size &&
+           header->num_buckets * 8 == file_size - header->buckets_offset;
+  }
+  return true;
+}
+
+// Entry index if it lies within the entries section, otherwise NULL. Files
+// opened without verify may be corrupt, so every access goes through this.
+static const string *table_entry(const string_table *table, size_t index) {
+  const table_header *header = table->map;
+  uint64_t entries_end = header->num_buckets ? header->buckets_offset
+                                             : header->file_size;
+  uint64_t entries_start =
+      table_align(header->offsets_offset + header->count * 8);
+  uint64_t offset = table->offsets[index];
+  // Room for the string header and at least the terminating null.
+  if (offset % 8 != 0 || offset < entries_start || offset >= entries_end ||
+      entries_end - offset <= sizeof(string)) {
+    return NULL;
+  }
+  const string *entry = (const string *)((const char *)table->map + offset);
+  if (entry->length >= entries_end - offset - sizeof(string) ||
+      entry->data[entry->length] != '\0' || entry->refcount != 0) {
+    return NULL;
+  }
+  return entry;
+}
+
+// Check every entry and bucket. Used when verifying.
+static bool table_check_entries(const string_table *table) {
+  for (size_t i = 0; i < table->count; i++) {
+    if (!table_entry(table, i)) {
+      return false;
+    }
+  }
+  for (size_t b = 0; b < table->num_buckets; b++) {
+    if (table->buckets[b] > table->count) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool string_table_open(string_table *table, const char *path, bool verify) {
+  memset(table, 0, sizeof(*table));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(table_header)) {
+    close(fd);
+    return false;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+
+  const table_header *header = map;
+  table->map = map;
+  table->map_size = st.st_size;
+  if (!table_check_header(header, st.st_size)) {
+    string_table_close(table);
+    return false;
+  }
+  table->count = header->count;
+  table->offsets =
+      (const uint64_t *)((const char *)map + header->offsets_offset);
+  table->num_buckets = header->num_buckets;
+  table->buckets =
+      header->num_buckets
+          ? (const uint64_t *)((const char *)map + header->buckets_offset)
+          : NULL;
+
+  if (verify &&
+      (table_checksum((const unsigned char *)map + sizeof(table_header),
+                      st.st_size - sizeof(table_header)) != header->checksum ||
+       !table_check_entries(table))) {
+    string_table_close(table);
+    return false;
+  }
+  return true;
+}
+
+const string *string_table_get(const string_table *table, size_t index) {
+  if (index >= table->count) {
+    return NULL;
+  }
+  return table_entry(table, index);
+}
+
+ssize_t string_table_find(const string_table *table, const char *key,
+                          size_t length) {
+  if (!table->buckets) {
+    return -1;
+  }
+  // At most num_buckets probes, in case a corrupt index has no empty bucket.
+  size_t mask = table->num_buckets - 1;
+  size_t b = table_hash(key, length) & mask;
+  for (size_t probe = 0; probe < table->num_buckets && table->buckets[b];
+       probe++, b = (b + 1) & mask) {
+    const string *entry = string_table_get(table, table->buckets[b] - 1);
+    if (entry && entry->length == length &&
+        memcmp(entry->data, key, length) == 0) {
+      return table->buckets[b] - 1;
+    }
+  }
+  return -1;
+}
+
+void string_table_close(string_table *table) {
+  if (table->map) {
+    munmap((void *)table->map, table->map_size);
+  }
+  memset(table, 0, sizeof(*table));
+}
+
+/*
+FIFO byte queues.
+
+Consuming from the front only advances head. The unconsumed bytes are moved
+back to the start of the buffer when an append would otherwise have to grow
+it, or when the consumed prefix is both larger than
+STRING_FIFO_COMPACT_THRESHOLD and larger than what is left, so each byte is
+moved at most a constant number of times on average. Emptying the queue
+resets it for free.
+*/
+#define STRING_FIFO_COMPACT_THRESHOLD (64 * 1024)
+
+static void fifo_compact(string_fifo *fifo) {
+  string *buffer = fifo->buffer;
+  size_t remaining = buffer->length - fifo->head;
+  memmove(buffer->data, buffer->data + fifo->head, remaining);
+  buffer->data[remaining] = '\0';
+  buffer->length = remaining;
+  fifo->head = 0;
+}
+
+void string_fifo_init(string_fifo *fifo, size_t capacity) {
+  fifo->buffer = string_block_alloc(capacity + 1);
+  if (!fifo->buffer) {
+    printf("string_fifo_init(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  fifo->buffer->length = 0;
+  fifo->buffer->data[0] = '\0';
+  fifo->head = 0;
+}
+
+void string_fifo_init_from(string_fifo *fifo, string *str) {
+  fifo->buffer = str;
+  fifo->head = 0;
+  string_unshare(&fifo->buffer);
+}
+
+void string_fifo_append_n(string_fifo *fifo, const char *data, size_t length) {
+  string *buffer = fifo->buffer;
+  if (fifo->head > 0 && buffer->length + length + 1 > buffer->capacity) {
+    fifo_compact(fifo);
+  }
+  string_append_n(&fifo->buffer, data, length);
+}
+
+void string_fifo_append(string_fifo *fifo, const char *data) {
+  string_fifo_append_n(fifo, data, strlen(data));
+}
+
+void string_fifo_append_str(string_fifo *fifo, const string *str) {
+  string_fifo_append_n(fifo, str->data, str->length);
+}
+
+const char *string_fifo_data(const string_fifo *fifo) {
+  return fifo->buffer->data + fifo->head;
+}
+
+size_t string_fifo_length(const string_fifo *fifo) {
+  return fifo->buffer->length - fifo->head;
+}
+
+void string_fifo_consume(string_fifo *fifo, size_t count) {
+  string *buffer = fifo->buffer;
+  size_t remaining = buffer->length - fifo->head;
+  if (count >= remaining) {
+    buffer->length = 0;
+    buffer->data[0] = '\0';
+    fifo->head = 0;
+    return;
+  }
+
+  fifo->head += count;
+  if (fifo->head > STRING_FIFO_COMPACT_THRESHOLD &&
+      fifo->head > remaining - count) {
+    fifo_compact(fifo);
+  }
+}
+
+size_t string_fifo_ltrim(string_fifo *fifo) {
+  const char *data = string_fifo_data(fifo);
+  size_t length = string_fifo_length(fifo);
+  size_t start = 0;
+  while (start < length && isspace((unsigned char)data[start])) {
+    start++;
+  }
+  string_fifo_consume(fifo, start);
+  return start;
+}
+
+ssize_t string_fifo_find_n(const string_fifo *fifo, const char *needle,
+                           size_t length) {
+  const char *data = string_fifo_data(fifo);
+  const char *found =
+      string_memmem(data, string_fifo_length(fifo), needle, length);
+  return found ? found - data : -1;
+}
+
+string *string_fifo_take(string_fifo *fifo, size_t count) {
+  size_t remaining = string_fifo_length(fifo);
+  if (count > remaining) {
+    count = remaining;
+  }
+  string *taken = string_alloc_n(string_fifo_data(fifo), count);
+  string_fifo_consume(fifo, count);
+  return taken;
+}
+
+string *string_fifo_release(string_fifo *fifo) {
+  if (fifo->head > 0) {
+    fifo_compact(fifo);
+  }
+  string *buffer = fifo->buffer;
+  fifo->buffer = NULL;
+  return buffer;
+}
+
+void string_fifo_destroy(string_fifo *fifo) {
+  if (fifo->buffer) {
+    string_destroy(fifo->buffer);
+  }
+  fifo->buffer = NULL;
+  fifo->head = 0;
+}
+
+/*
+Line pipelines.
+
+The calling thread is the collector: workers claim chunks and output slots
+under one lock, and the collector hands finished slots to the sink, so the
+sink never needs to be thread-safe. In ordered mode chunk i may only use
+slot i % num_slots, which keeps a slow chunk from being overtaken by more
+than the window. glibc serialises regexec calls on a shared regex_t, so every
+worker compiles its own copy of the filters.
+*/
+#define STRING_PIPELINE_CHUNK_SIZE (1024 * 1024)
+
+enum { SLOT_FREE, SLOT_BUSY, SLOT_DONE };
+
+typedef struct pipeline_slot {
+  string *output;
+  size_t chunk;
+  size_t lines_read;
+  size_t lines_written;
+  int state;
+} pipeline_slot;
+
+typedef struct pipeline_run {
+  string_pipeline *pipeline;
+  const char *data;
+  size_t length;
+  pthread_mutex_t lock;
+  pthread_cond_t slot_free; // Signalled when the collector frees a slot.
+  pthread_cond_t slot_done; // Signalled when a worker finishes a chunk.
+  pipeline_slot *slots;
+  size_t num_slots;
+  size_t next_start; // Offset of the first unclaimed byte.
+  size_t next_chunk; // Index of the next chunk to claim.
+  size_t next_emit;  // Index of the next chunk to deliver when ordered.
+  bool stop;
+} pipeline_run;
+
+void string_pipeline_init(string_pipeline *pipeline) {
+  memset(pipeline, 0, sizeof(*pipeline));
+  pipeline->chunk_size = STRING_PIPELINE_CHUNK_SIZE;
+  pipeline->ordered = true;
+}
+
+void string_pipeline_destroy(string_pipeline *pipeline) {
+  for (size_t i = 0; i < pipeline->num_ops; i++) {
+    if (pipeline->ops[i].pattern) {
+      string_destroy(pipeline->ops[i].pattern);
+    }
+    if (pipeline->ops[i].replacement) {
+      string_destroy(pipeline->ops[i].replacement);
+    }
+  }
+  free(pipeline->ops);
+  pipeline->ops = NULL;
+  pipeline->num_ops = 0;
+  pipeline->ops_capacity = 0;
+}
+
+static string_pipeline_op *pipeline_add(string_pipeline *pipeline,
+                                        string_pipeline_op_kind kind) {
+  if (pipeline->num_ops == pipeline->ops_capacity) {
+    size_t capacity = pipeline->ops_capacity ? pipeline->ops_capacity * 2 : 4;
+    string_pipeline_op *ops =
+        realloc(pipeline->ops, capacity * sizeof(string_pipeline_op));
+    if (!ops) {
+      printf("string_pipeline_add(): memory allocation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    pipeline->ops = ops;
+    pipeline->ops_capacity = capacity;
+  }
+
+  string_pipeline_op *op = &pipeline->ops[pipeline->num_ops++];
+  memset(op, 0, sizeof(*op));
+  op->kind = kind;
+  return op;
+}
+
+bool string_pipeline_filter(string_pipeline *pipeline, const char *regex,
+                            bool invert) {
+  regex_t compiled_regex;
+  if (regcomp(&compiled_regex, regex, REG_EXTENDED | REG_NOSUB) != 0) {
+    return false;
+  }
+  regfree(&compiled_regex);
+
+  string_pipeline_op *op = pipeline_add(pipeline, STRING_PIPELINE_FILTER);
+  op->pattern = string_alloc(regex);
+  op->invert = invert;
+  return true;
+}
+
+void string_pipeline_replace_all_n(string_pipeline *pipeline,
+                                   const char *find_str, size_t find_len,
+                                   const char *replace_str,
+                                   size_t replace_len) {
+  string_pipeline_op *op = pipeline_add(pipeline, STRING_PIPELINE_REPLACE_ALL);
+  op->pattern = string_alloc_n(find_str, find_len);
+  op->replacement = string_alloc_n(replace_str, replace_len);
+}
+
+void string_pipeline_replace_all(string_pipeline *pipeline,
+                                 const char *find_str,
+                                 const char *replace_str) {
+  string_pipeline_replace_all_n(pipeline, find_str, strlen(find_str),
+                                replace_str, strlen(replace_str));
+}
+
+void string_pipeline_toupper(string_pipeline *pipeline) {
+  pipeline_add(pipeline, STRING_PIPELINE_TOUPPER);
+}
+
+void string_pipeline_tolower(string_pipeline *pipeline) {
+  pipeline_add(pipeline, STRING_PIPELINE_TOLOWER);
+}
+
+void string_pipeline_trim(string_pipeline *pipeline) {
+  pipeline_add(pipeline, STRING_PIPELINE_TRIM);
+}
+
+void string_pipeline_map(string_pipeline *pipeline, string_pipeline_map_fn map,
+                         void *user_data) {
+  string_pipeline_op *op = pipeline_add(pipeline, STRING_PIPELINE_MAP);
+  op->map = map;
+  op->user_data = user_data;
+}
+
+// Compile this worker's copy of the filters, indexed like the operations.
+static regex_t *pipeline_compile(const string_pipeline *pipeline) {
+  regex_t *regexes = calloc(pipeline->num_ops ? pipeline->num_ops : 1,
+                            sizeof(regex_t));
+  if (!regexes) {
+    printf("string_pipeline_run(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < pipeline->num_ops; i++) {
+    const string_pipeline_op *op = &pipeline->ops[i];
+    if (op->kind == STRING_PIPELINE_FILTER &&
+        regcomp(&regexes[i], op->pattern->data, REG_EXTENDED | REG_NOSUB) !=
+            0) {
+      printf("string_pipeline_run(): regex compilation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return regexes;
+}
+
+static void pipeline_free_regexes(const string_pipeline *pipeline,
+                                  regex_t *regexes) {
+  for (size_t i = 0; i < pipeline->num_ops; i++) {
+    if (pipeline->ops[i].kind == STRING_PIPELINE_FILTER) {
+      regfree(&regexes[i]);
+    }
+  }
+  free(regexes);
+}
+
+// Run one line through the operations. Returns false if it was dropped.
+static bool pipeline_apply(const string_pipeline *pipeline,
+                           const regex_t *regexes, string **line) {
+  for (size_t i = 0; i < pipeline->num_ops; i++) {
+    const string_pipeline_op *op = &pipeline->ops[i];
+    switch (op->kind) {
+    case STRING_PIPELINE_FILTER:
+      if ((regexec(&regexes[i], (*line)->data, 0, NULL, 0) == 0) ==
+          op->invert) {
+        return false;
+      }
+      break;
+    case STRING_PIPELINE_REPLACE_ALL:
+      string_replace_all_n(line, op->pattern->data, op->pattern->length,
+                           op->replacement->data, op->replacement->length);
+      break;
+    case STRING_PIPELINE_TOUPPER:
+      string_toupper(line);
+      break;
+    case STRING_PIPELINE_TOLOWER:
+      string_tolower(line);
+      break;
+    case STRING_PIPELINE_TRIM:
+      string_trim(line);
+      break;
+    case STRING_PIPELINE_MAP:
+      if (!op->map(line, op->user_data)) {
+        return false;
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+// Process the lines in [start, end) and append the survivors to output.
+static void pipeline_process(const string_pipeline *pipeline,
+                             const regex_t *regexes, string **line,
+                             const char *data, size_t start, size_t end,
+                             pipeline_slot *slot) {
+  const char *pos = data + start;
+  const char *stop = data + end;
+  while (pos < stop) {
+    const char *newline = memchr(pos, '\n', stop - pos);
+    const char *line_end = newline ? newline : stop;
+
+    string_clear(line);
+    string_append_n(line, pos, line_end - pos);
+    slot->lines_read++;
+    if (pipeline_apply(pipeline, regexes, line)) {
+      string_append_n(&slot->output, (*line)->data, (*line)->length);
+      string_append_n(&slot->output, "\n", 1);
+      slot->lines_written++;
+    }
+    pos = line_end + 1;
+  }
+}
+
+// End of the chunk starting at start: chunk_size bytes, then to the end of
+// the line.
+static size_t pipeline_chunk_end(const pipeline_run *run, size_t start) {
+  size_t chunk_size = run->pipeline->chunk_size ? run->pipeline->chunk_size
+                                                : STRING_PIPELINE_CHUNK_SIZE;
+  if (run->length - start <= chunk_size) {
+    return run->length;
+  }
+  size_t end = start + chunk_size - 1;
+  const char *newline = memchr(run->data + end, '\n', run->length - end);
+  return newline ? (size_t)(newline - run->data) + 1 : run->length;
+}
+
+static pipeline_slot *pipeline_free_slot(pipeline_run *run) {
+  if (run->pipeline->ordered) {
+    pipeline_slot *slot = &run->slots[run->next_chunk % run->num_slots];
+    return slot->state == SLOT_FREE ? slot : NULL;
+  }
+  for (size_t i = 0; i < run->num_slots; i++) {
+    if (run->slots[i].state == SLOT_FREE) {
+      return &run->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static void *pipeline_worker(void *arg) {
+  pipeline_run *run = arg;
+  regex_t *regexes = pipeline_compile(run->pipeline);
+  string *line = string_alloc("");
+
+  pthread_mutex_lock(&run->lock);
+  for (;;) {
+    pipeline_slot *slot = NULL;
+    while (!run->stop && run->next_start < run->length &&
+           (slot = pipeline_free_slot(run)) == NULL) {
+      pthread_cond_wait(&run->slot_free, &run->lock);
+    }
+    if (run->stop || run->next_start >= run->length) {
+      break;
+    }
+
+    size_t start = run->next_start;
+    size_t end = pipeline_chunk_end(run, start);
+    run->next_start = end;
+    slot->chunk = run->next_chunk++;
+    slot->state = SLOT_BUSY;
+    pthread_mutex_unlock(&run->lock);
+
+    pipeline_process(run->pipeline, regexes, &line, run->data, start, end,
+                     slot);
+
+    pthread_mutex_lock(&run->lock);
+    slot->state = SLOT_DONE;
+    pthread_cond_signal(&run->slot_done);
+  }
+  pthread_mutex_unlock(&run->lock);
+
+  string_destroy(line);
+  pipeline_free_regexes(run->pipeline, regexes);
+  return NULL;
+}
+
+// Find a finished slot the collector may deliver next.
+static pipeline_slot *pipeline_ready_slot(pipeline_run *run) {
+  if (run->pipeline->ordered) {
+    pipeline_slot *slot = &run->slots[run->next_emit % run->num_slots];
+    return slot->state == SLOT_DONE && slot->chunk == run->next_emit ? slot
+                                                                     : NULL;
+  }
+  for (size_t i = 0; i < run->num_slots; i++) {
+    if (run->slots[i].state == SLOT_DONE) {
+      return &run->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static bool pipeline_idle(const pipeline_run *run) {
+  for (size_t i = 0; i < run->num_slots; i++) {
+    if (run->slots[i].state != SLOT_FREE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Deliver finished chunks to the sink until the input is exhausted.
+static bool pipeline_collect(pipeline_run *run, string_pipeline_sink_fn sink,
+                             void *user_data) {
+  string_pipeline *pipeline = run->pipeline;
+  bool ok = true;
+
+  pthread_mutex_lock(&run->lock);
+  for (;;) {
+    pipeline_slot *slot = pipeline_ready_slot(run);
+    if (!slot) {
+      if (run->next_start >= run->length && pipeline_idle(run)) {
+        break;
+      }
+      pthread_cond_wait(&run->slot_done, &run->lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&run->lock);
+    if (slot->output->length > 0) {
+      ok = sink(slot->output->data, slot->output->length, user_data);
+    }
+    pipeline->lines_read += slot->lines_read;
+    pipeline->lines_written += slot->lines_written;
+    string_clear(&slot->output);
+    slot->lines_read = 0;
+    slot->lines_written = 0;
+    pthread_mutex_lock(&run->lock);
+
+    slot->state = SLOT_FREE;
+    run->next_emit++;
+    if (!ok) {
+      run->stop = true;
+      pthread_cond_broadcast(&run->slot_free);
+      break;
+    }
+    pthread_cond_broadcast(&run->slot_free);
+  }
+  pthread_mutex_unlock(&run->lock);
+  return ok;
+}
+
+// A single thread processes and delivers each chunk in turn.
+static bool pipeline_run_serial(pipeline_run *run,
+                                string_pipeline_sink_fn sink,
+                                void *user_data) {
+  string_pipeline *pipeline = run->pipeline;
+  regex_t *regexes = pipeline_compile(pipeline);
+  string *line = string_alloc("");
+  pipeline_slot slot = {.output = string_alloc("")};
+  bool ok = true;
+  while (ok && run->next_start < run->length) {
+    size_t end = pipeline_chunk_end(run, run->next_start);
+    pipeline_process(pipeline, regexes, &line, run->data, run->next_start,
+                     end, &slot);
+    run->next_start = end;
+    if (slot.output->length > 0) {
+      ok = sink(slot.output->data, slot.output->length, user_data);
+    }
+    string_clear(&slot.output);
+  }
+  pipeline->lines_read = slot.lines_read;
+  pipeline->lines_written = slot.lines_written;
+  string_destroy(slot.output);
+  string_destroy(line);
+  pipeline_free_regexes(pipeline, regexes);
+  return ok;
+}
+
+bool string_pipeline_run(string_pipeline *pipeline, const char *data,
+                         size_t length, string_pipeline_sink_fn sink,
+                         void *user_data) {
+  pipeline->lines_read = 0;
+  pipeline->lines_written = 0;
+
+  pipeline_run run = {.pipeline = pipeline, .data = data, .length = length};
+  size_t chunk_size =
+      pipeline->chunk_size ? pipeline->chunk_size : STRING_PIPELINE_CHUNK_SIZE;
+  size_t threads = pipeline->threads ? pipeline->threads : online_cpus();
+  size_t chunks = length / chunk_size + 1;
+  if (threads > chunks) {
+    threads = chunks;
+  }
+  if (threads <= 1) {
+    return pipeline_run_serial(&run, sink, user_data);
+  }
+
+  run.num_slots = pipeline->max_in_flight ? pipeline->max_in_flight
+                                          : threads * 2;
+  run.slots = calloc(run.num_slots, sizeof(pipeline_slot));
+  pthread_t *ids = malloc(threads * sizeof(pthread_t));
+  if (!run.slots || !ids) {
+    printf("string_pipeline_run(): memory allocation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < run.num_slots; i++) {
+    run.slots[i].output = string_alloc("");
+  }
+  pthread_mutex_init(&run.lock, NULL);
+  pthread_cond_init(&run.slot_free, NULL);
+  pthread_cond_init(&run.slot_done, NULL);
+
+  // Workers block until the collector frees a slot, so they cannot run on
+  // this thread; carry on with the ones that started.
+  size_t started = 0;
+  while (started < threads &&
+         pthread_create(&ids[started], NULL, pipeline_worker, &run) == 0) {
+    started++;
+  }
+  bool ok = started > 0 ? pipeline_collect(&run, sink, user_data)
+                        : pipeline_run_serial(&run, sink, user_data);
+  for (size_t t = 0; t < started; t++) {
+    pthread_join(ids[t], NULL);
+  }
+
+  pthread_cond_destroy(&run.slot_done);
+  pthread_cond_destroy(&run.slot_free);
+  pthread_mutex_destroy(&run.lock);
+  for (size_t i = 0; i < run.num_slots; i++) {
+    string_destroy(run.slots[i].output);
+  }
+  free(run.slots);
+  free(ids);
+  return ok;
+}
+
+bool string_pipeline_run_file(string_pipeline *pipeline, const char *path,
+                              string_pipeline_sink_fn sink, void *user_data) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror("open");
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror("fstat");
+    close(fd);
+    return false;
+  }
+
+  size_t length = st.st_size;
+  if (length == 0) {
+    close(fd);
+    return string_pipeline_run(pipeline, "", 0, sink, user_data);
+  }
+
+  char *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return false;
+  }
+  madvise(data, length, MADV_SEQUENTIAL);
+
+  bool ok = string_pipeline_run(pipeline, data, length, sink, user_data);
+  munmap(data, length);
+  return ok;
+}
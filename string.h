@@ -3,21 +3,47 @@
 
 #include <ctype.h>
 #include <regex.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 
 /**
  * Represents a flexible string structure.
  */
 typedef struct string {
-  size_t length;   /**< Current length of the string. */
-  size_t capacity; /**< Capacity of the allocated memory. */
-  char data[];     /**< Flexible array member to hold the string data. */
+  size_t length;          /**< Current length of the string. */
+  size_t capacity;        /**< Capacity of the allocated memory. */
+  atomic_size_t refcount; /**< Number of owners sharing the buffer. */
+  char data[];            /**< Flexible array member to hold the string data. */
 } string;
 
+/**
+ * @brief Create a read-only string from a string literal without allocating.
+ *
+ * The length is computed at compile time and the result may be passed to any
+ * function taking a const string *. Its reference count is 0, which marks it
+ * as static: string_destroy is a no-op and string_share returns it unchanged,
+ * so mutating a shared handle through a string ** function always copies.
+ * Like any compound literal, it has static storage at file scope and lives
+ * until the end of the enclosing block otherwise.
+ *
+ * @code
+ * static const string *const GREETING = STRING_LITERAL("Hello");
+ * @endcode
+ */
+#define STRING_LITERAL(literal)                                                \
+  ((const string *)&(const struct {                                            \
+    size_t length;                                                             \
+    size_t capacity;                                                           \
+    atomic_size_t refcount;                                                    \
+    char data[sizeof(literal)];                                                \
+  }){sizeof(literal) - 1, sizeof(literal), 0, "" literal})
+
 /**
  * @brief Allocate and initialize a new string with the given initial data.
  *
@@ -26,6 +52,16 @@ typedef struct string {
  */
 string *string_alloc(const char *initial_data);
 
+/**
+ * @brief Allocate a new string from a buffer of known length.
+ * The data may contain null bytes.
+ *
+ * @param data The initial data for the string.
+ * @param length The number of bytes to copy from data.
+ * @return A pointer to the allocated string structure.
+ */
+string *string_alloc_n(const char *data, size_t length);
+
 /**
  * @brief Resize the capacity of the string to the given new capacity.
  *
@@ -36,11 +72,69 @@ void string_resize(string **str, size_t new_capacity);
 
 /**
  * @brief Destroy and free the memory allocated for the string.
+ * If the string is shared, only the caller's reference is released.
  *
  * @param str Pointer to the string structure to be destroyed.
  */
 void string_destroy(string *str);
 
+/**
+ * @brief Share the string with another owner without copying it.
+ *
+ * The buffer is reference counted: each shared handle must be released with
+ * string_destroy. Every mutating function takes a string ** and
+ * transparently detaches (copies) the buffer before changing it while it is
+ * shared.
+ *
+ * @param str Pointer to the string structure.
+ * @return The same string, with its reference count incremented.
+ */
+string *string_share(const string *str);
+
+/**
+ * @brief Check whether the string buffer has more than one owner.
+ *
+ * @param str Pointer to the string structure.
+ * @return True if the buffer is shared, false otherwise.
+ */
+bool string_is_shared(const string *str);
+
+/**
+ * @brief Ensure the caller holds the only reference to the string buffer,
+ * copying it if it is shared.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ */
+void string_unshare(string **str);
+
+/**
+ * @brief Enable or disable the string block pool.
+ *
+ * When enabled, string_destroy returns blocks to per-thread free lists sorted
+ * into power-of-two size classes and string_alloc / string_resize take blocks
+ * from them before calling malloc. Retention is bounded per thread and per
+ * process; blocks freed on another thread are shared through a common depot.
+ * The pool is disabled by default and may be toggled at any time.
+ *
+ * @param enable true to enable the pool, false to disable it.
+ */
+void string_pool_enable(bool enable);
+
+/**
+ * @brief Check whether the string block pool is enabled.
+ *
+ * @return True if the pool is enabled, false otherwise.
+ */
+bool string_pool_enabled(void);
+
+/**
+ * @brief Release the blocks cached by the calling thread back to the system
+ * allocator, together with every block in the process-wide depot. Blocks
+ * cached by other threads are kept. Intended to be called when a thread goes
+ * idle; other threads refill the depot from their caches as they spill.
+ */
+void string_pool_trim(void);
+
 /**
  * @brief Append the specified string to the end of the string.
  *
@@ -49,12 +143,29 @@ void string_destroy(string *str);
  */
 void string_append(string **str, const char *append_str);
 
+/**
+ * @brief Append length bytes from a buffer to the end of the string.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param append_str The bytes to append. May contain null bytes.
+ * @param append_len The number of bytes to append.
+ */
+void string_append_n(string **str, const char *append_str, size_t append_len);
+
+/**
+ * @brief Append another string to the end of the string.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param append_str The string to append. May be the string itself.
+ */
+void string_append_str(string **str, const string *append_str);
+
 /**
  * @brief Clear the contents of the string, setting its length to 0.
  *
- * @param str Pointer to the string structure to be cleared.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_clear(string *str);
+void string_clear(string **str);
 
 /**
  * @brief Get the character at the specified index in the string.
@@ -75,6 +186,25 @@ char string_get_char(const string *str, size_t index);
  */
 ssize_t string_find(const string *str, const char *sub_str);
 
+/**
+ * @brief Find the first occurrence of a byte sequence within the string.
+ *
+ * @param str Pointer to the string structure.
+ * @param sub_str The bytes to search for. May contain null bytes.
+ * @param sub_len The number of bytes in sub_str.
+ * @return The index of the first occurrence, or -1 if not found.
+ */
+ssize_t string_find_n(const string *str, const char *sub_str, size_t sub_len);
+
+/**
+ * @brief Find the first occurrence of another string within the string.
+ *
+ * @param str Pointer to the string structure.
+ * @param sub_str The string to search for.
+ * @return The index of the first occurrence, or -1 if not found.
+ */
+ssize_t string_find_str(const string *str, const string *sub_str);
+
 /**
  * @brief Perform regular expression matching and return the matched capture
  * group.
@@ -95,6 +225,26 @@ char *regex_sub_match(const char *str, const char *regex, int capture_group);
  */
 bool string_contains(const string *str, const char *substring);
 
+/**
+ * @brief Check if the string contains a specific byte sequence.
+ *
+ * @param str Pointer to the string structure.
+ * @param substring The bytes to check for. May contain null bytes.
+ * @param sub_len The number of bytes in substring.
+ * @return True if the bytes are found, false otherwise.
+ */
+bool string_contains_n(const string *str, const char *substring,
+                       size_t sub_len);
+
+/**
+ * @brief Check if the string contains another string.
+ *
+ * @param str Pointer to the string structure.
+ * @param substring The string to check for.
+ * @return True if the substring is found, false otherwise.
+ */
+bool string_contains_str(const string *str, const string *substring);
+
 /**
  * @brief Insert the specified string at the given index within the string.
  *
@@ -104,34 +254,56 @@ bool string_contains(const string *str, const char *substring);
  */
 void string_insert(string **str, size_t index, const char *insert_str);
 
+/**
+ * @brief Insert length bytes from a buffer at the given index.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param index The index at which to insert the bytes.
+ * @param insert_str The bytes to insert. May contain null bytes.
+ * @param insert_len The number of bytes to insert.
+ */
+void string_insert_n(string **str, size_t index, const char *insert_str,
+                     size_t insert_len);
+
+/**
+ * @brief Insert another string at the given index.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param index The index at which to insert the string.
+ * @param insert_str The string to insert. May be the string itself.
+ */
+void string_insert_str(string **str, size_t index, const string *insert_str);
+
 /**
  * @brief Convert all characters in the string to uppercase.
  *
- * @param str Pointer to the string structure to be converted.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_toupper(string *str);
+void string_toupper(string **str);
 
 /**
  * @brief Convert all characters in the string to lowercase.
  *
- * @param str Pointer to the string structure to be converted.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_tolower(string *str);
+void string_tolower(string **str);
 
 /**
- * @brief Convert the string to camel case format.
+ * @brief Convert the string to camel case format, capitalizing the first
+ * letter of every word (including the first) and removing whitespace, '_'
+ * and '-' separators. See string_convert_case for other styles.
  *
- * @param str Pointer to the string structure to be converted.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_to_camelcase(string *str);
+void string_to_camelcase(string **str);
 
 /**
  * @brief Convert the first letter of each word to uppercase, making the string
- * title case.
+ * title case. Words are separated by whitespace, '_' or '-'.
  *
- * @param str Pointer to the string structure to be converted.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_to_titlecase(string *str);
+void string_to_titlecase(string **str);
 
 /**
  * @brief Convert the string to snake case format.
@@ -140,6 +312,60 @@ void string_to_titlecase(string *str);
  */
 void string_to_snakecase(string **str);
 
+/**
+ * Target styles for string_convert_case.
+ */
+typedef enum string_case {
+  STRING_CASE_SNAKE,    /**< snake_case */
+  STRING_CASE_KEBAB,    /**< kebab-case */
+  STRING_CASE_CAMEL,    /**< camelCase */
+  STRING_CASE_PASCAL,   /**< PascalCase */
+  STRING_CASE_TITLE,    /**< Title Case */
+  STRING_CASE_CONSTANT, /**< CONSTANT_CASE */
+} string_case;
+
+/**
+ * Word boundary rules for string_convert_case.
+ */
+typedef struct string_case_rules {
+  const char *separators; /**< Bytes separating words; NULL for whitespace,
+                               '_' and '-'. */
+  bool split_case;        /**< Start a word at a lower-to-upper transition,
+                               as in "helloWorld". */
+  bool split_acronyms;    /**< Start a word at the last capital of an
+                               acronym, as in "HTTPServer". */
+  bool split_digits;      /**< Start a word between letters and digits, as
+                               in "utf8". */
+} string_case_rules;
+
+/**
+ * @brief Convert the string to another case style in a single linear pass.
+ * The result is allocated at its exact size.
+ *
+ * @param str Pointer to the string structure to be converted.
+ * @param style The target case style.
+ * @param rules Word boundary rules, or NULL to split on separators, case
+ * transitions and acronyms.
+ * @return A newly allocated string, or NULL if allocation fails.
+ */
+string *string_convert_case(const string *str, string_case style,
+                            const string_case_rules *rules);
+
+/**
+ * @brief Convert an array of strings to another case style, preparing the
+ * word boundary rules only once.
+ *
+ * @param src The strings to convert.
+ * @param dst Array receiving the newly allocated results.
+ * @param count The number of strings in src.
+ * @param style The target case style.
+ * @param rules Word boundary rules, or NULL for the defaults.
+ * @return True if every conversion succeeded. Failed entries are set to NULL.
+ */
+bool string_convert_case_batch(const string *src[], string *dst[],
+                               size_t count, string_case style,
+                               const string_case_rules *rules);
+
 /**
  * @brief Remove a specified number of characters from the string, starting from
  * the given index.
@@ -153,9 +379,9 @@ void string_remove(string **s, size_t index, size_t count);
 /**
  * @brief Reverse the characters in the string.
  *
- * @param s Pointer to the string structure to be reversed.
+ * @param s Pointer to the pointer of the string structure.
  */
-void string_reverse(string *s);
+void string_reverse(string **s);
 
 /**
  * @brief Replace the first occurrence of a substring with another string.
@@ -167,6 +393,28 @@ void string_reverse(string *s);
 void string_replace(string **str, const char *find_str,
                     const char *replace_str);
 
+/**
+ * @brief Replace the first occurrence of a byte sequence with another.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param find_str The bytes to find. May contain null bytes.
+ * @param find_len The number of bytes in find_str.
+ * @param replace_str The replacement bytes. May contain null bytes.
+ * @param replace_len The number of bytes in replace_str.
+ */
+void string_replace_n(string **str, const char *find_str, size_t find_len,
+                      const char *replace_str, size_t replace_len);
+
+/**
+ * @brief Replace the first occurrence of a string with another string.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param find_str The substring to find.
+ * @param replace_str The string to replace the substring with.
+ */
+void string_replace_str(string **str, const string *find_str,
+                        const string *replace_str);
+
 /**
  * @brief Replace all occurrences of a substring with another string.
  *
@@ -177,6 +425,28 @@ void string_replace(string **str, const char *find_str,
 void string_replace_all(string **str, const char *find_str,
                         const char *replace_str);
 
+/**
+ * @brief Replace all occurrences of a byte sequence with another.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param find_str The bytes to find. May contain null bytes.
+ * @param find_len The number of bytes in find_str.
+ * @param replace_str The replacement bytes. May contain null bytes.
+ * @param replace_len The number of bytes in replace_str.
+ */
+void string_replace_all_n(string **str, const char *find_str, size_t find_len,
+                          const char *replace_str, size_t replace_len);
+
+/**
+ * @brief Replace all occurrences of a string with another string.
+ *
+ * @param str Pointer to the pointer of the string structure.
+ * @param find_str The substring to find.
+ * @param replace_str The string to replace the substring with.
+ */
+void string_replace_all_str(string **str, const string *find_str,
+                            const string *replace_str);
+
 /**
  * @brief Join an array of strings using a specified delimiter.
  *
@@ -188,6 +458,31 @@ void string_replace_all(string **str, const char *find_str,
 string *string_join(const char *strings[], size_t num_strings,
                     const char *delimiter);
 
+/**
+ * @brief Join an array of buffers of known length using a delimiter.
+ *
+ * @param strings An array of buffers to be joined. May contain null bytes.
+ * @param lengths The number of bytes in each buffer.
+ * @param num_strings The number of buffers in the array.
+ * @param delimiter The delimiter to use between joined buffers.
+ * @param delimiter_len The number of bytes in the delimiter.
+ * @return A newly allocated string containing the joined buffers.
+ */
+string *string_join_n(const char *strings[], const size_t lengths[],
+                      size_t num_strings, const char *delimiter,
+                      size_t delimiter_len);
+
+/**
+ * @brief Join an array of strings using a delimiter string.
+ *
+ * @param strings An array of strings to be joined.
+ * @param num_strings The number of strings in the array.
+ * @param delimiter The delimiter to use between joined strings.
+ * @return A newly allocated string containing the joined strings.
+ */
+string *string_join_str(const string *strings[], size_t num_strings,
+                        const string *delimiter);
+
 /**
  * @brief Split the string into an array of substrings based on a delimiter.
  *
@@ -196,7 +491,7 @@ string *string_join(const char *strings[], size_t num_strings,
  * @param num_tokens Pointer to store the number of generated tokens.
  * @return An array of dynamically allocated string pointers.
  */
-string **string_split(string *str, char delimiter, size_t *num_tokens);
+string **string_split(const string *str, char delimiter, size_t *num_tokens);
 
 /**
  * @brief Free the dynamically allocated memory for an array of substrings.
@@ -226,6 +521,26 @@ string *string_substr(const string *str, size_t start, size_t length);
  */
 bool string_startswith(const string *s, const char *prefix);
 
+/**
+ * @brief Check if the string starts with a byte sequence.
+ *
+ * @param s Pointer to the string structure.
+ * @param prefix The prefix bytes. May contain null bytes.
+ * @param prefix_length The number of bytes in prefix.
+ * @return True if the string starts with the prefix, false otherwise.
+ */
+bool string_startswith_n(const string *s, const char *prefix,
+                         size_t prefix_length);
+
+/**
+ * @brief Check if the string starts with another string.
+ *
+ * @param s Pointer to the string structure.
+ * @param prefix The prefix to check.
+ * @return True if the string starts with the prefix, false otherwise.
+ */
+bool string_startswith_str(const string *s, const string *prefix);
+
 /**
  * @brief Check if the string ends with a specified suffix.
  *
@@ -235,6 +550,26 @@ bool string_startswith(const string *s, const char *prefix);
  */
 bool string_endswith(const string *s, const char *suffix);
 
+/**
+ * @brief Check if the string ends with a byte sequence.
+ *
+ * @param s Pointer to the string structure.
+ * @param suffix The suffix bytes. May contain null bytes.
+ * @param suffix_length The number of bytes in suffix.
+ * @return True if the string ends with the suffix, false otherwise.
+ */
+bool string_endswith_n(const string *s, const char *suffix,
+                       size_t suffix_length);
+
+/**
+ * @brief Check if the string ends with another string.
+ *
+ * @param s Pointer to the string structure.
+ * @param suffix The suffix to check.
+ * @return True if the string ends with the suffix, false otherwise.
+ */
+bool string_endswith_str(const string *s, const string *suffix);
+
 /**
  * @brief Check if the string matches a specified regular expression.
  *
@@ -245,18 +580,1420 @@ bool string_endswith(const string *s, const char *suffix);
 bool string_match(const string *str, const char *regex);
 
 /** @brief Remove leading and trailing white space from string
- * @param str Pointer to the string structure.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_trim(string *str);
+void string_trim(string **str);
 
 /** @brief Remove trailing white space from string
- * @param str Pointer to the string structure.
+ * @param str Pointer to the pointer of the string structure.
  */
-void string_rtrim(string *str);
+void string_rtrim(string **str);
 
 /** @brief Remove leading white space from string
- * @param str Pointer to the string structure.
+ * @param str Pointer to the pointer of the string structure.
+ */
+void string_ltrim(string **str);
+
+/**
+ * A segment of a string builder.
+ */
+typedef struct string_segment {
+  struct string_segment *next; /**< Next segment in the chain. */
+  size_t length;               /**< Number of bytes used in the segment. */
+  size_t capacity;             /**< Number of bytes the segment can hold. */
+  char data[];                 /**< Segment bytes. */
+} string_segment;
+
+/**
+ * Builds a large string from many appends without moving earlier data.
+ *
+ * Appended bytes go into a chain of segments that grow geometrically; nothing
+ * is copied until the result is flattened with string_builder_to_string or
+ * handed to writev through string_builder_iovec.
+ */
+typedef struct string_builder {
+  string_segment *head;   /**< First segment. */
+  string_segment *tail;   /**< Segment currently being filled. */
+  size_t length;          /**< Total number of bytes appended. */
+  size_t segment_size;    /**< Capacity of the next segment to allocate. */
+} string_builder;
+
+/**
+ * @brief Initialize a string builder.
+ *
+ * @param builder Pointer to the builder to initialize.
+ * @param size_hint Expected final size in bytes, or 0 if unknown. The first
+ * segment is sized to hold it.
+ */
+void string_builder_init(string_builder *builder, size_t size_hint);
+
+/**
+ * @brief Ensure the next additional bytes can be appended without allocating.
+ *
+ * @param builder Pointer to the builder.
+ * @param additional The number of bytes about to be appended.
+ */
+void string_builder_reserve(string_builder *builder, size_t additional);
+
+/**
+ * @brief Append a null-terminated string to the builder.
+ *
+ * @param builder Pointer to the builder.
+ * @param str The string to append.
+ */
+void string_builder_append(string_builder *builder, const char *str);
+
+/**
+ * @brief Append length bytes from a buffer to the builder.
+ *
+ * @param builder Pointer to the builder.
+ * @param data The bytes to append. May contain null bytes.
+ * @param length The number of bytes to append.
+ */
+void string_builder_append_n(string_builder *builder, const char *data,
+                             size_t length);
+
+/**
+ * @brief Append a string to the builder.
+ *
+ * @param builder Pointer to the builder.
+ * @param str The string to append.
+ */
+void string_builder_append_str(string_builder *builder, const string *str);
+
+/**
+ * @brief Flatten the builder into a single newly allocated string.
+ * Every byte is copied exactly once. The builder is left unchanged.
+ *
+ * @param builder Pointer to the builder.
+ * @return A newly allocated string, or NULL if allocation fails.
+ */
+string *string_builder_to_string(const string_builder *builder);
+
+/**
+ * @brief Describe the builder contents as an iovec array for writev.
+ *
+ * @param builder Pointer to the builder.
+ * @param iov Array receiving one entry per non-empty segment.
+ * @param max_iov The number of entries available in iov.
+ * @return The number of entries needed to describe the whole builder. If it
+ * is larger than max_iov, only the first max_iov entries are filled.
+ */
+size_t string_builder_iovec(const string_builder *builder, struct iovec *iov,
+                            size_t max_iov);
+
+/**
+ * @brief Empty the builder while keeping its segments for reuse.
+ *
+ * @param builder Pointer to the builder.
+ */
+void string_builder_reset(string_builder *builder);
+
+/**
+ * @brief Free all the memory owned by the builder.
+ *
+ * @param builder Pointer to the builder.
+ */
+void string_builder_destroy(string_builder *builder);
+
+/**
+ * @brief Compute the Levenshtein edit distance between two strings using
+ * Myers' bit-parallel algorithm.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @param max_distance The largest distance of interest. The computation stops
+ * as soon as the distance is known to exceed it; pass SIZE_MAX for no limit.
+ * @return The edit distance, or SIZE_MAX if it exceeds max_distance.
+ */
+size_t string_levenshtein(const string *a, const string *b,
+                          size_t max_distance);
+
+/**
+ * @brief Compute the Damerau-Levenshtein (optimal string alignment) distance
+ * between two strings, counting adjacent transpositions as one edit.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @param max_distance The largest distance of interest, or SIZE_MAX.
+ * @return The edit distance, or SIZE_MAX if it exceeds max_distance.
+ */
+size_t string_damerau(const string *a, const string *b, size_t max_distance);
+
+/**
+ * Location of an approximate match found by string_find_approx.
+ */
+typedef struct string_approx_match {
+  size_t start;    /**< Index of the first byte of the match. */
+  size_t length;   /**< Number of bytes in the match. */
+  size_t distance; /**< Edit distance between the match and the pattern. */
+} string_approx_match;
+
+/**
+ * @brief Find the substring with the lowest edit distance to a pattern.
+ * Among equally good matches the leftmost one is returned, extended for as
+ * long as the distance does not grow.
+ *
+ * @param str Pointer to the string structure to search.
+ * @param pattern The pattern to look for.
+ * @param max_edits The largest number of edits allowed.
+ * @param match Receives the match location and distance. May be NULL.
+ * @return The index of the match, or -1 if no substring is within max_edits.
+ */
+ssize_t string_find_approx(const string *str, const string *pattern,
+                           size_t max_edits, string_approx_match *match);
+
+/**
+ * @brief Compute the Levenshtein distance between a query and many
+ * candidates. For queries of up to 64 bytes, four candidates are scored at
+ * once with AVX2 when the CPU supports it.
+ *
+ * @param query Pointer to the query string.
+ * @param candidates The strings to compare against the query.
+ * @param count The number of candidates.
+ * @param max_distance The largest distance of interest, or SIZE_MAX.
+ * @param distances Receives the distance for each candidate, or SIZE_MAX if
+ * it exceeds max_distance.
+ */
+void string_levenshtein_batch(const string *query, const string *candidates[],
+                              size_t count, size_t max_distance,
+                              size_t distances[]);
+
+/**
+ * @brief Compare two strings byte by byte. A string that is a prefix of the
+ * other sorts first. Null bytes are compared like any other byte.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @return A negative value, zero or a positive value if a sorts before, equal
+ * to or after b.
+ */
+int string_compare(const string *a, const string *b);
+
+/**
+ * @brief Compare two strings ignoring ASCII case.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @return A negative value, zero or a positive value if a sorts before, equal
+ * to or after b.
+ */
+int string_compare_ci(const string *a, const string *b);
+
+/**
+ * @brief Compare two strings in natural order, comparing runs of digits by
+ * their numeric value, so that "file9" sorts before "file10".
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @return A negative value, zero or a positive value if a sorts before, equal
+ * to or after b.
+ */
+int string_compare_natural(const string *a, const string *b);
+
+/**
+ * @brief Sort an array of strings in string_compare order using a multikey
+ * quicksort with cached key prefixes.
+ *
+ * @param strings The array of strings to sort.
+ * @param count The number of strings in the array.
+ */
+void string_sort(string **strings, size_t count);
+
+/**
+ * @brief Sort an array of strings with a comparison function such as
+ * string_compare_ci or string_compare_natural. The sort is stable.
+ *
+ * @param strings The array of strings to sort.
+ * @param count The number of strings in the array.
+ * @param compare The comparison function.
+ */
+void string_sort_with(string **strings, size_t count,
+                      int (*compare)(const string *, const string *));
+
+/**
+ * @brief Sort a large array of strings in string_compare order using several
+ * threads. Each thread sorts a run with string_sort and the runs are then
+ * merged in parallel. Small arrays, and machines with a single CPU, sort on
+ * the calling thread with string_sort; the thread count is capped at the
+ * number of online CPUs.
+ *
+ * @param strings The array of strings to sort.
+ * @param count The number of strings in the array.
+ * @param threads The maximum number of threads to use.
+ */
+void string_sort_parallel(string **strings, size_t count, size_t threads);
+
+/**
+ * A field of a parsed CSV record. The field points into the parsed input.
+ */
+typedef struct string_csv_field {
+  const char *data; /**< Field contents, without enclosing quotes. */
+  size_t length;    /**< Number of bytes in the field. */
+  bool escaped;     /**< True if the field contains doubled quotes that
+                         string_csv_field_string collapses. */
+} string_csv_field;
+
+/**
+ * Reusable index of the records and fields found in delimited input.
+ */
+typedef struct string_csv {
+  char delimiter;            /**< Field delimiter, such as ',' or '\t'. */
+  char quote;                /**< Quote character, or '\0' for none. */
+  string_csv_field *fields;  /**< Fields of all records, in order. */
+  size_t num_fields;         /**< Number of fields in the index. */
+  size_t fields_capacity;    /**< Allocated number of fields. */
+  size_t *records;           /**< Index of the first field of each record,
+                                  followed by num_fields. */
+  size_t num_records;        /**< Number of records in the index. */
+  size_t records_capacity;   /**< Allocated number of record entries. */
+} string_csv;
+
+/**
+ * @brief Initialize a CSV parser.
+ *
+ * @param csv Pointer to the parser to initialize.
+ * @param delimiter The field delimiter, such as ',' or '\t'.
+ * @param quote The quote character, usually '"', or '\0' to disable quoting.
+ */
+void string_csv_init(string_csv *csv, char delimiter, char quote);
+
+/**
+ * @brief Free the index owned by a CSV parser.
+ *
+ * @param csv Pointer to the parser.
+ */
+void string_csv_destroy(string_csv *csv);
+
+/**
+ * @brief Parse delimited records following RFC 4180 quoting rules.
+ *
+ * The index is cleared and refilled with every complete record in the input.
+ * Quoted fields may contain delimiters, newlines and doubled quotes; CRLF and
+ * LF line endings are accepted. Field views point into data, which must stay
+ * alive while they are used.
+ *
+ * For streaming, pass final as false: the bytes of a trailing incomplete
+ * record are left unparsed and should be passed again at the start of the
+ * next call, followed by more input.
+ *
+ * @param csv Pointer to the parser.
+ * @param data The input bytes.
+ * @param length The number of input bytes.
+ * @param final True if the input ends with the last record, which may then
+ * lack a line ending.
+ * @return The number of bytes consumed.
+ */
+size_t string_csv_parse_n(string_csv *csv, const char *data, size_t length,
+                          bool final);
+
+/**
+ * @brief Parse delimited records from a string. See string_csv_parse_n.
+ *
+ * @param csv Pointer to the parser.
+ * @param str The input string.
+ * @param final True if the string ends with the last record.
+ * @return The number of bytes consumed.
+ */
+size_t string_csv_parse(string_csv *csv, const string *str, bool final);
+
+/**
+ * @brief Parse a complete input on several threads.
+ *
+ * A first pass counts quotes per chunk to find where each chunk's first
+ * record begins; the chunks are then parsed independently and their indexes
+ * concatenated in order. The thread count is capped at the number of online
+ * CPUs and at one thread per MiB of input; a single thread parses on the
+ * calling thread with string_csv_parse_n.
+ *
+ * @param csv Pointer to the parser.
+ * @param data The input bytes.
+ * @param length The number of input bytes.
+ * @param threads The maximum number of threads to use.
+ * @return True if the whole input was indexed.
+ */
+bool string_csv_parse_parallel(string_csv *csv, const char *data,
+                               size_t length, size_t threads);
+
+/**
+ * @brief Get the fields of a parsed record.
+ *
+ * @param csv Pointer to the parser.
+ * @param index The index of the record.
+ * @param num_fields Receives the number of fields in the record.
+ * @return The first field of the record, or NULL if index is out of range.
+ */
+const string_csv_field *string_csv_record(const string_csv *csv, size_t index,
+                                          size_t *num_fields);
+
+/**
+ * @brief Copy a field into a new string, collapsing doubled quotes.
+ *
+ * @param csv Pointer to the parser that produced the field.
+ * @param field The field to copy.
+ * @return A newly allocated string.
+ */
+string *string_csv_field_string(const string_csv *csv,
+                                const string_csv_field *field);
+
+/**
+ * @brief Append src to dst escaped for use inside a JSON string literal.
+ * Quotes, backslashes and control characters are escaped.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The string to escape. May be *dst itself.
+ */
+void string_json_escape(string **dst, const string *src);
+
+/**
+ * @brief Append length bytes from src to dst escaped for a JSON string.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to escape. Must not point into *dst.
+ * @param length The number of bytes in src.
+ */
+void string_json_escape_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Append the unescaped contents of a JSON string literal (without its
+ * enclosing quotes) to dst. \\u escapes, including surrogate pairs, are
+ * decoded to UTF-8.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The escaped string. May be *dst itself.
+ * @return True on success. On invalid input, dst is left unchanged and false
+ * is returned.
+ */
+bool string_json_unescape(string **dst, const string *src);
+
+/**
+ * @brief Append the unescaped contents of length bytes of a JSON string
+ * literal to dst. See string_json_unescape.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The escaped bytes. Must not point into *dst.
+ * @param length The number of bytes in src.
+ * @return True on success, false on invalid input.
+ */
+bool string_json_unescape_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Append src to dst with &, <, >, " and ' replaced by HTML entities.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The string to escape. May be *dst itself.
+ */
+void string_html_escape(string **dst, const string *src);
+
+/**
+ * @brief Append length bytes from src to dst escaped for HTML.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to escape. Must not point into *dst.
+ * @param length The number of bytes in src.
+ */
+void string_html_escape_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Append src to dst with HTML entities decoded. The entities produced
+ * by string_html_escape, &apos; and numeric character references are
+ * recognised; other entities are copied as they are.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The escaped string. May be *dst itself.
+ * @return True if every entity was recognised, false otherwise.
+ */
+bool string_html_unescape(string **dst, const string *src);
+
+/**
+ * @brief Append length bytes from src to dst with HTML entities decoded.
+ * See string_html_unescape.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The escaped bytes. Must not point into *dst.
+ * @param length The number of bytes in src.
+ * @return True if every entity was recognised, false otherwise.
+ */
+bool string_html_unescape_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Append src to dst percent-encoded. Only the RFC 3986 unreserved
+ * characters (letters, digits, '-', '.', '_' and '~') are kept.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The string to encode. May be *dst itself.
+ */
+void string_url_encode(string **dst, const string *src);
+
+/**
+ * @brief Append length bytes from src to dst percent-encoded.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. Must not point into *dst.
+ * @param length The number of bytes in src.
+ */
+void string_url_encode_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Append src to dst with percent-encoded bytes decoded.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The encoded string. May be *dst itself.
+ * @return True on success. If a '%' is not followed by two hex digits, dst is
+ * left unchanged and false is returned.
+ */
+bool string_url_decode(string **dst, const string *src);
+
+/**
+ * @brief Append length bytes from src to dst with percent-encoded bytes
+ * decoded. See string_url_decode.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The encoded bytes. Must not point into *dst.
+ * @param length The number of bytes in src.
+ * @return True on success, false on invalid input.
+ */
+bool string_url_decode_n(string **dst, const char *src, size_t length);
+
+/** Base64 alphabets (RFC 4648). */
+typedef enum string_base64_alphabet {
+  STRING_BASE64_STANDARD, /**< A-Z a-z 0-9 + /, padded with '=' */
+  STRING_BASE64_URL,      /**< A-Z a-z 0-9 - _, unpadded */
+} string_base64_alphabet;
+
+/**
+ * @brief State for encoding or decoding base64 in chunks.
+ */
+typedef struct string_base64_stream {
+  string_base64_alphabet alphabet; /**< Alphabet used by every chunk. */
+  char pending[4];    /**< Bytes or characters carried over to the next
+                           chunk. */
+  size_t num_pending; /**< Number of bytes in pending. */
+  bool finished;      /**< Decoding only: the padded final quantum was
+                           seen. */
+} string_base64_stream;
+
+/**
+ * @brief Append the base64 encoding of src to dst. The standard alphabet is
+ * padded with '=', the URL-safe alphabet is not.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. May be *dst itself.
+ * @param alphabet The alphabet to use.
+ */
+void string_base64_encode(string **dst, const string *src,
+                          string_base64_alphabet alphabet);
+
+/**
+ * @brief Append the base64 encoding of length bytes from src to dst.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. Must not point into *dst.
+ * @param length The number of bytes in src.
+ * @param alphabet The alphabet to use.
+ */
+void string_base64_encode_n(string **dst, const void *src, size_t length,
+                            string_base64_alphabet alphabet);
+
+/**
+ * @brief Append the bytes encoded by src to dst. Decoding is strict: no
+ * whitespace, padding only at the end (required for the standard alphabet,
+ * optional for the URL-safe one) and unused trailing bits must be zero.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The base64 text. May be *dst itself.
+ * @param alphabet The alphabet src is encoded with.
+ * @return True on success. On invalid input, dst is left unchanged and false
+ * is returned.
+ */
+bool string_base64_decode(string **dst, const string *src,
+                          string_base64_alphabet alphabet);
+
+/**
+ * @brief Append the bytes encoded by length characters of src to dst.
+ * See string_base64_decode.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The base64 text. Must not point into *dst.
+ * @param length The number of characters in src.
+ * @param alphabet The alphabet src is encoded with.
+ * @return True on success, false on invalid input.
+ */
+bool string_base64_decode_n(string **dst, const char *src, size_t length,
+                            string_base64_alphabet alphabet);
+
+/**
+ * @brief Initialize a base64 stream. A stream is used either for encoding or
+ * for decoding, and needs no cleanup.
+ *
+ * @param stream The stream to initialize.
+ * @param alphabet The alphabet to use.
+ */
+void string_base64_stream_init(string_base64_stream *stream,
+                               string_base64_alphabet alphabet);
+
+/**
+ * @brief Encode a chunk of input, appending the complete output to dst.
+ * Up to two bytes are carried over to the next call.
+ *
+ * @param stream The stream.
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. Must not point into *dst.
+ * @param length The number of bytes in src.
+ */
+void string_base64_encode_update(string_base64_stream *stream, string **dst,
+                                 const void *src, size_t length);
+
+/**
+ * @brief Encode the bytes carried over by the stream, with padding.
+ *
+ * @param stream The stream.
+ * @param dst Pointer to the pointer of the destination string.
+ */
+void string_base64_encode_final(string_base64_stream *stream, string **dst);
+
+/**
+ * @brief Decode a chunk of base64 text, appending the decoded bytes to dst.
+ * Chunks may split quanta anywhere.
+ *
+ * @param stream The stream.
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The base64 text. Must not point into *dst.
+ * @param length The number of characters in src.
+ * @return True on success. On invalid input, false is returned; output from
+ * this chunk is discarded, output from earlier chunks is kept and the stream
+ * is left as it was before the call.
+ */
+bool string_base64_decode_update(string_base64_stream *stream, string **dst,
+                                 const char *src, size_t length);
+
+/**
+ * @brief Finish decoding, handling an unpadded final quantum.
+ *
+ * @param stream The stream.
+ * @param dst Pointer to the pointer of the destination string.
+ * @return True if the input ended on a valid boundary.
+ */
+bool string_base64_decode_final(string_base64_stream *stream, string **dst);
+
+/**
+ * @brief Append the lowercase hex encoding of src to dst.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. May be *dst itself.
+ */
+void string_hex_encode(string **dst, const string *src);
+
+/**
+ * @brief Append the lowercase hex encoding of length bytes from src to dst.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The bytes to encode. Must not point into *dst.
+ * @param length The number of bytes in src.
+ */
+void string_hex_encode_n(string **dst, const void *src, size_t length);
+
+/**
+ * @brief Append the bytes encoded by the hex digits in src to dst. Both
+ * cases are accepted. Since each byte is two digits, inputs can be decoded
+ * in chunks of even length.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The hex text. May be *dst itself.
+ * @return True on success. On an odd length or a non-hex character, dst is
+ * left unchanged and false is returned.
+ */
+bool string_hex_decode(string **dst, const string *src);
+
+/**
+ * @brief Append the bytes encoded by length hex digits of src to dst.
+ * See string_hex_decode.
+ *
+ * @param dst Pointer to the pointer of the destination string.
+ * @param src The hex text. Must not point into *dst.
+ * @param length The number of characters in src.
+ * @return True on success, false on invalid input.
+ */
+bool string_hex_decode_n(string **dst, const char *src, size_t length);
+
+/**
+ * @brief Write the contents of strings to fd, in order, with as few writev
+ * calls as possible. Each call carries up to IOV_MAX strings; partial writes
+ * and EINTR are retried, so fd should be in blocking mode.
+ *
+ * @param fd The file descriptor to write to.
+ * @param strings The strings to write.
+ * @param count The number of strings.
+ * @return The number of bytes written, or -1 with errno set on error. On
+ * error, an unknown prefix of the data may have been written.
+ */
+ssize_t string_write_all(int fd, string **strings, size_t count);
+
+/**
+ * @brief Writes batches of strings to a file descriptor. On Linux, writes are
+ * queued on an io_uring so that one system call flushes many writev batches;
+ * elsewhere, or if the ring cannot be set up, writes use string_write_all.
+ */
+typedef struct string_writer {
+  int fd;                    /**< The file descriptor written to. */
+  struct string_uring *ring; /**< NULL when writing through writev. */
+} string_writer;
+
+/**
+ * @brief Initialize a writer.
+ *
+ * @param writer The writer to initialize.
+ * @param fd The file descriptor to write to, in blocking mode.
+ * @param queue_depth The number of writev batches (of up to IOV_MAX strings
+ * each) submitted per system call, capped at 64. 0 disables io_uring.
+ */
+void string_writer_init(string_writer *writer, int fd, unsigned queue_depth);
+
+/**
+ * @brief Check whether the writer submits through io_uring.
+ *
+ * @param writer The writer.
+ * @return True if writes go through io_uring, false if they use writev.
+ */
+bool string_writer_uses_uring(const string_writer *writer);
+
+/**
+ * @brief Write the contents of strings to the writer's file descriptor, in
+ * order. Returns once everything has been written.
+ *
+ * @param writer The writer.
+ * @param strings The strings to write.
+ * @param count The number of strings.
+ * @return The number of bytes written, or -1 with errno set on error.
+ */
+ssize_t string_writer_write(string_writer *writer, string **strings,
+                            size_t count);
+
+/**
+ * @brief Release the writer's io_uring, if any. The file descriptor is not
+ * closed.
+ *
+ * @param writer The writer.
+ */
+void string_writer_destroy(string_writer *writer);
+
+/**
+ * @brief A string that can be kept compressed while it is not being used.
+ * The value is decompressed on first access and stays decompressed until it
+ * is compressed again, typically by string_cold_sweep. A string_cold is not
+ * thread-safe.
+ */
+typedef struct string_cold {
+  string *value;             /**< The value, or NULL while compressed. */
+  unsigned char *compressed; /**< LZ4 block while compressed, else NULL. */
+  size_t compressed_length;  /**< Size of the compressed block. */
+  size_t length;             /**< Length of the value while compressed. */
+  uint64_t last_access;      /**< Monotonic time of the last access, in ns. */
+} string_cold;
+
+/**
+ * @brief Decides which strings string_cold_sweep compresses.
+ */
+typedef struct string_cold_policy {
+  size_t min_length;   /**< Leave values shorter than this uncompressed. */
+  double idle_seconds; /**< Only compress values idle for this long. */
+  /** Optional final say, called for values that pass the checks above. */
+  bool (*should_compress)(const string_cold *cold, void *user_data);
+  void *user_data; /**< Passed to should_compress. */
+} string_cold_policy;
+
+/**
+ * @brief Process-wide compression statistics.
+ */
+typedef struct string_cold_stats {
+  uint64_t compressions;     /**< Values compressed. */
+  uint64_t rejected;         /**< Values left as they were because they did
+                                  not shrink. */
+  uint64_t decompressions;   /**< Values decompressed, including scratch
+                                  reads. */
+  uint64_t compress_ns;      /**< CPU time spent compressing, summed over
+                                  threads. */
+  uint64_t decompress_ns;    /**< CPU time spent decompressing. */
+  uint64_t original_bytes;   /**< Length of the values currently
+                                  compressed. */
+  uint64_t compressed_bytes; /**< Their compressed size. */
+} string_cold_stats;
+
+/**
+ * @brief Initialize a cold string holding value, uncompressed.
+ *
+ * @param cold The cold string to initialize.
+ * @param value The value. Ownership is transferred to the cold string.
+ */
+void string_cold_init(string_cold *cold, string *value);
+
+/**
+ * @brief Compress the value now, releasing the uncompressed copy.
+ * Shared and static strings, and values that do not shrink, are left as
+ * they are.
+ *
+ * @param cold The cold string.
+ * @return True if the value is now stored compressed.
+ */
+bool string_cold_compress(string_cold *cold);
+
+/**
+ * @brief Check whether the value is currently stored compressed.
+ *
+ * @param cold The cold string.
+ * @return True if compressed.
+ */
+bool string_cold_is_compressed(const string_cold *cold);
+
+/**
+ * @brief Get the value, decompressing it if necessary, and record the
+ * access.
+ *
+ * @param cold The cold string.
+ * @return The value. It remains owned by the cold string and is valid until
+ * the cold string is compressed or destroyed. It must not be modified; to
+ * change it, destroy the cold string and initialize it with a new value.
+ */
+const string *string_cold_get(string_cold *cold);
+
+/**
+ * @brief Copy the value, null-terminated, into a caller buffer without
+ * changing how it is stored.
+ *
+ * @param cold The cold string.
+ * @param scratch The buffer to fill.
+ * @param size The size of scratch; at least the value's length + 1.
+ * @return False if scratch is too small.
+ */
+bool string_cold_read(const string_cold *cold, char *scratch, size_t size);
+
+/**
+ * @brief Get the number of heap bytes used to store the value.
+ *
+ * @param cold The cold string.
+ * @return The compressed size, or the size of the string block.
+ */
+size_t string_cold_footprint(const string_cold *cold);
+
+/**
+ * @brief Compress the items that the policy selects.
+ *
+ * @param items The cold strings to consider.
+ * @param count The number of items.
+ * @param policy The compression policy.
+ * @return The number of items compressed by this call.
+ */
+size_t string_cold_sweep(string_cold items[], size_t count,
+                         const string_cold_policy *policy);
+
+/**
+ * @brief Free the value, compressed or not.
+ *
+ * @param cold The cold string.
+ */
+void string_cold_destroy(string_cold *cold);
+
+/**
+ * @brief Read the process-wide compression statistics.
+ *
+ * @param stats Filled with the current statistics.
+ */
+void string_cold_stats_get(string_cold_stats *stats);
+
+/**
+ * @brief Reset the counters and timers. original_bytes and compressed_bytes
+ * describe live values and are not reset.
+ */
+void string_cold_stats_reset(void);
+
+/** Parts of a string_index to build. */
+typedef enum string_index_parts {
+  STRING_INDEX_SUFFIX_ARRAY = 1, /**< Keep the text and its suffix array:
+                                      about 5 bytes per text byte, and the
+                                      fastest queries. */
+  STRING_INDEX_FM = 2,           /**< Build an FM-index: about 1.4 bytes per
+                                      text byte, without the text. */
+  STRING_INDEX_ALL = STRING_INDEX_SUFFIX_ARRAY | STRING_INDEX_FM,
+} string_index_parts;
+
+/**
+ * @brief A substring index over an immutable text. Once built, queries take
+ * time proportional to the pattern length (times log n for the suffix
+ * array) plus the number of occurrences reported, instead of a scan of the
+ * text. An index is read-only and may be queried from several threads.
+ */
+typedef struct string_index {
+  string *text;           /**< Shared reference to the text, or NULL if only
+                               the FM-index is kept. */
+  size_t length;          /**< Length of the text. */
+  uint32_t *sa;           /**< Suffix array of length + 1 rows, or NULL. */
+  struct string_fm *fm;   /**< FM-index, or NULL. */
+  struct string_rmq *rmq; /**< Range minima of text positions by row. */
+} string_index;
+
+/**
+ * @brief Build an index over text using SA-IS suffix array construction.
+ * When both parts are built, queries use the suffix array.
+ *
+ * @param index The index to build.
+ * @param text The text to index. It is shared, not copied, and must not be
+ * modified while the index exists. Texts of 4 GiB or more are not supported.
+ * @param parts A combination of string_index_parts.
+ * @return True on success.
+ */
+bool string_index_build(string_index *index, const string *text,
+                        unsigned parts);
+
+/**
+ * @brief Count the occurrences of a pattern (overlapping ones included).
+ *
+ * @param index The index.
+ * @param pattern The pattern.
+ * @param length The length of the pattern.
+ * @return The number of occurrences. An empty pattern matches at every
+ * position, including the end.
+ */
+size_t string_index_count(const string_index *index, const char *pattern,
+                          size_t length);
+
+/**
+ * @brief Find the first occurrence of a pattern. This takes the time of
+ * count plus a bounded number of locates, however often the pattern occurs.
+ *
+ * @param index The index.
+ * @param pattern The pattern.
+ * @param length The length of the pattern.
+ * @return The smallest position where the pattern occurs, or -1.
+ */
+ssize_t string_index_find(const string_index *index, const char *pattern,
+                          size_t length);
+
+/**
+ * @brief Locate the occurrences of a pattern.
+ *
+ * @param index The index.
+ * @param pattern The pattern.
+ * @param length The length of the pattern.
+ * @param positions Filled with up to max_positions positions in ascending
+ * order. Which occurrences are reported when there are more is unspecified.
+ * @param max_positions The capacity of positions.
+ * @return The total number of occurrences.
+ */
+size_t string_index_locate(const string_index *index, const char *pattern,
+                           size_t length, size_t positions[],
+                           size_t max_positions);
+
+/**
+ * @brief Save the index to a file. The format uses native byte order.
+ *
+ * @param index The index.
+ * @param path The file to write.
+ * @return True on success.
+ */
+bool string_index_save(const string_index *index, const char *path);
+
+/**
+ * @brief Load an index written by string_index_save.
+ *
+ * @param index The index to initialize.
+ * @param path The file to read.
+ * @return True on success. On failure the index is left empty.
+ */
+bool string_index_load(string_index *index, const char *path);
+
+/**
+ * @brief Get the number of bytes used by the index, including the text when
+ * the suffix array is kept.
+ *
+ * @param index The index.
+ * @return The size in bytes.
+ */
+size_t string_index_memory(const string_index *index);
+
+/**
+ * @brief Free the index and release its reference to the text.
+ *
+ * @param index The index.
+ */
+void string_index_destroy(string_index *index);
+
+/**
+ * @brief A needle prepared for repeated searches. The search algorithm and
+ * its tables are set up once, by string_finder_init; after that the finder
+ * is read-only and can be used from several threads at once.
+ */
+typedef struct string_finder {
+  char *needle;   /**< Copy of the needle. */
+  size_t length;  /**< Length of the needle. */
+  size_t *shift;  /**< Horspool shifts for long needles, otherwise NULL. */
+  size_t *rshift; /**< Shifts for searching backwards, otherwise NULL. */
+} string_finder;
+
+/**
+ * @brief Prepare a finder for a needle.
+ *
+ * @param finder The finder to initialize.
+ * @param needle The needle; it is copied.
+ * @param length The length of the needle.
+ */
+void string_finder_init(string_finder *finder, const char *needle,
+                        size_t length);
+
+/**
+ * @brief Find the first occurrence of the needle in haystack.
+ *
+ * @param finder The finder.
+ * @param haystack The string to search.
+ * @return The position of the first occurrence, or -1. An empty needle is
+ * found at 0.
+ */
+ssize_t string_finder_find(const string_finder *finder, const string *haystack);
+
+/**
+ * @brief Find the first occurrence of the needle in length bytes of
+ * haystack.
+ *
+ * @param finder The finder.
+ * @param haystack The bytes to search.
+ * @param length The number of bytes in haystack.
+ * @return The position of the first occurrence, or -1.
+ */
+ssize_t string_finder_find_n(const string_finder *finder, const char *haystack,
+                             size_t length);
+
+/**
+ * @brief Find the last occurrence of the needle in haystack.
+ *
+ * @param finder The finder.
+ * @param haystack The string to search.
+ * @return The position of the last occurrence, or -1. An empty needle is
+ * found at the end of haystack.
+ */
+ssize_t string_finder_rfind(const string_finder *finder,
+                            const string *haystack);
+
+/**
+ * @brief Find the last occurrence of the needle in length bytes of haystack.
+ *
+ * @param finder The finder.
+ * @param haystack The bytes to search.
+ * @param length The number of bytes in haystack.
+ * @return The position of the last occurrence, or -1.
+ */
+ssize_t string_finder_rfind_n(const string_finder *finder,
+                              const char *haystack, size_t length);
+
+/**
+ * @brief Find the non-overlapping occurrences of the needle in haystack,
+ * scanning left to right as string_replace_all does.
+ *
+ * @param finder The finder.
+ * @param haystack The string to search.
+ * @param positions Filled with the positions of the first max_positions
+ * occurrences. May be NULL if max_positions is 0.
+ * @param max_positions The capacity of positions.
+ * @return The total number of occurrences.
+ */
+size_t string_finder_find_all(const string_finder *finder,
+                              const string *haystack, size_t positions[],
+                              size_t max_positions);
+
+/**
+ * @brief Find the non-overlapping occurrences of the needle in length bytes
+ * of haystack. See string_finder_find_all.
+ *
+ * @param finder The finder.
+ * @param haystack The bytes to search.
+ * @param length The number of bytes in haystack.
+ * @param positions Filled with the positions of the first occurrences.
+ * @param max_positions The capacity of positions.
+ * @return The total number of occurrences.
+ */
+size_t string_finder_find_all_n(const string_finder *finder,
+                                const char *haystack, size_t length,
+                                size_t positions[], size_t max_positions);
+
+/**
+ * @brief Free the finder's copy of the needle and its tables.
+ *
+ * @param finder The finder.
+ */
+void string_finder_destroy(string_finder *finder);
+
+/**
+ * @brief A read-only collection of strings mapped from a file written by
+ * string_table_write. Opening a table maps the file and does not parse it or
+ * allocate. Entries are static strings inside the mapping, so they can be
+ * used with any function that takes a const string *, until the table is
+ * closed.
+ */
+typedef struct string_table {
+  const void *map;         /**< The mapped file. */
+  size_t map_size;         /**< Size of the mapping. */
+  size_t count;            /**< Number of entries. */
+  const uint64_t *offsets; /**< File offset of each entry. */
+  const uint64_t *buckets; /**< Hash index, or NULL if the file has none. */
+  size_t num_buckets;      /**< Number of hash buckets. */
+} string_table;
+
+/**
+ * @brief Write strings to a table file. The file is written under a
+ * temporary name and renamed into place. The format is versioned, records
+ * the byte order and word size of the writer, and carries a checksum.
+ *
+ * @param path The file to write.
+ * @param strings The strings to store, in order.
+ * @param count The number of strings.
+ * @param hash_index Whether to include a hash index for string_table_find.
+ * @return True on success.
+ */
+bool string_table_write(const char *path, const string *strings[],
+                        size_t count, bool hash_index);
+
+/**
+ * @brief Map a table file. The header and section bounds are always
+ * checked, and each entry is bounds-checked when it is read; with verify,
+ * the checksum and every entry are checked up front as well, which reads
+ * the whole file.
+ *
+ * @param table The table to open.
+ * @param path The file to map.
+ * @param verify Whether to verify the checksum and entries.
+ * @return True on success. On failure the table is left empty.
+ */
+bool string_table_open(string_table *table, const char *path, bool verify);
+
+/**
+ * @brief Get an entry.
+ *
+ * @param table The table.
+ * @param index The index of the entry.
+ * @return A view of the entry, valid until the table is closed, or NULL if
+ * index is out of range or the entry does not lie within the file.
+ */
+const string *string_table_get(const string_table *table, size_t index);
+
+/**
+ * @brief Look up an entry by value using the hash index.
+ *
+ * @param table The table.
+ * @param key The value to look up.
+ * @param length The length of key.
+ * @return The index of the first entry equal to key, or -1 if there is none
+ * or the table has no hash index.
+ */
+ssize_t string_table_find(const string_table *table, const char *key,
+                          size_t length);
+
+/**
+ * @brief Unmap the table. Views obtained from it become invalid.
+ *
+ * @param table The table.
+ */
+void string_table_close(string_table *table);
+
+/**
+ * @brief A byte queue over a string: bytes are appended at the back and
+ * consumed from the front in O(1), by advancing a head offset instead of
+ * moving what is left as string_remove(&s, 0, n) and string_ltrim do. The
+ * remaining bytes are moved to the front only when an append needs the room
+ * or the consumed prefix grows past a threshold. Suited to protocol parsers
+ * that strip messages off an input buffer.
+ */
+typedef struct string_fifo {
+  string *buffer; /**< Bytes [head, buffer->length) are queued. */
+  size_t head;    /**< Number of consumed bytes at the front of buffer. */
+} string_fifo;
+
+/**
+ * @brief Initialize an empty queue.
+ *
+ * @param fifo Pointer to the queue to initialize.
+ * @param capacity Initial capacity in bytes.
+ */
+void string_fifo_init(string_fifo *fifo, size_t capacity);
+
+/**
+ * @brief Initialize a queue holding the contents of str.
+ *
+ * @param fifo Pointer to the queue to initialize.
+ * @param str The initial contents. Ownership is transferred to the queue.
+ */
+void string_fifo_init_from(string_fifo *fifo, string *str);
+
+/**
+ * @brief Append a null-terminated string to the back of the queue.
+ *
+ * @param fifo Pointer to the queue.
+ * @param data The string to append.
+ */
+void string_fifo_append(string_fifo *fifo, const char *data);
+
+/**
+ * @brief Append length bytes to the back of the queue. data must not point
+ * into the queue itself, since the queued bytes may be moved.
+ *
+ * @param fifo Pointer to the queue.
+ * @param data The bytes to append.
+ * @param length The number of bytes.
+ */
+void string_fifo_append_n(string_fifo *fifo, const char *data, size_t length);
+
+/**
+ * @brief Append a string to the back of the queue.
+ *
+ * @param fifo Pointer to the queue.
+ * @param str The string to append.
+ */
+void string_fifo_append_str(string_fifo *fifo, const string *str);
+
+/**
+ * @brief Get the queued bytes. They are null-terminated.
+ *
+ * @param fifo Pointer to the queue.
+ * @return Pointer to the first queued byte, valid until the queue is next
+ * modified.
+ */
+const char *string_fifo_data(const string_fifo *fifo);
+
+/**
+ * @brief Get the number of queued bytes.
+ *
+ * @param fifo Pointer to the queue.
+ * @return The number of bytes.
+ */
+size_t string_fifo_length(const string_fifo *fifo);
+
+/**
+ * @brief Drop bytes from the front of the queue in O(1) amortized time.
+ *
+ * @param fifo Pointer to the queue.
+ * @param count The number of bytes to drop; clamped to the queue length.
+ */
+void string_fifo_consume(string_fifo *fifo, size_t count);
+
+/**
+ * @brief Drop leading whitespace from the queue.
+ *
+ * @param fifo Pointer to the queue.
+ * @return The number of bytes dropped.
+ */
+size_t string_fifo_ltrim(string_fifo *fifo);
+
+/**
+ * @brief Find the first occurrence of a byte sequence in the queue.
+ *
+ * @param fifo Pointer to the queue.
+ * @param needle The bytes to find.
+ * @param length The length of needle.
+ * @return The position relative to the front of the queue, or -1.
+ */
+ssize_t string_fifo_find_n(const string_fifo *fifo, const char *needle,
+                           size_t length);
+
+/**
+ * @brief Remove bytes from the front of the queue and return them.
+ *
+ * @param fifo Pointer to the queue.
+ * @param count The number of bytes to take; clamped to the queue length.
+ * @return A new string holding the bytes. The caller owns it.
+ */
+string *string_fifo_take(string_fifo *fifo, size_t count);
+
+/**
+ * @brief Turn the queue back into a plain string holding the queued bytes.
+ * The queue is left empty and needs no destroy.
+ *
+ * @param fifo Pointer to the queue.
+ * @return The string. The caller owns it.
+ */
+string *string_fifo_release(string_fifo *fifo);
+
+/**
+ * @brief Free the queue's buffer.
+ *
+ * @param fifo Pointer to the queue.
+ */
+void string_fifo_destroy(string_fifo *fifo);
+
+/**
+ * @brief Kinds of operations in a line pipeline.
+ */
+typedef enum string_pipeline_op_kind {
+  STRING_PIPELINE_FILTER,      /**< Keep lines matching (or not matching) a
+                                    regex. */
+  STRING_PIPELINE_REPLACE_ALL, /**< string_replace_all_n. */
+  STRING_PIPELINE_TOUPPER,     /**< string_toupper. */
+  STRING_PIPELINE_TOLOWER,     /**< string_tolower. */
+  STRING_PIPELINE_TRIM,        /**< string_trim. */
+  STRING_PIPELINE_MAP,         /**< A user callback. */
+} string_pipeline_op_kind;
+
+/**
+ * @brief A per-line callback. It may modify or replace *line and returns
+ * false to drop the line. It runs concurrently on the worker threads.
+ */
+typedef bool (*string_pipeline_map_fn)(string **line, void *user_data);
+
+/**
+ * @brief Receives the output of a pipeline run one chunk at a time: complete
+ * lines, each ending in '\n'. It runs on the thread that called
+ * string_pipeline_run and returns false to stop the run.
+ */
+typedef bool (*string_pipeline_sink_fn)(const char *data, size_t length,
+                                        void *user_data);
+
+/**
+ * @brief An operation in a line pipeline.
+ */
+typedef struct string_pipeline_op {
+  string_pipeline_op_kind kind; /**< What the operation does. */
+  string *pattern;              /**< FILTER regex or REPLACE_ALL search
+                                     bytes. */
+  string *replacement;          /**< REPLACE_ALL replacement bytes. */
+  bool invert;                  /**< FILTER keeps the lines that do not
+                                     match. */
+  string_pipeline_map_fn map;   /**< MAP callback. */
+  void *user_data;              /**< Passed to map. */
+} string_pipeline_op;
+
+/**
+ * @brief Applies a chain of operations to every line of a large input on
+ * several threads.
+ *
+ * The input is cut into chunks of about chunk_size bytes that end on line
+ * boundaries. Idle workers claim the next chunk, run each line through the
+ * operations in the order they were added and collect the surviving lines.
+ * At most max_in_flight chunk outputs exist at once, so memory stays bounded
+ * however large the input and however slow the sink.
+ */
+typedef struct string_pipeline {
+  string_pipeline_op *ops; /**< Operations, in order. */
+  size_t num_ops;          /**< Number of operations. */
+  size_t ops_capacity;     /**< Allocated number of operations. */
+  size_t threads;          /**< Worker threads; 0 uses every online CPU. */
+  size_t chunk_size;       /**< Target bytes per chunk. */
+  size_t max_in_flight;    /**< Chunks being processed or awaiting the sink;
+                                0 uses twice the number of threads. */
+  bool ordered;            /**< Deliver chunks in input order. */
+  size_t lines_read;       /**< Lines read by the last run. */
+  size_t lines_written;    /**< Lines passed to the sink by the last run. */
+} string_pipeline;
+
+/**
+ * @brief Initialize an empty pipeline that uses every CPU, 1 MiB chunks and
+ * ordered output.
+ *
+ * @param pipeline Pointer to the pipeline to initialize.
+ */
+void string_pipeline_init(string_pipeline *pipeline);
+
+/**
+ * @brief Free the operations of a pipeline.
+ *
+ * @param pipeline Pointer to the pipeline.
+ */
+void string_pipeline_destroy(string_pipeline *pipeline);
+
+/**
+ * @brief Add a filter keeping the lines that match an extended regular
+ * expression, as string_match does. The regex is compiled once per worker
+ * for each run.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param regex The regular expression.
+ * @param invert Keep the lines that do not match instead.
+ * @return False if the regex does not compile; nothing is added then.
+ */
+bool string_pipeline_filter(string_pipeline *pipeline, const char *regex,
+                            bool invert);
+
+/**
+ * @brief Add a replacement of every occurrence of a string in each line.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param find_str The non-empty substring to find.
+ * @param replace_str The string to replace it with.
+ */
+void string_pipeline_replace_all(string_pipeline *pipeline,
+                                 const char *find_str, const char *replace_str);
+
+/**
+ * @brief Add a replacement of every occurrence of a byte sequence in each
+ * line.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param find_str The bytes to find.
+ * @param find_len The number of bytes in find_str; must not be 0.
+ * @param replace_str The replacement bytes.
+ * @param replace_len The number of bytes in replace_str.
+ */
+void string_pipeline_replace_all_n(string_pipeline *pipeline,
+                                   const char *find_str, size_t find_len,
+                                   const char *replace_str,
+                                   size_t replace_len);
+
+/**
+ * @brief Add a conversion of each line to uppercase.
+ *
+ * @param pipeline Pointer to the pipeline.
+ */
+void string_pipeline_toupper(string_pipeline *pipeline);
+
+/**
+ * @brief Add a conversion of each line to lowercase.
+ *
+ * @param pipeline Pointer to the pipeline.
+ */
+void string_pipeline_tolower(string_pipeline *pipeline);
+
+/**
+ * @brief Add removal of leading and trailing white space from each line.
+ *
+ * @param pipeline Pointer to the pipeline.
+ */
+void string_pipeline_trim(string_pipeline *pipeline);
+
+/**
+ * @brief Add a user callback. See string_pipeline_map_fn.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param map The callback. It must be safe to call from several threads.
+ * @param user_data Passed to map.
+ */
+void string_pipeline_map(string_pipeline *pipeline, string_pipeline_map_fn map,
+                         void *user_data);
+
+/**
+ * @brief Run the pipeline over newline-delimited input.
+ *
+ * Lines are split on '\n', which is not part of the line; a last line without
+ * one is still processed. Each surviving line is written followed by '\n'.
+ * The lines of a chunk reach the sink together; with ordered unset, chunks
+ * reach it in the order they finish.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param data The input bytes.
+ * @param length The number of input bytes.
+ * @param sink Receives the output.
+ * @param user_data Passed to sink.
+ * @return False if the sink stopped the run.
+ */
+bool string_pipeline_run(string_pipeline *pipeline, const char *data,
+                         size_t length, string_pipeline_sink_fn sink,
+                         void *user_data);
+
+/**
+ * @brief Run the pipeline over a file, which is mapped rather than read.
+ * See string_pipeline_run.
+ *
+ * @param pipeline Pointer to the pipeline.
+ * @param path The path of the file.
+ * @param sink Receives the output.
+ * @param user_data Passed to sink.
+ * @return False if the file could not be mapped or the sink stopped the run.
  */
-void string_ltrim(string *str);
+bool string_pipeline_run_file(string_pipeline *pipeline, const char *path,
+                              string_pipeline_sink_fn sink, void *user_data);
 
 #endif /* __STRING_H__ */
@@ -0,0 +1,593 @@
+#include "string.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double seconds, size_t iterations) {
+  printf("%-40s %10.1f ns/op\n", name, seconds * 1e9 / iterations);
+}
+
+// Compare the strlen-based API with the length-taking variants on long inputs.
+void bench_strlen_savings() {
+  const size_t chunk_len = 64 * 1024;
+  const size_t iterations = 2000;
+
+  char *chunk = malloc(chunk_len + 1);
+  memset(chunk, 'x', chunk_len);
+  chunk[chunk_len] = '\0';
+
+  string *str = string_alloc("");
+  double start = now_seconds();
+  for (size_t i = 0; i < iterations; i++) {
+    string_append(&str, chunk);
+  }
+  report("string_append (64 KiB)", now_seconds() - start, iterations);
+  string_destroy(str);
+
+  str = string_alloc("");
+  start = now_seconds();
+  for (size_t i = 0; i < iterations; i++) {
+    string_append_n(&str, chunk, chunk_len);
+  }
+  report("string_append_n (64 KiB)", now_seconds() - start, iterations);
+
+  volatile size_t matches = 0;
+  start = now_seconds();
+  for (size_t i = 0; i < iterations; i++) {
+    matches += string_startswith(str, chunk);
+  }
+  report("string_startswith (64 KiB)", now_seconds() - start, iterations);
+
+  start = now_seconds();
+  for (size_t i = 0; i < iterations; i++) {
+    matches += string_startswith_n(str, chunk, chunk_len);
+  }
+  report("string_startswith_n (64 KiB)", now_seconds() - start, iterations);
+  string_destroy(str);
+
+  const size_t num_parts = 1000;
+  const char **parts = malloc(num_parts * sizeof(char *));
+  size_t *lengths = malloc(num_parts * sizeof(size_t));
+  for (size_t i = 0; i < num_parts; i++) {
+    parts[i] = chunk;
+    lengths[i] = chunk_len;
+  }
+
+  start = now_seconds();
+  for (size_t i = 0; i < 20; i++) {
+    string_destroy(string_join(parts, num_parts, ","));
+  }
+  report("string_join (1000 x 64 KiB)", now_seconds() - start, 20);
+
+  start = now_seconds();
+  for (size_t i = 0; i < 20; i++) {
+    string_destroy(string_join_n(parts, lengths, num_parts, ",", 1));
+  }
+  report("string_join_n (1000 x 64 KiB)", now_seconds() - start, 20);
+
+  free(lengths);
+  free(parts);
+  free(chunk);
+}
+
+// Build a 64 MiB string from small appends.
+void bench_builder() {
+  const char line[] =
+      "0123456789abcdef0123456789abcdef0123456789abcdef012345678\n";
+  const size_t line_len = sizeof(line) - 1;
+  const size_t iterations = (64 * 1024 * 1024) / line_len;
+
+  double start = now_seconds();
+  string *str = string_alloc("");
+  for (size_t i = 0; i < iterations; i++) {
+    string_append_n(&str, line, line_len);
+  }
+  report("string_append_n (64 MiB total)", now_seconds() - start, iterations);
+  string_destroy(str);
+
+  start = now_seconds();
+  string_builder builder;
+  string_builder_init(&builder, 0);
+  for (size_t i = 0; i < iterations; i++) {
+    string_builder_append_n(&builder, line, line_len);
+  }
+  report("string_builder_append_n (64 MiB total)", now_seconds() - start,
+         iterations);
+
+  start = now_seconds();
+  str = string_builder_to_string(&builder);
+  report("string_builder_to_string (64 MiB)", now_seconds() - start, 1);
+  string_destroy(str);
+  string_builder_destroy(&builder);
+}
+
+// Score one query against a dictionary of short words.
+void bench_edit_distance() {
+  const size_t count = 100000;
+  string **words = malloc(count * sizeof(string *));
+  size_t *distances = malloc(count * sizeof(size_t));
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    char word[16];
+    size_t length = 4 + rand() % 10;
+    for (size_t j = 0; j < length; j++) {
+      word[j] = 'a' + rand() % 26;
+    }
+    words[i] = string_alloc_n(word, length);
+  }
+  const string *query = STRING_LITERAL("autocomplete");
+
+  double start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    distances[i] = string_levenshtein(query, words[i], SIZE_MAX);
+  }
+  report("string_levenshtein", now_seconds() - start, count);
+
+  start = now_seconds();
+  string_levenshtein_batch(query, (const string **)words, count, SIZE_MAX,
+                           distances);
+  report("string_levenshtein_batch", now_seconds() - start, count);
+
+  substring_free(words, count);
+  free(distances);
+}
+
+static int compare_strcmp(const void *a, const void *b) {
+  return strcmp((*(const string **)a)->data, (*(const string **)b)->data);
+}
+
+// Sort log keys sharing long timestamp prefixes.
+void bench_sort() {
+  const size_t count = 1000000;
+  string **keys = malloc(count * sizeof(string *));
+  string **work = malloc(count * sizeof(string *));
+  srand(2);
+  for (size_t i = 0; i < count; i++) {
+    char key[64];
+    int n = snprintf(key, sizeof(key), "2023-08-13T%02d:%02d:%02d.%06d host-%d",
+                     rand() % 24, rand() % 60, rand() % 60, rand() % 1000000,
+                     rand() % 100);
+    keys[i] = string_alloc_n(key, n);
+  }
+
+  memcpy(work, keys, count * sizeof(string *));
+  double start = now_seconds();
+  qsort(work, count, sizeof(string *), compare_strcmp);
+  report("qsort + strcmp (1M keys)", now_seconds() - start, count);
+
+  memcpy(work, keys, count * sizeof(string *));
+  start = now_seconds();
+  string_sort(work, count);
+  report("string_sort (1M keys)", now_seconds() - start, count);
+
+  memcpy(work, keys, count * sizeof(string *));
+  start = now_seconds();
+  string_sort_parallel(work, count, 4);
+  report("string_sort_parallel x4 (1M keys)", now_seconds() - start, count);
+
+  free(work);
+  substring_free(keys, count);
+}
+
+// Index 64 MiB of CSV.
+void bench_csv() {
+  string_builder builder;
+  string_builder_init(&builder, 64 * 1024 * 1024);
+  while (builder.length < 64 * 1024 * 1024) {
+    string_builder_append(&builder, "2023-08-13,GET,/index.html,200,\"Mozilla/"
+                                    "5.0 (X11; Linux x86_64)\",1532\n");
+  }
+  string *input = string_builder_to_string(&builder);
+  string_builder_destroy(&builder);
+
+  string_csv csv;
+  string_csv_init(&csv, ',', '"');
+  double start = now_seconds();
+  string_csv_parse(&csv, input, true);
+  report("string_csv_parse, cold (per byte)", now_seconds() - start,
+         input->length);
+
+  start = now_seconds();
+  string_csv_parse(&csv, input, true);
+  report("string_csv_parse, reused (per byte)", now_seconds() - start,
+         input->length);
+
+  start = now_seconds();
+  string_csv_parse_parallel(&csv, input->data, input->length, 4);
+  report("string_csv_parse_parallel x4 (per byte)", now_seconds() - start,
+         input->length);
+
+  string_csv_destroy(&csv);
+  string_destroy(input);
+}
+
+// Escape 16 MiB of mostly clean text.
+void bench_escape() {
+  const size_t length = 16 * 1024 * 1024;
+  char *text = malloc(length);
+  for (size_t i = 0; i < length; i++) {
+    text[i] = i % 97 == 0 ? '"' : 'a' + i % 26;
+  }
+
+  string *out = string_alloc("");
+  double start = now_seconds();
+  string_json_escape_n(&out, text, length);
+  report("string_json_escape_n (per byte)", now_seconds() - start, length);
+
+  string *back = string_alloc("");
+  start = now_seconds();
+  string_json_unescape(&back, out);
+  report("string_json_unescape (per byte)", now_seconds() - start, length);
+
+  string_clear(&out);
+  start = now_seconds();
+  string_html_escape_n(&out, text, length);
+  report("string_html_escape_n (per byte)", now_seconds() - start, length);
+
+  string_clear(&out);
+  start = now_seconds();
+  string_url_encode_n(&out, text, length);
+  report("string_url_encode_n (per byte)", now_seconds() - start, length);
+
+  string_destroy(back);
+  string_destroy(out);
+  free(text);
+}
+
+// Encode and decode 16 MiB of binary data.
+void bench_base64_hex() {
+  const size_t length = 16 * 1024 * 1024;
+  unsigned char *data = malloc(length);
+  srand(3);
+  for (size_t i = 0; i < length; i++) {
+    data[i] = rand();
+  }
+
+  string *encoded = string_alloc("");
+  double start = now_seconds();
+  string_base64_encode_n(&encoded, data, length, STRING_BASE64_STANDARD);
+  report("string_base64_encode_n (per byte)", now_seconds() - start, length);
+
+  string *decoded = string_alloc("");
+  start = now_seconds();
+  string_base64_decode(&decoded, encoded, STRING_BASE64_STANDARD);
+  report("string_base64_decode (per byte)", now_seconds() - start, length);
+
+  string_clear(&encoded);
+  start = now_seconds();
+  string_hex_encode_n(&encoded, data, length);
+  report("string_hex_encode_n (per byte)", now_seconds() - start, length);
+
+  string_clear(&decoded);
+  start = now_seconds();
+  string_hex_decode(&decoded, encoded);
+  report("string_hex_decode (per byte)", now_seconds() - start, length);
+
+  string_destroy(decoded);
+  string_destroy(encoded);
+  free(data);
+}
+
+// Flush 100k small response fragments to /dev/null.
+void bench_write_all() {
+  const size_t count = 100000;
+  string **parts = malloc(count * sizeof(string *));
+  for (size_t i = 0; i < count; i++) {
+    parts[i] = string_alloc("HTTP response fragment;");
+  }
+  int fd = open("/dev/null", O_WRONLY);
+
+  double start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    if (write(fd, parts[i]->data, parts[i]->length) < 0) {
+      break;
+    }
+  }
+  report("write per string", now_seconds() - start, count);
+
+  start = now_seconds();
+  string_write_all(fd, parts, count);
+  report("string_write_all", now_seconds() - start, count);
+
+  string_writer writer;
+  string_writer_init(&writer, fd, 32);
+  start = now_seconds();
+  string_writer_write(&writer, parts, count);
+  report(string_writer_uses_uring(&writer) ? "string_writer_write (io_uring)"
+                                            : "string_writer_write (writev)",
+         now_seconds() - start, count);
+  string_writer_destroy(&writer);
+
+  close(fd);
+  substring_free(parts, count);
+}
+
+// Compress a cache of 20k JSON records of about 1 KiB each.
+void bench_cold() {
+  const size_t count = 20000;
+  string_cold *items = malloc(count * sizeof(string_cold));
+  size_t original = 0;
+  srand(4);
+  for (size_t i = 0; i < count; i++) {
+    string *value = string_alloc("[");
+    for (int j = 0; j < 8; j++) {
+      char record[160];
+      snprintf(record, sizeof(record),
+               "{\"id\":%d,\"user\":\"user-%d\",\"status\":\"%s\","
+               "\"created\":\"2023-08-%02dT%02d:00:00Z\",\"score\":%d},",
+               rand(), rand() % 1000, rand() % 2 ? "active" : "inactive",
+               1 + rand() % 28, rand() % 24, rand() % 100);
+      string_append(&value, record);
+    }
+    string_append(&value, "]");
+    original += value->length;
+    string_cold_init(&items[i], value);
+  }
+
+  string_cold_policy policy = {0};
+  string_cold_stats_reset();
+  double start = now_seconds();
+  string_cold_sweep(items, count, &policy);
+  report("string_cold_sweep (per byte)", now_seconds() - start, original);
+
+  size_t footprint = 0;
+  for (size_t i = 0; i < count; i++) {
+    footprint += string_cold_footprint(&items[i]);
+  }
+  printf("%-40s %10.2fx\n", "string_cold ratio", (double)original / footprint);
+
+  start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    string_cold_get(&items[i]);
+  }
+  report("string_cold_get (per byte)", now_seconds() - start, original);
+
+  for (size_t i = 0; i < count; i++) {
+    string_cold_destroy(&items[i]);
+  }
+  free(items);
+}
+
+// Query a 16 MiB corpus of words 1000 times.
+void bench_index() {
+  const char *words[] = {"lorem", "ipsum", "dolor", "sit",   "amet",
+                         "consectetur", "adipiscing", "elit", "sed", "do"};
+  string_builder builder;
+  string_builder_init(&builder, 16 * 1024 * 1024);
+  srand(5);
+  while (builder.length < 16 * 1024 * 1024) {
+    string_builder_append(&builder, words[rand() % 10]);
+    string_builder_append(&builder, rand() % 16 ? " " : ".\n");
+  }
+  string *corpus = string_builder_to_string(&builder);
+  string_builder_destroy(&builder);
+  string_append(&corpus, "needle in a haystack");
+
+  const size_t queries = 1000;
+  volatile ssize_t found = 0;
+  double start = now_seconds();
+  for (size_t i = 0; i < queries; i++) {
+    found += string_find_n(corpus, "needle", 6);
+  }
+  report("string_find_n (16 MiB)", now_seconds() - start, queries);
+
+  string_index index;
+  start = now_seconds();
+  string_index_build(&index, corpus, STRING_INDEX_ALL);
+  report("string_index_build (per byte)", now_seconds() - start,
+         corpus->length);
+
+  start = now_seconds();
+  for (size_t i = 0; i < queries; i++) {
+    found += string_index_find(&index, "needle", 6);
+  }
+  report("string_index_find, suffix array", now_seconds() - start, queries);
+
+  string_index fm_index = {NULL, index.length, NULL, index.fm};
+  start = now_seconds();
+  for (size_t i = 0; i < queries; i++) {
+    found += string_index_find(&fm_index, "needle", 6);
+  }
+  report("string_index_find, FM-index", now_seconds() - start, queries);
+  printf("%-40s %10.2f bytes/byte\n", "FM-index size",
+         (double)string_index_memory(&fm_index) / corpus->length);
+
+  string_index_destroy(&index);
+  string_destroy(corpus);
+}
+
+// Search one needle in 1M short log lines.
+void bench_finder() {
+  const size_t count = 1000000;
+  string **lines = malloc(count * sizeof(string *));
+  srand(6);
+  for (size_t i = 0; i < count; i++) {
+    char line[160];
+    int n = snprintf(line, sizeof(line),
+                     "2023-08-13T12:%02d:%02d host-%d GET /api/v1/items/%d "
+                     "status=%d latency=%dms",
+                     rand() % 60, rand() % 60, rand() % 100, rand(),
+                     rand() % 2 ? 200 : 404, rand() % 1000);
+    lines[i] = string_alloc_n(line, n);
+  }
+
+  const char *needles[] = {"status=404", "GET /api/v1/items/ with a needle "
+                                         "longer than thirty-two bytes"};
+  const char *names[][2] = {
+      {"string_find (short needle)", "string_finder_find (short needle)"},
+      {"string_find (long needle)", "string_finder_find (long needle)"}};
+  for (int k = 0; k < 2; k++) {
+    volatile ssize_t found = 0;
+    double start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+      found += string_find(lines[i], needles[k]);
+    }
+    report(names[k][0], now_seconds() - start, count);
+
+    string_finder finder;
+    string_finder_init(&finder, needles[k], strlen(needles[k]));
+    start = now_seconds();
+    for (size_t i = 0; i < count; i++) {
+      found += string_finder_find(&finder, lines[i]);
+    }
+    report(names[k][1], now_seconds() - start, count);
+    string_finder_destroy(&finder);
+  }
+
+  substring_free(lines, count);
+}
+
+// Load a dictionary of 1M words: allocate each from text, or map a table.
+void bench_table() {
+  const size_t count = 1000000;
+  string *text = string_alloc("");
+  for (size_t i = 0; i < count; i++) {
+    char word[32];
+    int n = snprintf(word, sizeof(word), "word-%zu\n", i * 2654435761u);
+    string_append_n(&text, word, n);
+  }
+
+  double start = now_seconds();
+  string **words = malloc(count * sizeof(string *));
+  const char *line = text->data;
+  for (size_t i = 0; i < count; i++) {
+    const char *end = memchr(line, '\n', text->data + text->length - line);
+    words[i] = string_alloc_n(line, end - line);
+    line = end + 1;
+  }
+  report("string_alloc from text (1M words)", now_seconds() - start, 1);
+
+  const char *path = "/tmp/string_bench_table";
+  string_table_write(path, (const string **)words, count, true);
+
+  string_table table;
+  start = now_seconds();
+  string_table_open(&table, path, false);
+  report("string_table_open (1M words)", now_seconds() - start, 1);
+  string_table_close(&table);
+
+  start = now_seconds();
+  string_table_open(&table, path, true);
+  report("string_table_open, verified (1M words)", now_seconds() - start, 1);
+
+  volatile ssize_t found = 0;
+  start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    found += string_table_find(&table, words[i]->data, words[i]->length);
+  }
+  report("string_table_find", now_seconds() - start, count);
+
+  string_table_close(&table);
+  remove(path);
+  substring_free(words, count);
+  string_destroy(text);
+}
+
+// Strip 64-byte records off the front of a 4 MiB buffer.
+void bench_fifo() {
+  const size_t record = 64;
+  const size_t count = 64 * 1024;
+  char *data = malloc(record * count);
+  memset(data, 'r', record * count);
+
+  string *str = string_alloc_n(data, record * count);
+  double start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    string_remove(&str, 0, record);
+  }
+  report("string_remove(0, 64) (4 MiB buffer)", now_seconds() - start, count);
+  string_destroy(str);
+
+  string_fifo fifo;
+  string_fifo_init_from(&fifo, string_alloc_n(data, record * count));
+  start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    string_fifo_consume(&fifo, record);
+  }
+  report("string_fifo_consume(64) (4 MiB buffer)", now_seconds() - start,
+         count);
+
+  // Steady state with a 1000-record backlog: append one, consume one.
+  string_fifo_append_n(&fifo, data, record * 1000);
+  start = now_seconds();
+  for (size_t i = 0; i < count; i++) {
+    string_fifo_append_n(&fifo, data, record);
+    string_fifo_consume(&fifo, record);
+  }
+  report("string_fifo append + consume", now_seconds() - start, count);
+  string_fifo_destroy(&fifo);
+  free(data);
+}
+
+static bool pipeline_count_sink(const char *data, size_t length,
+                                void *user_data) {
+  (void)data;
+  *(size_t *)user_data += length;
+  return true;
+}
+
+// Filter and transform 2M log lines with 1 to N threads.
+void bench_pipeline() {
+  const size_t count = 2000000;
+  const char *levels[] = {"INFO", "WARN", "ERROR", "DEBUG"};
+  string *input = string_alloc("");
+  for (size_t i = 0; i < count; i++) {
+    char line[128];
+    int n = snprintf(line, sizeof(line),
+                     "  2024-05-%02zu %s request id=%zu path=/api/v1/items  \n",
+                     i % 28 + 1, levels[i % 4], i * 2654435761u % 1000000);
+    string_append_n(&input, line, n);
+  }
+
+  string_pipeline pipeline;
+  string_pipeline_init(&pipeline);
+  string_pipeline_filter(&pipeline, " (WARN|ERROR) ", false);
+  string_pipeline_trim(&pipeline);
+  string_pipeline_replace_all(&pipeline, "/api/v1/", "/api/v2/");
+  string_pipeline_toupper(&pipeline);
+
+  // 1, 2, 4, ... threads, ending with every online CPU.
+  size_t online = sysconf(_SC_NPROCESSORS_ONLN);
+  for (size_t threads = 1;; threads = threads * 2 < online ? threads * 2
+                                                          : online) {
+    pipeline.threads = threads;
+    size_t written = 0;
+    double start = now_seconds();
+    string_pipeline_run(&pipeline, input->data, input->length,
+                        pipeline_count_sink, &written);
+    char name[64];
+    snprintf(name, sizeof(name), "string_pipeline (%zu threads)", threads);
+    report(name, now_seconds() - start, count);
+    if (threads >= online) {
+      break;
+    }
+  }
+
+  string_pipeline_destroy(&pipeline);
+  string_destroy(input);
+}
+
+int main() {
+  bench_strlen_savings();
+  bench_builder();
+  bench_edit_distance();
+  bench_sort();
+  bench_csv();
+  bench_escape();
+  bench_base64_hex();
+  bench_write_all();
+  bench_cold();
+  bench_index();
+  bench_finder();
+  bench_table();
+  bench_fifo();
+  bench_pipeline();
+  return 0;
+}
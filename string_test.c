@@ -1,7 +1,12 @@
 #include "string.h"
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <unistd.h>
+
+static const string *const GREETING = STRING_LITERAL("Hello, World!");
 
 void test_string_init() {
   string *str = string_alloc("Hello");
@@ -57,7 +62,7 @@ void test_str_find() {
 
 void test_str_to_upper() {
   string *str = string_alloc("hello");
-  string_toupper(str);
+  string_toupper(&str);
   printf("Uppercase string: %s\n", str->data);
   assert(strcmp(str->data, "HELLO") == 0);
   string_destroy(str);
@@ -66,7 +71,7 @@ void test_str_to_upper() {
 void test_str_to_lower() {
   string *str = string_alloc("HELLO");
 
-  string_tolower(str);
+  string_tolower(&str);
   printf("Lowercase string: %s\n", str->data);
   assert(strcmp(str->data, "hello") == 0);
   string_destroy(str);
@@ -117,7 +122,7 @@ void test_str_replace_all() {
 void test_str_to_camel_case() {
   string *str = string_alloc("hello world my_Dear_friends");
 
-  string_to_camelcase(str);
+  string_to_camelcase(&str);
   printf("Camel case string: %s\n", str->data);
   assert(strcmp(str->data, "HelloWorldMyDearFriends") == 0);
   string_destroy(str);
@@ -127,7 +132,7 @@ void test_str_to_titlecase() {
   string *str = string_alloc("hello world");
   assert(str);
 
-  string_to_titlecase(str);
+  string_to_titlecase(&str);
   printf("Title case string: %s\n", str->data);
   assert(strcmp(str->data, "Hello World") == 0);
   string_destroy(str);
@@ -175,6 +180,16 @@ void test_str_join() {
   printf("Joined string: %s\n", str->data);
   assert(strcmp(str->data, "Hello-World-Uganda") == 0);
   string_destroy(str);
+
+  // More elements than fit the on-stack length cache.
+  const char *many[100];
+  for (int i = 0; i < 100; i++) {
+    many[i] = i % 2 ? "ab" : "";
+  }
+  str = string_join(many, 100, ", ");
+  assert(str->length == 50 * 2 + 99 * 2);
+  assert(strncmp(str->data, ", ab, , ab", 10) == 0);
+  string_destroy(str);
 }
 
 void test_str_substring() {
@@ -190,7 +205,7 @@ void test_str_substring() {
 
 void test_str_reverse() {
   string *str = string_alloc("Hello, World!");
-  string_reverse(str);
+  string_reverse(&str);
 
   printf("Reversed string: %s\n", str->data);
   assert(strcmp(str->data, "!dlroW ,olleH") == 0);
@@ -250,7 +265,7 @@ void test_string_trimspace() {
     string *str = string_alloc("   Hello, World!   ");
     assert(str);
 
-    string_trim(str);
+    string_trim(&str);
     printf("\"%s\"\n", str->data);
     assert(strcmp(str->data, "Hello, World!") == 0);
 
@@ -262,7 +277,7 @@ void test_string_trimspace() {
     string *str = string_alloc("   Hello, World!   ");
     assert(str);
 
-    string_ltrim(str);
+    string_ltrim(&str);
     printf("\"%s\"\n", str->data);
 
     assert(strcmp(str->data, "Hello, World!   ") == 0);
@@ -275,7 +290,7 @@ void test_string_trimspace() {
     string *str = string_alloc("   Hello, World!   ");
     assert(str);
 
-    string_rtrim(str);
+    string_rtrim(&str);
     printf("\"%s\"\n", str->data);
 
     assert(strcmp(str->data, "   Hello, World!") == 0);
@@ -284,6 +299,1578 @@ void test_string_trimspace() {
   }
 }
 
+static void *destroy_strings_thread(void *arg) {
+  string **strings = arg;
+  for (int i = 0; i < 100; i++) {
+    string_destroy(strings[i]);
+  }
+  return NULL;
+}
+
+static void destroy_string_key(void *arg) { string_destroy(arg); }
+
+// Destroy a string from a TLS destructor that runs after the pool's own.
+static void *destroy_at_exit_thread(void *arg) {
+  pthread_key_t *key = arg;
+  string *str = string_alloc("freed at thread exit");
+  string_destroy(string_alloc("registers the thread cache"));
+  pthread_setspecific(*key, str);
+  return NULL;
+}
+
+void test_string_pool() {
+  string_pool_enable(true);
+  assert(string_pool_enabled());
+
+  // A destroyed block is recycled for the next string of the same class.
+  string *str = string_alloc("Hello");
+  string *first = str;
+  string_append(&str, ", World!");
+  assert(strcmp(str->data, "Hello, World!") == 0);
+  string_destroy(str);
+
+  string *reused = string_alloc("Hi");
+  assert(reused == first);
+  string_destroy(reused);
+
+  // Blocks freed on another thread are released back into the pool.
+  string *strings[100];
+  for (int i = 0; i < 100; i++) {
+    strings[i] = string_alloc("pooled string");
+  }
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, destroy_strings_thread, strings);
+  pthread_join(thread, NULL);
+
+  for (int i = 0; i < 100; i++) {
+    strings[i] = string_alloc("reused string");
+    assert(strcmp(strings[i]->data, "reused string") == 0);
+  }
+  for (int i = 0; i < 100; i++) {
+    string_destroy(strings[i]);
+  }
+
+  // Blocks freed after the thread cache is torn down reach the depot, which
+  // string_pool_trim releases; LeakSanitizer reports them otherwise.
+  pthread_key_t key;
+  pthread_key_create(&key, destroy_string_key);
+  pthread_create(&thread, NULL, destroy_at_exit_thread, &key);
+  pthread_join(thread, NULL);
+  pthread_key_delete(key);
+
+  string_pool_trim();
+  string_pool_enable(false);
+  assert(!string_pool_enabled());
+}
+
+static void *append_shared_thread(void *arg) {
+  string *str = arg;
+  string_append(&str, " consumed");
+  assert(strcmp(str->data, "payload consumed") == 0);
+  string_destroy(str);
+  return NULL;
+}
+
+void test_string_share() {
+  string *str = string_alloc("payload");
+  assert(!string_is_shared(str));
+
+  // Shared copies point at the same buffer.
+  string *copy = string_share(str);
+  assert(copy == str);
+  assert(string_is_shared(str));
+
+  // Mutating through string ** detaches the copy.
+  string_replace(&copy, "pay", "down");
+  assert(copy != str);
+  assert(strcmp(copy->data, "download") == 0);
+  assert(strcmp(str->data, "payload") == 0);
+  assert(!string_is_shared(str));
+
+  // In-place mutators copy a shared buffer before changing it.
+  string *upper = string_share(str);
+  string_toupper(&upper);
+  assert(upper != str);
+  assert(strcmp(upper->data, "PAYLOAD") == 0);
+  assert(strcmp(str->data, "payload") == 0);
+  assert(!string_is_shared(str));
+  string_reverse(&upper);
+  assert(strcmp(upper->data, "DAOLYAP") == 0);
+  string *cleared = string_share(str);
+  string_clear(&cleared);
+  assert(cleared != str && cleared->length == 0);
+  assert(strcmp(str->data, "payload") == 0);
+  string_destroy(cleared);
+
+  const string *literal = STRING_LITERAL("  Static ");
+  string *trimmed = string_share(literal);
+  string_trim(&trimmed);
+  assert(strcmp(trimmed->data, "Static") == 0);
+  assert(strcmp(literal->data, "  Static ") == 0);
+  string_destroy(trimmed);
+
+  pthread_t threads[5];
+  for (int i = 0; i < 5; i++) {
+    pthread_create(&threads[i], NULL, append_shared_thread, string_share(str));
+  }
+  for (int i = 0; i < 5; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(strcmp(str->data, "payload") == 0);
+  assert(!string_is_shared(str));
+
+  string_destroy(upper);
+  string_destroy(copy);
+  string_destroy(str);
+}
+
+void test_string_literal() {
+  assert(GREETING->length == 13);
+  assert(strcmp(GREETING->data, "Hello, World!") == 0);
+  assert(string_find(GREETING, "World") == 7);
+  assert(string_startswith(GREETING, "Hello"));
+  assert(string_is_shared(GREETING));
+
+  // Destroying a literal is a no-op.
+  string_destroy((string *)GREETING);
+  assert(GREETING->length == 13);
+
+  // Shared handles copy on write.
+  string *str = string_share(GREETING);
+  assert(str == GREETING);
+  string_append(&str, "!!");
+  assert(str != GREETING);
+  assert(strcmp(str->data, "Hello, World!!!") == 0);
+  assert(strcmp(GREETING->data, "Hello, World!") == 0);
+  string_destroy(str);
+
+  const string *local = STRING_LITERAL("");
+  assert(local->length == 0 && local->data[0] == '\0');
+}
+
+void test_string_binary_safe() {
+  const char data[] = "key\0value\0key";
+  string *str = string_alloc_n(data, sizeof(data) - 1);
+  assert(str->length == 13);
+
+  assert(string_find_n(str, "\0value", 6) == 3);
+  assert(string_contains_n(str, "e\0k", 3));
+  assert(string_startswith_n(str, "key\0", 4));
+  assert(string_endswith_n(str, "\0key", 4));
+
+  string_replace_all_n(&str, "\0", 1, "=>", 2);
+  assert(strcmp(str->data, "key=>value=>key") == 0);
+  assert(str->length == 15);
+
+  string_replace_all_n(&str, "=>", 2, "", 0);
+  assert(strcmp(str->data, "keyvaluekey") == 0);
+
+  string_insert_n(&str, 3, "\0", 1);
+  assert(str->length == 12 && str->data[3] == '\0');
+  string_remove(&str, 3, 1);
+
+  // Self-referencing string arguments.
+  string *key = string_substr(str, 0, 3);
+  assert(strcmp(key->data, "key") == 0);
+  string_append_str(&key, key);
+  assert(strcmp(key->data, "keykey") == 0);
+  string_insert_str(&key, 3, key);
+  assert(strcmp(key->data, "keykeykeykey") == 0);
+  string_replace_all_str(&key, STRING_LITERAL("keyk"), key);
+  assert(strcmp(key->data, "keykeykeykeyeykeykeykeykeyey") == 0);
+  string_destroy(key);
+
+  const string *parts[] = {STRING_LITERAL("a"), STRING_LITERAL("b\0c"),
+                           STRING_LITERAL("d")};
+  string *joined = string_join_str(parts, 3, STRING_LITERAL(", "));
+  assert(joined->length == 9);
+  assert(memcmp(joined->data, "a, b\0c, d", 10) == 0);
+  string_destroy(joined);
+
+  const char *chunks[] = {"x\0y", "z"};
+  const size_t lengths[] = {3, 1};
+  joined = string_join_n(chunks, lengths, 2, "\0", 1);
+  assert(joined->length == 5);
+  assert(memcmp(joined->data, "x\0y\0z", 6) == 0);
+  string_destroy(joined);
+
+  string_destroy(str);
+}
+
+void test_string_builder() {
+  string_builder builder;
+  string_builder_init(&builder, 0);
+
+  // Append enough data to span several segments.
+  string *expected = string_alloc("");
+  for (int i = 0; i < 10000; i++) {
+    char line[32];
+    int n = snprintf(line, sizeof(line), "line %d\n", i);
+    string_builder_append_n(&builder, line, n);
+    string_append_n(&expected, line, n);
+  }
+  string_builder_append_str(&builder, STRING_LITERAL("end"));
+  string_builder_append(&builder, "");
+  string_append(&expected, "end");
+  assert(builder.length == expected->length);
+  assert(builder.head != builder.tail);
+
+  string *result = string_builder_to_string(&builder);
+  assert(result->length == expected->length);
+  assert(strcmp(result->data, expected->data) == 0);
+  string_destroy(result);
+
+  struct iovec iov[64];
+  size_t count = string_builder_iovec(&builder, iov, 64);
+  assert(count > 1 && count <= 64);
+  size_t offset = 0;
+  for (size_t i = 0; i < count; i++) {
+    assert(memcmp(iov[i].iov_base, expected->data + offset, iov[i].iov_len) ==
+           0);
+    offset += iov[i].iov_len;
+  }
+  assert(offset == expected->length);
+
+  // Reuse the same segments for the next request.
+  string_segment *head = builder.head;
+  string_builder_reset(&builder);
+  assert(builder.length == 0);
+  string_builder_reserve(&builder, 100);
+  string_builder_append(&builder, "Hello, ");
+  string_builder_append(&builder, "World!");
+  assert(builder.head == head);
+
+  result = string_builder_to_string(&builder);
+  assert(strcmp(result->data, "Hello, World!") == 0);
+  string_destroy(result);
+
+  string_builder_destroy(&builder);
+  string_destroy(expected);
+}
+
+void test_string_convert_case() {
+  const string *src = STRING_LITERAL("parseHTTPServer_response-code v2");
+
+  struct {
+    string_case style;
+    const char *expected;
+  } cases[] = {
+      {STRING_CASE_SNAKE, "parse_http_server_response_code_v2"},
+      {STRING_CASE_KEBAB, "parse-http-server-response-code-v2"},
+      {STRING_CASE_CAMEL, "parseHttpServerResponseCodeV2"},
+      {STRING_CASE_PASCAL, "ParseHttpServerResponseCodeV2"},
+      {STRING_CASE_TITLE, "Parse Http Server Response Code V2"},
+      {STRING_CASE_CONSTANT, "PARSE_HTTP_SERVER_RESPONSE_CODE_V2"},
+  };
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    string *result = string_convert_case(src, cases[i].style, NULL);
+    printf("Converted case: %s\n", result->data);
+    assert(strcmp(result->data, cases[i].expected) == 0);
+    assert(result->capacity >= result->length + 1);
+    string_destroy(result);
+  }
+
+  // Custom rules: only '.' separates words, digits start new words.
+  string_case_rules rules = {".", true, false, true};
+  string *result =
+      string_convert_case(STRING_LITERAL("utf8.HTMLDecoder"), STRING_CASE_SNAKE,
+                          &rules);
+  assert(strcmp(result->data, "utf_8_htmldecoder") == 0);
+  string_destroy(result);
+
+  const string *columns[] = {STRING_LITERAL("userId"),
+                             STRING_LITERAL("created_at"),
+                             STRING_LITERAL("ZIPCode")};
+  string *converted[3];
+  assert(string_convert_case_batch(columns, converted, 3, STRING_CASE_KEBAB,
+                                   NULL));
+  assert(strcmp(converted[0]->data, "user-id") == 0);
+  assert(strcmp(converted[1]->data, "created-at") == 0);
+  assert(strcmp(converted[2]->data, "zip-code") == 0);
+  for (int i = 0; i < 3; i++) {
+    string_destroy(converted[i]);
+  }
+
+  string *title = string_alloc("hello_wORLD-again");
+  string_to_titlecase(&title);
+  assert(strcmp(title->data, "Hello_World-Again") == 0);
+  string_destroy(title);
+
+  string *snake = string_alloc("hello world");
+  string_to_snakecase(&snake);
+  assert(strcmp(snake->data, "hello_world") == 0);
+  string_destroy(snake);
+}
+
+static size_t naive_edit_distance(const string *a, const string *b,
+                                  bool transpositions) {
+  size_t m = a->length, n = b->length;
+  size_t *d = malloc((m + 1) * (n + 1) * sizeof(size_t));
+#define D(i, j) d[(i) * (n + 1) + (j)]
+  for (size_t i = 0; i <= m; i++) {
+    for (size_t j = 0; j <= n; j++) {
+      if (i == 0 || j == 0) {
+        D(i, j) = i + j;
+        continue;
+      }
+      size_t best = D(i - 1, j - 1) + (a->data[i - 1] != b->data[j - 1]);
+      if (D(i - 1, j) + 1 < best) {
+        best = D(i - 1, j) + 1;
+      }
+      if (D(i, j - 1) + 1 < best) {
+        best = D(i, j - 1) + 1;
+      }
+      if (transpositions && i > 1 && j > 1 &&
+          a->data[i - 1] == b->data[j - 2] &&
+          a->data[i - 2] == b->data[j - 1] && D(i - 2, j - 2) + 1 < best) {
+        best = D(i - 2, j - 2) + 1;
+      }
+      D(i, j) = best;
+    }
+  }
+  size_t result = D(m, n);
+#undef D
+  free(d);
+  return result;
+}
+
+static string *random_string(size_t max_length) {
+  char buf[256];
+  size_t length = rand() % (max_length + 1);
+  for (size_t i = 0; i < length; i++) {
+    buf[i] = "abcd"[rand() % 4];
+  }
+  return string_alloc_n(buf, length);
+}
+
+void test_string_edit_distance() {
+  string *kitten = string_alloc("kitten");
+  string *sitting = string_alloc("sitting");
+  assert(string_levenshtein(kitten, sitting, SIZE_MAX) == 3);
+  assert(string_levenshtein(kitten, sitting, 2) == SIZE_MAX);
+  assert(string_damerau(STRING_LITERAL("abcd"), STRING_LITERAL("acbd"),
+                        SIZE_MAX) == 1);
+  assert(string_levenshtein(STRING_LITERAL("abcd"), STRING_LITERAL("acbd"),
+                            SIZE_MAX) == 2);
+
+  srand(42);
+  string *candidates[64];
+  for (int round = 0; round < 200; round++) {
+    string *a = random_string(round < 100 ? 40 : 150);
+    string *b = random_string(round < 100 ? 40 : 150);
+    size_t expected = naive_edit_distance(a, b, false);
+    assert(string_levenshtein(a, b, SIZE_MAX) == expected);
+    assert(string_levenshtein(a, b, expected) == expected);
+    if (expected > 0) {
+      assert(string_levenshtein(a, b, expected - 1) == SIZE_MAX);
+    }
+    assert(string_damerau(a, b, SIZE_MAX) == naive_edit_distance(a, b, true));
+    string_destroy(a);
+    string_destroy(b);
+  }
+
+  // Batch scoring matches the scalar path.
+  string *query = random_string(50);
+  for (int i = 0; i < 64; i++) {
+    candidates[i] = random_string(60);
+  }
+  size_t distances[64];
+  string_levenshtein_batch(query, (const string **)candidates, 64, 20,
+                           distances);
+  for (int i = 0; i < 64; i++) {
+    size_t expected = naive_edit_distance(query, candidates[i], false);
+    assert(distances[i] == (expected <= 20 ? expected : SIZE_MAX));
+    string_destroy(candidates[i]);
+  }
+  string_destroy(query);
+
+  string *text = string_alloc("the quick brown fox jumps over the lazy dog");
+  string_approx_match match;
+  assert(string_find_approx(text, STRING_LITERAL("jumsp"), 2, &match) == 20);
+  assert(match.distance == 1);
+  printf("Approximate match: %.*s\n", (int)match.length,
+         text->data + match.start);
+  assert(string_find_approx(text, STRING_LITERAL("browm"), 1, &match) == 10);
+  assert(match.length == 5 && match.distance == 1);
+  assert(string_find_approx(text, STRING_LITERAL("cat"), 1, NULL) == -1);
+
+  string_destroy(text);
+  string_destroy(kitten);
+  string_destroy(sitting);
+}
+
+static int compare_strings_qsort(const void *a, const void *b) {
+  return string_compare(*(const string **)a, *(const string **)b);
+}
+
+void test_string_sort() {
+  assert(string_compare(STRING_LITERAL("abc"), STRING_LITERAL("abd")) < 0);
+  assert(string_compare(STRING_LITERAL("ab"), STRING_LITERAL("ab\0")) < 0);
+  assert(string_compare(STRING_LITERAL("abc"), STRING_LITERAL("abc")) == 0);
+  assert(string_compare_ci(STRING_LITERAL("Hello, World! Hello, World!"),
+                           STRING_LITERAL("hello, world! HELLO, WORLD!")) ==
+         0);
+  assert(string_compare_ci(STRING_LITERAL("Hello, World! Hello, World?"),
+                           STRING_LITERAL("hello, world! HELLO, WORLD!")) > 0);
+  assert(string_compare_natural(STRING_LITERAL("file9.txt"),
+                                STRING_LITERAL("file10.txt")) < 0);
+  assert(string_compare_natural(STRING_LITERAL("v1.002"),
+                                STRING_LITERAL("v1.2")) == 0);
+
+  // Strings with long shared prefixes and embedded null bytes.
+  srand(7);
+  size_t count = 100000;
+  string **strings = malloc(count * sizeof(string *));
+  string **expected = malloc(count * sizeof(string *));
+  for (size_t i = 0; i < count; i++) {
+    char buf[40] = "2023-08-13T12:00:00 host-";
+    size_t length = 25 + rand() % 12;
+    for (size_t j = 20; j < length; j++) {
+      buf[j] = "ab\0z"[rand() % 4];
+    }
+    strings[i] = string_alloc_n(buf, length);
+  }
+  memcpy(expected, strings, count * sizeof(string *));
+  qsort(expected, count, sizeof(string *), compare_strings_qsort);
+
+  string_sort(strings, count);
+  for (size_t i = 0; i < count; i++) {
+    assert(string_compare(strings[i], expected[i]) == 0);
+  }
+
+  // Shuffle and sort again on several threads.
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    string *tmp = strings[i];
+    strings[i] = strings[j];
+    strings[j] = tmp;
+  }
+  string_sort_parallel(strings, count, 3);
+  for (size_t i = 0; i < count; i++) {
+    assert(string_compare(strings[i], expected[i]) == 0);
+  }
+  free(expected);
+  substring_free(strings, count);
+
+  string *files[] = {string_alloc("file10"), string_alloc("File2"),
+                     string_alloc("file1")};
+  string_sort_with(files, 3, string_compare_natural);
+  assert(strcmp(files[0]->data, "File2") == 0);
+  assert(strcmp(files[1]->data, "file1") == 0);
+  string_sort_with(files, 3, string_compare_ci);
+  assert(strcmp(files[0]->data, "file1") == 0);
+  assert(strcmp(files[1]->data, "file10") == 0);
+  assert(strcmp(files[2]->data, "File2") == 0);
+  for (int i = 0; i < 3; i++) {
+    string_destroy(files[i]);
+  }
+}
+
+static void assert_field(const string_csv *csv, const string_csv_field *field,
+                         const char *expected) {
+  string *str = string_csv_field_string(csv, field);
+  assert(strcmp(str->data, expected) == 0);
+  string_destroy(str);
+}
+
+void test_string_csv() {
+  const string *input =
+      STRING_LITERAL("name,quote,count\r\n"
+                     "alice,\"hello, world\",1\r\n"
+                     "bob,\"say \"\"hi\"\"\nthere\",\n"
+                     ",,3");
+
+  string_csv csv;
+  string_csv_init(&csv, ',', '"');
+  assert(string_csv_parse(&csv, input, true) == input->length);
+  assert(csv.num_records == 4);
+
+  size_t num_fields;
+  const string_csv_field *fields = string_csv_record(&csv, 1, &num_fields);
+  assert(num_fields == 3);
+  assert_field(&csv, &fields[0], "alice");
+  assert_field(&csv, &fields[1], "hello, world");
+  assert_field(&csv, &fields[2], "1");
+
+  fields = string_csv_record(&csv, 2, &num_fields);
+  assert(num_fields == 3);
+  assert(fields[1].escaped);
+  assert_field(&csv, &fields[1], "say \"hi\"\nthere");
+  assert(fields[2].length == 0);
+
+  fields = string_csv_record(&csv, 3, &num_fields);
+  assert(num_fields == 3);
+  assert_field(&csv, &fields[2], "3");
+  assert(string_csv_record(&csv, 4, &num_fields) == NULL);
+
+  // Without final, the unterminated last record is left for the next call.
+  size_t consumed = string_csv_parse(&csv, input, false);
+  assert(csv.num_records == 3);
+  assert(consumed == (size_t)string_find(input, ",,3"));
+
+  // A final record ending in a delimiter has an empty last field.
+  assert(string_csv_parse_n(&csv, "a,b\nc,", 6, true) == 6);
+  assert(csv.num_records == 2);
+  fields = string_csv_record(&csv, 1, &num_fields);
+  assert(num_fields == 2);
+  assert_field(&csv, &fields[0], "c");
+  assert(fields[1].length == 0);
+  assert(string_csv_parse_n(&csv, "c,", 2, true) == 2);
+  assert(csv.num_records == 1 && csv.num_fields == 2);
+  assert(string_csv_parse_n(&csv, "c,", 2, false) == 0);
+  assert(csv.num_records == 0);
+
+  // Streaming in small pieces yields the same records.
+  string_csv stream;
+  string_csv_init(&stream, ',', '"');
+  string *pending = string_alloc("");
+  size_t records = 0;
+  for (size_t pos = 0; pos < input->length; pos += 7) {
+    size_t n = input->length - pos < 7 ? input->length - pos : 7;
+    string_append_n(&pending, input->data + pos, n);
+    bool final = pos + n == input->length;
+    consumed = string_csv_parse(&stream, pending, final);
+    records += stream.num_records;
+    string_remove(&pending, 0, consumed);
+  }
+  assert(records == 4);
+  assert(pending->length == 0);
+  string_destroy(pending);
+  string_csv_destroy(&stream);
+
+  // Parallel parsing agrees with the sequential parser.
+  srand(11);
+  string *big = string_alloc("");
+  for (int i = 0; i < 5000; i++) {
+    const char *values[] = {"plain", "\"quoted, with comma\"",
+                            "\"multi\nline\"", "\"\"\"\"", ""};
+    for (int j = 0; j < 4; j++) {
+      string_append(&big, values[rand() % 5]);
+      string_append(&big, j < 3 ? "," : (i % 2 ? "\r\n" : "\n"));
+    }
+  }
+  string_append(&big, "last,record,without,newline");
+
+  string_csv parallel;
+  string_csv_init(&parallel, ',', '"');
+  assert(string_csv_parse(&csv, big, true) == big->length);
+  assert(string_csv_parse_parallel(&parallel, big->data, big->length, 4));
+  assert(csv.num_records == 5001);
+  assert(parallel.num_records == csv.num_records);
+  assert(parallel.num_fields == csv.num_fields);
+  for (size_t i = 0; i < csv.num_fields; i++) {
+    assert(parallel.fields[i].data == csv.fields[i].data);
+    assert(parallel.fields[i].length == csv.fields[i].length);
+  }
+  for (size_t i = 0; i <= csv.num_records; i++) {
+    assert(parallel.records[i] == csv.records[i]);
+  }
+
+  string_destroy(big);
+  string_csv_destroy(&parallel);
+
+  // Tab separated values without quoting.
+  string_csv_destroy(&csv);
+  string_csv_init(&csv, '\t', '\0');
+  string_csv_parse(&csv, STRING_LITERAL("a\t\"b\tc\n"), true);
+  fields = string_csv_record(&csv, 0, &num_fields);
+  assert(num_fields == 3);
+  assert_field(&csv, &fields[1], "\"b");
+  string_csv_destroy(&csv);
+}
+
+void test_string_escape() {
+  string *out = string_alloc("");
+
+  // JSON round trip, including a clean run longer than one SIMD block.
+  const char raw[] = "say \"hi\"\\\n\ttab\x01 and a long clean run of text";
+  string_json_escape_n(&out, raw, sizeof(raw) - 1);
+  assert(strcmp(out->data, "say \\\"hi\\\"\\\\\\n\\ttab\\u0001 and a long clean "
+                           "run of text") == 0);
+  string *back = string_alloc("");
+  assert(string_json_unescape(&back, out));
+  assert(back->length == sizeof(raw) - 1);
+  assert(memcmp(back->data, raw, back->length) == 0);
+
+  // \u escapes decode to UTF-8, surrogate pairs included.
+  string_clear(&back);
+  assert(string_json_unescape(
+      &back, STRING_LITERAL("\\u00e9\\u20ac\\ud83d\\ude00\\/")));
+  assert(strcmp(back->data, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80/") == 0);
+
+  // Invalid input leaves the destination as it was.
+  string_clear(&back);
+  string_append(&back, "keep");
+  assert(!string_json_unescape(&back, STRING_LITERAL("bad \\x")));
+  assert(!string_json_unescape(&back, STRING_LITERAL("\\ud83d alone")));
+  assert(!string_json_unescape(&back, STRING_LITERAL("\\ude00")));
+  assert(!string_json_unescape(&back, STRING_LITERAL("raw \" quote")));
+  assert(!string_json_unescape(&back, STRING_LITERAL("\\u12")));
+  assert(strcmp(back->data, "keep") == 0 && back->length == 4);
+
+  // HTML.
+  string_clear(&out);
+  string_html_escape(&out, STRING_LITERAL("<a href=\"x\">Tom & Jerry's</a>"));
+  assert(strcmp(out->data, "&lt;a href=&quot;x&quot;&gt;Tom &amp; "
+                           "Jerry&#39;s&lt;/a&gt;") == 0);
+  string_clear(&back);
+  assert(string_html_unescape(&back, out));
+  assert(strcmp(back->data, "<a href=\"x\">Tom & Jerry's</a>") == 0);
+
+  string_clear(&back);
+  assert(string_html_unescape(&back, STRING_LITERAL("&#233;&#x20AC;&apos;")));
+  assert(strcmp(back->data, "\xc3\xa9\xe2\x82\xac'") == 0);
+  string_clear(&back);
+  assert(!string_html_unescape(&back, STRING_LITERAL("a &copy; b & c")));
+  assert(strcmp(back->data, "a &copy; b & c") == 0);
+
+  // URL percent-encoding.
+  string_clear(&out);
+  string_url_encode(&out, STRING_LITERAL("a b/c?d=e&f~g_h.i-j\xff"));
+  assert(strcmp(out->data, "a%20b%2Fc%3Fd%3De%26f~g_h.i-j%FF") == 0);
+  string_clear(&back);
+  assert(string_url_decode(&back, out));
+  assert(strcmp(back->data, "a b/c?d=e&f~g_h.i-j\xff") == 0);
+  assert(!string_url_decode(&back, STRING_LITERAL("50%")));
+  assert(!string_url_decode(&back, STRING_LITERAL("%zz")));
+  assert(strcmp(back->data, "a b/c?d=e&f~g_h.i-j\xff") == 0);
+
+  // Escaping appends to the existing contents.
+  string_clear(&out);
+  string_append(&out, "q=");
+  string_url_encode_n(&out, "1+1", 3);
+  assert(strcmp(out->data, "q=1%2B1") == 0);
+
+  // A string may be escaped onto itself, even when that reallocates it.
+  string *self = string_alloc_n("\x01\x02\x03\x04\x05\x06\x07\x08"
+                                "\x0e\x0f\x10\x11\x12\x13\x14\x15"
+                                "\x16\x17\x18\x19\x1a\x1b\x1c\x1d"
+                                "\x1e\x1f\x01\x02\x03\x04\x05",
+                                31);
+  string_json_escape(&self, self);
+  assert(self->length == 31 + 30 * 6 + 2); // \x08 escapes as \b.
+  assert(strncmp(self->data + 31, "\\u0001\\u0002", 12) == 0);
+  string_clear(&self);
+  string_append(&self, "<a href='x'>");
+  string_html_escape(&self, self);
+  assert(strcmp(self->data,
+                "<a href='x'>&lt;a href=&#39;x&#39;&gt;") == 0);
+  string_clear(&self);
+  string_append(&self, "%41 %");
+  assert(!string_url_decode(&self, self));
+  assert(strcmp(self->data, "%41 %") == 0);
+  string_clear(&self);
+  string_append(&self, "%41b");
+  assert(string_url_decode(&self, self));
+  assert(strcmp(self->data, "%41bAb") == 0);
+  string_destroy(self);
+
+  string_destroy(back);
+  string_destroy(out);
+}
+
+void test_string_base64_hex() {
+  // RFC 4648 test vectors.
+  const char *plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+  const char *encoded[] = {"",         "Zg==",     "Zm8=",    "Zm9v",
+                           "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+  string *out = string_alloc("");
+  for (size_t i = 0; i < 7; i++) {
+    string_clear(&out);
+    string_base64_encode_n(&out, plain[i], strlen(plain[i]),
+                           STRING_BASE64_STANDARD);
+    assert(strcmp(out->data, encoded[i]) == 0);
+    string_clear(&out);
+    assert(string_base64_decode_n(&out, encoded[i], strlen(encoded[i]),
+                                  STRING_BASE64_STANDARD));
+    assert(strcmp(out->data, plain[i]) == 0);
+  }
+
+  // URL-safe output is unpadded; decoding accepts both forms.
+  string_clear(&out);
+  string_base64_encode_n(&out, "\xfb\xff", 2, STRING_BASE64_URL);
+  assert(strcmp(out->data, "-_8") == 0);
+  string_clear(&out);
+  assert(string_base64_decode(&out, STRING_LITERAL("-_8="), STRING_BASE64_URL));
+  assert(string_base64_decode(&out, STRING_LITERAL("-_8"), STRING_BASE64_URL));
+  assert(memcmp(out->data, "\xfb\xff\xfb\xff", 4) == 0 && out->length == 4);
+
+  // Strict validation leaves the destination unchanged.
+  string_clear(&out);
+  string_append(&out, "keep");
+  const string *bad[] = {
+      STRING_LITERAL("Zm9v\nYmF"),  STRING_LITERAL("Zm9"),
+      STRING_LITERAL("Zh=="),       STRING_LITERAL("Zm=v"),
+      STRING_LITERAL("Zg==Zg=="),   STRING_LITERAL("-_8="),
+      STRING_LITERAL("QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVphYmNkZWZnaGlq!2xt"),
+  };
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    assert(!string_base64_decode(&out, bad[i], STRING_BASE64_STANDARD));
+  }
+  assert(string_base64_decode(&out, STRING_LITERAL("Zg=="), STRING_BASE64_URL));
+  assert(!string_base64_decode(&out, STRING_LITERAL("Z"), STRING_BASE64_URL));
+  assert(!string_base64_decode(&out, STRING_LITERAL("Zh"), STRING_BASE64_URL));
+  assert(strcmp(out->data, "keepf") == 0);
+
+  // Random round trips long enough for the vector paths, one-shot and
+  // streamed in random chunks.
+  srand(7);
+  unsigned char data[300];
+  string *encoded_str = string_alloc("");
+  string *decoded = string_alloc("");
+  for (size_t length = 0; length < sizeof(data); length += 1 + rand() % 7) {
+    for (size_t i = 0; i < length; i++) {
+      data[i] = rand();
+    }
+    for (int alphabet = 0; alphabet < 2; alphabet++) {
+      string_clear(&encoded_str);
+      string_base64_encode_n(&encoded_str, data, length, alphabet);
+      string_clear(&decoded);
+      assert(string_base64_decode(&decoded, encoded_str, alphabet));
+      assert(decoded->length == length);
+      assert(memcmp(decoded->data, data, length) == 0);
+
+      string_base64_stream stream;
+      string *streamed = string_alloc("");
+      string_base64_stream_init(&stream, alphabet);
+      for (size_t i = 0; i < length;) {
+        size_t n = rand() % 40;
+        n = n > length - i ? length - i : n;
+        string_base64_encode_update(&stream, &streamed, data + i, n);
+        i += n;
+      }
+      string_base64_encode_final(&stream, &streamed);
+      assert(strcmp(streamed->data, encoded_str->data) == 0);
+
+      string_clear(&decoded);
+      string_base64_stream_init(&stream, alphabet);
+      for (size_t i = 0; i < streamed->length;) {
+        size_t n = rand() % 40;
+        n = n > streamed->length - i ? streamed->length - i : n;
+        assert(string_base64_decode_update(&stream, &decoded,
+                                           streamed->data + i, n));
+        i += n;
+      }
+      assert(string_base64_decode_final(&stream, &decoded));
+      assert(decoded->length == length);
+      assert(memcmp(decoded->data, data, length) == 0);
+      string_destroy(streamed);
+    }
+
+    string_clear(&encoded_str);
+    string_hex_encode_n(&encoded_str, data, length);
+    assert(encoded_str->length == length * 2);
+    for (size_t i = 0; i < length; i++) {
+      char digits[3];
+      snprintf(digits, sizeof(digits), "%02x", data[i]);
+      assert(memcmp(encoded_str->data + i * 2, digits, 2) == 0);
+    }
+    string_clear(&decoded);
+    assert(string_hex_decode(&decoded, encoded_str));
+    assert(decoded->length == length);
+    assert(memcmp(decoded->data, data, length) == 0);
+  }
+
+  // Hex decoding accepts uppercase and rejects anything else.
+  string_clear(&decoded);
+  assert(string_hex_decode(
+      &decoded, STRING_LITERAL("DEADbeef00112233445566778899AABBCCDDEEFF")));
+  assert(decoded->length == 20 && (unsigned char)decoded->data[0] == 0xde);
+  assert(!string_hex_decode(
+      &decoded, STRING_LITERAL("00112233445566778899aabbccddeegg00")));
+  assert(!string_hex_decode(&decoded, STRING_LITERAL("abc")));
+  assert(decoded->length == 20);
+
+  // A rejected chunk does not disturb the quantum pending in the stream.
+  string_base64_stream stream;
+  string_base64_stream_init(&stream, STRING_BASE64_STANDARD);
+  string_clear(&decoded);
+  assert(string_base64_decode_update(&stream, &decoded, "QU", 2));
+  assert(!string_base64_decode_update(&stream, &decoded, "J!", 2));
+  assert(string_base64_decode_update(&stream, &decoded, "JD", 2));
+  assert(string_base64_decode_final(&stream, &decoded));
+  assert(strcmp(decoded->data, "ABC") == 0);
+
+  // Strings may be encoded and decoded onto themselves.
+  string *self = string_alloc("0123456789abcdef0123456789abcdef");
+  string_base64_encode(&self, self, STRING_BASE64_STANDARD);
+  assert(strcmp(self->data + 32,
+                "MDEyMzQ1Njc4OWFiY2RlZjAxMjM0NTY3ODlhYmNkZWY=") == 0);
+  string_clear(&self);
+  string_append(&self, "QUJD");
+  assert(string_base64_decode(&self, self, STRING_BASE64_STANDARD));
+  assert(strcmp(self->data, "QUJDABC") == 0);
+  string_hex_encode(&self, self);
+  assert(strcmp(self->data, "QUJDABC51554a44414243") == 0);
+  string_clear(&self);
+  string_append(&self, "4142");
+  assert(string_hex_decode(&self, self));
+  assert(strcmp(self->data, "4142AB") == 0);
+  string_destroy(self);
+
+  string_destroy(decoded);
+  string_destroy(encoded_str);
+  string_destroy(out);
+}
+
+typedef struct pipe_reader {
+  int fd;
+  string *received;
+} pipe_reader;
+
+static void *read_pipe(void *arg) {
+  pipe_reader *reader = arg;
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(reader->fd, buf, sizeof(buf))) > 0) {
+    string_append_n(&reader->received, buf, n);
+  }
+  return NULL;
+}
+
+void test_string_write_all() {
+  // More strings than IOV_MAX, including empty ones.
+  const size_t count = 5000;
+  string **parts = malloc(count * sizeof(string *));
+  string *expected = string_alloc("");
+  for (size_t i = 0; i < count; i++) {
+    char text[32];
+    int n = i % 7 == 0 ? 0 : snprintf(text, sizeof(text), "part-%zu,", i);
+    parts[i] = string_alloc_n(text, n);
+    string_append_str(&expected, parts[i]);
+  }
+
+  // To a file.
+  FILE *file = tmpfile();
+  assert(file);
+  ssize_t written = string_write_all(fileno(file), parts, count);
+  assert(written == (ssize_t)expected->length);
+  rewind(file);
+  char *contents = malloc(expected->length);
+  assert(fread(contents, 1, expected->length, file) == expected->length);
+  assert(memcmp(contents, expected->data, expected->length) == 0);
+  fclose(file);
+  free(contents);
+
+  // Through a pipe, which forces partial writes, with and without io_uring.
+  // The deepest queue is capped rather than sized for 4096 batches.
+  const unsigned depths[] = {0, 2, 8, 4096};
+  for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+    unsigned depth = depths[d];
+    int fds[2];
+    assert(pipe(fds) == 0);
+    pipe_reader reader = {fds[0], string_alloc("")};
+    pthread_t thread;
+    pthread_create(&thread, NULL, read_pipe, &reader);
+
+    string_writer writer;
+    string_writer_init(&writer, fds[1], depth);
+    assert(depth > 0 || !string_writer_uses_uring(&writer));
+    for (int round = 0; round < 3; round++) {
+      written = string_writer_write(&writer, parts, count);
+      assert(written == (ssize_t)expected->length);
+    }
+    assert(string_writer_write(&writer, parts, 0) == 0);
+    string_writer_destroy(&writer);
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+
+    assert(reader.received->length == 3 * expected->length);
+    for (int round = 0; round < 3; round++) {
+      assert(memcmp(reader.received->data + round * expected->length,
+                    expected->data, expected->length) == 0);
+    }
+    string_destroy(reader.received);
+  }
+
+  // Errors are reported through errno.
+  errno = 0;
+  assert(string_write_all(-1, parts + 1, 1) == -1 && errno == EBADF);
+
+  substring_free(parts, count);
+  string_destroy(expected);
+}
+
+static bool compress_even_lengths(const string_cold *cold, void *user_data) {
+  (*(size_t *)user_data)++;
+  return cold->length % 2 == 0;
+}
+
+void test_string_cold() {
+  string_cold_stats_reset();
+
+  // Round trips across sizes and data shapes: runs (overlapping matches),
+  // repeated records, and short values that cannot shrink.
+  string_builder builder;
+  string_builder_init(&builder, 0);
+  srand(11);
+  for (size_t length = 0; length < 70000; length = length * 3 + 1) {
+    for (int shape = 0; shape < 3; shape++) {
+      string_builder_reset(&builder);
+      for (size_t i = 0; i < length; i++) {
+        char c = shape == 0   ? 'a'
+                 : shape == 1 ? "{\"id\":1,\"name\":\"widget\"}"[i % 24]
+                              : 'a' + rand() % 3;
+        string_builder_append_n(&builder, &c, 1);
+      }
+      string *expected = string_builder_to_string(&builder);
+
+      string_cold cold;
+      string_cold_init(&cold, string_alloc_n(expected->data, length));
+      bool compressed = string_cold_compress(&cold);
+      assert(compressed == string_cold_is_compressed(&cold));
+      if (length >= 64) {
+        assert(compressed);
+        assert(shape == 2 || string_cold_footprint(&cold) < length / 2);
+      }
+
+      char *scratch = malloc(length + 1);
+      assert(!string_cold_read(&cold, scratch, length));
+      assert(string_cold_read(&cold, scratch, length + 1));
+      assert(memcmp(scratch, expected->data, length + 1) == 0);
+      assert(string_cold_is_compressed(&cold) == compressed);
+      free(scratch);
+
+      const string *value = string_cold_get(&cold);
+      assert(!string_cold_is_compressed(&cold));
+      assert(value->length == length);
+      assert(memcmp(value->data, expected->data, length + 1) == 0);
+
+      string_cold_destroy(&cold);
+      string_destroy(expected);
+    }
+  }
+  string_builder_destroy(&builder);
+
+  // Random bytes do not shrink and stay uncompressed.
+  char noise[4096];
+  for (size_t i = 0; i < sizeof(noise); i++) {
+    noise[i] = rand();
+  }
+  string_cold cold;
+  string_cold_init(&cold, string_alloc_n(noise, sizeof(noise)));
+  assert(!string_cold_compress(&cold));
+  assert(string_cold_get(&cold)->length == sizeof(noise));
+  string_cold_destroy(&cold);
+
+  // Shared values are left alone.
+  string *shared = string_alloc("shared shared shared shared shared shared");
+  string_cold_init(&cold, string_share(shared));
+  assert(!string_cold_compress(&cold));
+  string_cold_destroy(&cold);
+  string_destroy(shared);
+
+  string_cold_stats stats;
+  string_cold_stats_get(&stats);
+  assert(stats.compressions > 0 && stats.rejected > 0);
+  assert(stats.decompressions >= 2 * stats.compressions);
+  assert(stats.compress_ns > 0 && stats.decompress_ns > 0);
+  assert(stats.original_bytes == 0 && stats.compressed_bytes == 0);
+
+  // Policy: minimum length, idle time and the hook.
+  string_cold items[4];
+  const char *text = "cold cold cold cold cold cold cold cold cold cold!";
+  for (int i = 0; i < 4; i++) {
+    string_cold_init(&items[i], string_alloc_n(text, 40 + i));
+  }
+  string_cold_policy policy = {.min_length = 41, .idle_seconds = 3600};
+  assert(string_cold_sweep(items, 4, &policy) == 0);
+
+  items[1].last_access -= 7200 * 1000000000ull;
+  items[2].last_access -= 7200 * 1000000000ull;
+  assert(string_cold_sweep(items, 4, &policy) == 2);
+  assert(string_cold_is_compressed(&items[1]));
+  assert(string_cold_is_compressed(&items[2]));
+
+  string_cold_get(&items[1]);
+  string_cold_get(&items[2]);
+  size_t calls = 0;
+  policy = (string_cold_policy){.min_length = 0,
+                                .should_compress = compress_even_lengths,
+                                .user_data = &calls};
+  assert(string_cold_sweep(items, 4, &policy) == 2);
+  assert(calls == 4);
+  assert(string_cold_is_compressed(&items[0]));
+  assert(!string_cold_is_compressed(&items[1]));
+  assert(string_cold_is_compressed(&items[2]));
+
+  string_cold_stats_get(&stats);
+  assert(stats.original_bytes == 40 + 42);
+  assert(stats.compressed_bytes < stats.original_bytes);
+  for (int i = 0; i < 4; i++) {
+    assert(strncmp(string_cold_get(&items[i])->data, text, 40 + i) == 0);
+    string_cold_destroy(&items[i]);
+  }
+}
+
+void test_string_index() {
+  // Compare every query against a scan of the text, with both parts.
+  srand(13);
+  string *text = string_alloc("");
+  for (int i = 0; i < 3000; i++) {
+    char c = i % 500 < 100 ? 'a' : "abc\0"[rand() % 4];
+    string_append_n(&text, &c, 1);
+  }
+  string_append(&text, "mississippi banana");
+
+  string_index sa_index, fm_index;
+  assert(string_index_build(&sa_index, text, STRING_INDEX_SUFFIX_ARRAY));
+  assert(string_index_build(&fm_index, text, STRING_INDEX_FM));
+  assert(fm_index.text == NULL && sa_index.fm == NULL);
+  assert(string_index_memory(&fm_index) < string_index_memory(&sa_index));
+
+  // Rows are sorted suffixes, the empty one first.
+  assert(sa_index.sa[0] == text->length);
+  for (size_t r = 1; r < text->length; r++) {
+    size_t a = sa_index.sa[r], b = sa_index.sa[r + 1];
+    size_t n = text->length - (a > b ? a : b);
+    int cmp = memcmp(text->data + a, text->data + b, n);
+    assert(cmp < 0 || (cmp == 0 && a > b));
+  }
+
+  size_t *expected = malloc((text->length + 1) * sizeof(size_t));
+  size_t *positions = malloc((text->length + 1) * sizeof(size_t));
+  const char *patterns[] = {"a", "aaaa", "ab", "abca", "issi", "banana",
+                            "x", "a\0b", "", "ppi banana", "\0\0"};
+  const size_t lengths[] = {1, 4, 2, 4, 4, 6, 1, 3, 0, 10, 2};
+  for (size_t p = 0; p < sizeof(lengths) / sizeof(lengths[0]); p++) {
+    size_t count = 0;
+    for (size_t i = 0; i + lengths[p] <= text->length; i++) {
+      if (memcmp(text->data + i, patterns[p], lengths[p]) == 0) {
+        expected[count++] = i;
+      }
+    }
+
+    string_index *indexes[] = {&sa_index, &fm_index};
+    for (int k = 0; k < 2; k++) {
+      string_index *index = indexes[k];
+      assert(string_index_count(index, patterns[p], lengths[p]) == count);
+      assert(string_index_find(index, patterns[p], lengths[p]) ==
+             (count ? (ssize_t)expected[0] : -1));
+      assert(string_index_locate(index, patterns[p], lengths[p], positions,
+                                 text->length + 1) == count);
+      assert(memcmp(positions, expected, count * sizeof(size_t)) == 0);
+    }
+  }
+  assert(string_index_locate(&fm_index, "a", 1, positions, 3) > 3);
+
+  // Save and load both kinds.
+  char path[] = "/tmp/string_index_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+  string_index loaded;
+  for (int k = 0; k < 2; k++) {
+    assert(string_index_save(k ? &fm_index : &sa_index, path));
+    assert(string_index_load(&loaded, path));
+    assert(string_index_count(&loaded, "issi", 4) == 2);
+    assert(string_index_find(&loaded, "banana", 6) ==
+           (ssize_t)text->length - 6);
+    string_index_destroy(&loaded);
+  }
+
+  // Truncated or foreign files are rejected.
+  FILE *file = fopen(path, "r+");
+  fseek(file, 0, SEEK_END);
+  assert(ftruncate(fileno(file), ftell(file) - 1) == 0);
+  fclose(file);
+  assert(!string_index_load(&loaded, path));
+  file = fopen(path, "w");
+  fputs("not an index", file);
+  fclose(file);
+  assert(!string_index_load(&loaded, path));
+
+  // Corrupt FM-index files either fail to load or answer without hanging.
+  assert(string_index_save(&fm_index, path));
+  file = fopen(path, "rb");
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  char *saved = malloc(size);
+  rewind(file);
+  assert(fread(saved, 1, size, file) == (size_t)size);
+  fclose(file);
+  for (int trial = 0; trial < 200; trial++) {
+    long at = 32 + rand() % (size - 32);
+    char old = saved[at];
+    saved[at] ^= 1 << rand() % 8;
+    file = fopen(path, "wb");
+    fwrite(saved, 1, size, file);
+    fclose(file);
+    saved[at] = old;
+    if (string_index_load(&loaded, path)) {
+      string_index_find(&loaded, "a", 1);
+      string_index_locate(&loaded, "ab", 2, positions, text->length + 1);
+      string_index_destroy(&loaded);
+    }
+  }
+  free(saved);
+
+  // An empty text has only the sentinel row.
+  const string *empty = STRING_LITERAL("");
+  for (int k = 0; k < 2; k++) {
+    string_index index;
+    assert(string_index_build(&index, empty,
+                              k ? STRING_INDEX_FM : STRING_INDEX_ALL));
+    assert(string_index_count(&index, "", 0) == 1);
+    assert(string_index_count(&index, "a", 1) == 0);
+    assert(string_index_find(&index, "", 0) == 0);
+    assert(string_index_find(&index, "a", 1) == -1);
+    assert(string_index_save(&index, path));
+    string_index_destroy(&index);
+    assert(string_index_load(&index, path));
+    assert(index.length == 0);
+    assert(string_index_locate(&index, "", 0, positions, 1) == 1);
+    assert(positions[0] == 0);
+    string_index_destroy(&index);
+  }
+  remove(path);
+
+  // The classic example, over a static string.
+  string_index small;
+  const string *banana = STRING_LITERAL("banana");
+  assert(string_index_build(&small, banana, STRING_INDEX_ALL));
+  const uint32_t banana_sa[] = {6, 5, 3, 1, 0, 4, 2};
+  assert(memcmp(small.sa, banana_sa, sizeof(banana_sa)) == 0);
+  assert(string_index_count(&small, "ana", 3) == 2);
+  string_index_destroy(&small);
+
+  free(positions);
+  free(expected);
+  string_index_destroy(&fm_index);
+  string_index_destroy(&sa_index);
+  string_destroy(text);
+}
+
+static ssize_t naive_find(const char *h, size_t n, const char *p, size_t m,
+                          bool last) {
+  ssize_t found = -1;
+  for (size_t i = 0; i + m <= n; i++) {
+    if (memcmp(h + i, p, m) == 0) {
+      found = i;
+      if (!last) {
+        break;
+      }
+    }
+  }
+  return found;
+}
+
+typedef struct finder_job {
+  const string_finder *finder;
+  const string *haystack;
+  size_t count;
+} finder_job;
+
+static void *count_matches(void *arg) {
+  finder_job *job = arg;
+  for (int i = 0; i < 100; i++) {
+    job->count = string_finder_find_all(job->finder, job->haystack, NULL, 0);
+  }
+  return NULL;
+}
+
+void test_string_finder() {
+  // Needle lengths cover every algorithm; a small alphabet makes partial
+  // matches common.
+  srand(17);
+  char haystack[400], needle[80];
+  size_t positions[400];
+  for (int round = 0; round < 3000; round++) {
+    size_t n = rand() % sizeof(haystack);
+    size_t m = rand() % 5 == 0 ? rand() % sizeof(needle) : rand() % 6;
+    for (size_t i = 0; i < n; i++) {
+      haystack[i] = "ab\0"[rand() % 3];
+    }
+    for (size_t i = 0; i < m; i++) {
+      needle[i] = "ab\0"[rand() % 3];
+    }
+    // Plant the needle sometimes so long needles match too.
+    if (m <= n && rand() % 2) {
+      memcpy(haystack + rand() % (n - m + 1), needle, m);
+    }
+
+    string_finder finder;
+    string_finder_init(&finder, needle, m);
+    assert(string_finder_find_n(&finder, haystack, n) ==
+           naive_find(haystack, n, needle, m, false));
+    assert(string_finder_rfind_n(&finder, haystack, n) ==
+           (m == 0 ? (ssize_t)n : naive_find(haystack, n, needle, m, true)));
+
+    size_t count = string_finder_find_all_n(&finder, haystack, n, positions,
+                                            sizeof(positions) / sizeof(size_t));
+    size_t expected = 0;
+    for (size_t i = 0; i + m <= n;) {
+      ssize_t found = naive_find(haystack + i, n - i, needle, m, false);
+      if (found < 0) {
+        break;
+      }
+      assert(expected < count && positions[expected] == i + found);
+      expected++;
+      i += found + (m ? m : 1);
+    }
+    assert(count == expected);
+    string_finder_destroy(&finder);
+  }
+
+  string_finder finder;
+  string_finder_init(&finder, "needle", 6);
+  assert(string_finder_find(&finder, STRING_LITERAL("haystack")) == -1);
+  const string *text = STRING_LITERAL("a needle, another needle");
+  assert(string_finder_find(&finder, text) == 2);
+  assert(string_finder_rfind(&finder, text) == 18);
+
+  // One finder shared by several threads.
+  string *big = string_alloc("");
+  for (int i = 0; i < 1000; i++) {
+    string_append(&big, "hay hay needle hay ");
+  }
+  finder_job jobs[4];
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    jobs[t] = (finder_job){&finder, big, 0};
+    pthread_create(&threads[t], NULL, count_matches, &jobs[t]);
+  }
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+    assert(jobs[t].count == 1000);
+  }
+  string_destroy(big);
+  string_finder_destroy(&finder);
+}
+
+void test_string_table() {
+  const size_t count = 10000;
+  string **strings = malloc(count * sizeof(string *));
+  for (size_t i = 0; i < count; i++) {
+    char text[32];
+    int n = i == 0 ? 0 : snprintf(text, sizeof(text), "word-%zu", i * 7919);
+    strings[i] = string_alloc_n(text, n);
+  }
+  string_append_n(&strings[1], "\0binary", 7);
+
+  char path[] = "/tmp/string_table_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  for (int hashed = 0; hashed < 2; hashed++) {
+    assert(string_table_write(path, (const string **)strings, count, hashed));
+    string_table table;
+    assert(string_table_open(&table, path, true));
+    assert(table.count == count);
+    for (size_t i = 0; i < count; i++) {
+      const string *entry = string_table_get(&table, i);
+      assert(entry->length == strings[i]->length);
+      assert(memcmp(entry->data, strings[i]->data, entry->length + 1) == 0);
+    }
+    assert(string_table_get(&table, count) == NULL);
+
+    // Entries are static strings usable with the rest of the API.
+    const string *entry = string_table_get(&table, 5);
+    assert(string_share(entry) == entry);
+    assert(string_find(entry, "-") == 4);
+    string_destroy((string *)entry);
+
+    ssize_t expected = hashed ? 1234 : -1;
+    assert(string_table_find(&table, strings[1234]->data,
+                             strings[1234]->length) == expected);
+    assert(string_table_find(&table, strings[1]->data, strings[1]->length) ==
+           (hashed ? 1 : -1));
+    assert(string_table_find(&table, "", 0) == (hashed ? 0 : -1));
+    assert(string_table_find(&table, "missing", 7) == -1);
+    string_table_close(&table);
+  }
+
+  // A flipped byte fails verification but not the structural checks.
+  FILE *file = fopen(path, "r+");
+  fseek(file, -20, SEEK_END);
+  int c = fgetc(file);
+  fseek(file, -20, SEEK_END);
+  fputc(c ^ 1, file);
+  fclose(file);
+  string_table table;
+  assert(!string_table_open(&table, path, true));
+  assert(table.map == NULL);
+  assert(string_table_open(&table, path, false));
+  string_table_close(&table);
+
+  // Without verification, corrupt offsets and buckets are caught on access.
+  srand(41);
+  for (int trial = 0; trial < 500; trial++) {
+    assert(string_table_write(path, (const string **)strings, 50, true));
+    file = fopen(path, "r+");
+    fseek(file, 0, SEEK_END);
+    long words = ftell(file) / 8;
+    long at = 9 + rand() % (words - 9); // Past the 72-byte header.
+    uint64_t value = trial % 2 ? (uint64_t)rand() % 64 : (uint64_t)rand() << 3;
+    fseek(file, at * 8, SEEK_SET);
+    fwrite(&value, sizeof(value), 1, file);
+    fclose(file);
+    if (trial == 0) {
+      // A bucket array with no empty bucket.
+      file = fopen(path, "r+");
+      fseek(file, -128 * 8, SEEK_END);
+      for (int b = 0; b < 128; b++) {
+        fwrite(&(uint64_t){1}, sizeof(uint64_t), 1, file);
+      }
+      fclose(file);
+    }
+    assert(string_table_open(&table, path, false));
+    for (size_t i = 0; i < table.count; i++) {
+      const string *entry = string_table_get(&table, i);
+      assert(!entry || entry->data[entry->length] == '\0');
+    }
+    string_table_find(&table, strings[7]->data, strings[7]->length);
+    string_table_find(&table, "missing", 7);
+    string_table_close(&table);
+  }
+
+  // An entry header ending exactly at the end of the entries section.
+  const string *single[] = {strings[0]};
+  assert(string_table_write(path, single, 1, false));
+  file = fopen(path, "r+");
+  fseek(file, 0, SEEK_END);
+  uint64_t offset = ftell(file) - sizeof(string);
+  uint64_t huge = (uint64_t)1 << 40;
+  fseek(file, sizeof(uint64_t) * 9, SEEK_SET); // offsets[0]
+  fwrite(&offset, sizeof(offset), 1, file);
+  fseek(file, offset, SEEK_SET); // The entry's length.
+  fwrite(&huge, sizeof(huge), 1, file);
+  fclose(file);
+  assert(string_table_open(&table, path, false));
+  assert(string_table_get(&table, 0) == NULL);
+  string_table_close(&table);
+
+  // Truncated and foreign files are rejected without verification.
+  assert(truncate(path, 4096) == 0);
+  assert(!string_table_open(&table, path, false));
+  file = fopen(path, "w");
+  fputs("not a table", file);
+  fclose(file);
+  assert(!string_table_open(&table, path, false));
+  remove(path);
+
+  substring_free(strings, count);
+}
+
+void test_string_fifo() {
+  string_fifo fifo;
+  string_fifo_init(&fifo, 8);
+  assert(string_fifo_length(&fifo) == 0);
+  assert(strcmp(string_fifo_data(&fifo), "") == 0);
+
+  string_fifo_append(&fifo, "HEAD 1\r\nbody\r\n");
+  ssize_t end = string_fifo_find_n(&fifo, "\r\n", 2);
+  assert(end == 6);
+  string *line = string_fifo_take(&fifo, end);
+  assert(strcmp(line->data, "HEAD 1") == 0);
+  string_destroy(line);
+  string_fifo_consume(&fifo, 2);
+  assert(strcmp(string_fifo_data(&fifo), "body\r\n") == 0);
+  assert(fifo.head == 8);
+
+  // Appending into a full buffer reuses the consumed prefix first.
+  size_t capacity = fifo.buffer->capacity;
+  size_t room = capacity - fifo.buffer->length - 1;
+  char fill[64] = {0};
+  assert(room + 1 <= sizeof(fill));
+  string_fifo_append_n(&fifo, fill, room + 1);
+  assert(string_fifo_length(&fifo) == 6 + room + 1);
+  assert(memcmp(string_fifo_data(&fifo), "body\r\n\0", 7) == 0);
+  assert(fifo.buffer->capacity == capacity);
+  assert(fifo.head == 0);
+
+  string_fifo_consume(&fifo, 100);
+  assert(string_fifo_length(&fifo) == 0);
+  assert(fifo.head == 0);
+
+  string_fifo_append(&fifo, " \t\n data ");
+  assert(string_fifo_ltrim(&fifo) == 4);
+  assert(string_fifo_ltrim(&fifo) == 0);
+  assert(strcmp(string_fifo_data(&fifo), "data ") == 0);
+  assert(string_fifo_find_n(&fifo, "missing", 7) == -1);
+
+  string *rest = string_fifo_release(&fifo);
+  assert(fifo.buffer == NULL);
+  assert(strcmp(rest->data, "data ") == 0);
+  assert(rest->length == 5);
+  string_destroy(rest);
+
+  // A queue fed and drained in small steps stays small and ordered.
+  string_fifo_init_from(&fifo, string_alloc(""));
+  size_t produced = 0, consumed = 0;
+  for (size_t round = 0; round < 100000; round++) {
+    char record[16];
+    int n = snprintf(record, sizeof(record), "%09zu\n", produced++);
+    string_fifo_append_n(&fifo, record, n);
+    if (round % 3 != 2) {
+      snprintf(record, sizeof(record), "%09zu\n", consumed++);
+      assert(memcmp(string_fifo_data(&fifo), record, 10) == 0);
+      string_fifo_consume(&fifo, 10);
+    }
+    assert(fifo.buffer->data[fifo.buffer->length] == '\0');
+  }
+  assert(string_fifo_length(&fifo) == (produced - consumed) * 10);
+  string_fifo_destroy(&fifo);
+  string_fifo_destroy(&fifo);
+
+  // Shared and static strings are copied rather than consumed in place.
+  string *shared = string_alloc("abc");
+  string_fifo_init_from(&fifo, string_share(shared));
+  string_fifo_consume(&fifo, 1);
+  string_fifo_append(&fifo, "d");
+  assert(strcmp(shared->data, "abc") == 0);
+  assert(strcmp(string_fifo_data(&fifo), "bcd") == 0);
+  string_fifo_destroy(&fifo);
+  string_destroy(shared);
+
+  const string *literal = STRING_LITERAL("xyz");
+  string_fifo_init_from(&fifo, string_share(literal));
+  string_fifo_consume(&fifo, 2);
+  assert(strcmp(string_fifo_data(&fifo), "z") == 0);
+  string_fifo_destroy(&fifo);
+}
+
+static bool pipeline_collect_sink(const char *data, size_t length,
+                                  void *user_data) {
+  string_append_n((string **)user_data, data, length);
+  return true;
+}
+
+static bool pipeline_stop_sink(const char *data, size_t length,
+                               void *user_data) {
+  (void)data;
+  (void)length;
+  return ++*(int *)user_data < 3;
+}
+
+// Drop lines containing "skip" and tag the rest.
+static bool pipeline_tag(string **line, void *user_data) {
+  if (string_contains(*line, "skip")) {
+    return false;
+  }
+  string_append(line, (const char *)user_data);
+  return true;
+}
+
+// Sort the lines of a pipeline output so unordered runs can be compared.
+static string *pipeline_sorted(const string *output) {
+  size_t count = 0;
+  string **lines = string_split(output, '\n', &count);
+  string_sort(lines, count);
+  const string *newline = STRING_LITERAL("\n");
+  string *joined = string_join_str((const string **)lines, count, newline);
+  substring_free(lines, count);
+  return joined;
+}
+
+void test_string_pipeline() {
+  const char *words[] = {" alpha ", "beta", "Gamma", "skip me", "delta"};
+  string *input = string_alloc("");
+  for (size_t i = 0; i < 5000; i++) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%s %zu%s", words[i % 5], i,
+                     i % 7 == 0 ? "\r\n" : "\n");
+    string_append_n(&input, line, n);
+  }
+  string_append(&input, "delta tail"); // No final newline.
+
+  // The same chain applied one line at a time.
+  string *expected = string_alloc("");
+  size_t count = 0, kept = 0;
+  string **lines = string_split(input, '\n', &count);
+  for (size_t i = 0; i < count; i++) {
+    string_trim(&lines[i]);
+    if (string_match(lines[i], "^(alpha|gamma|delta) [0-9]*[02468]$")) {
+      continue;
+    }
+    string_tolower(&lines[i]);
+    if (!string_match(lines[i], "[a-z]+ [0-9]+") ||
+        string_contains(lines[i], "skip")) {
+      continue;
+    }
+    string_replace_all(&lines[i], "a", "AA");
+    string_append(&lines[i], "!");
+    string_append_n(&expected, lines[i]->data, lines[i]->length);
+    string_append(&expected, "\n");
+    kept++;
+  }
+  substring_free(lines, count);
+
+  string_pipeline pipeline;
+  string_pipeline_init(&pipeline);
+  assert(!string_pipeline_filter(&pipeline, "([unclosed", false));
+  string_pipeline_trim(&pipeline);
+  assert(string_pipeline_filter(&pipeline,
+                                "^(alpha|gamma|delta) [0-9]*[02468]$", true));
+  string_pipeline_tolower(&pipeline);
+  assert(string_pipeline_filter(&pipeline, "[a-z]+ [0-9]+", false));
+  string_pipeline_map(&pipeline, pipeline_tag, "");
+  string_pipeline_replace_all(&pipeline, "a", "AA");
+  string_pipeline_map(&pipeline, pipeline_tag, "!");
+  assert(pipeline.num_ops == 7);
+
+  string *sorted_expected = pipeline_sorted(expected);
+  for (size_t threads = 1; threads <= 4; threads += 3) {
+    for (int ordered = 0; ordered < 2; ordered++) {
+      pipeline.threads = threads;
+      pipeline.ordered = ordered;
+      pipeline.chunk_size = 1000;
+      pipeline.max_in_flight = 2;
+
+      string *output = string_alloc("");
+      assert(string_pipeline_run(&pipeline, input->data, input->length,
+                                 pipeline_collect_sink, &output));
+      assert(pipeline.lines_read == 5001);
+      assert(pipeline.lines_written == kept);
+      if (ordered) {
+        assert(output->length == expected->length);
+        assert(memcmp(output->data, expected->data, output->length) == 0);
+      } else {
+        string *sorted = pipeline_sorted(output);
+        assert(strcmp(sorted->data, sorted_expected->data) == 0);
+        string_destroy(sorted);
+      }
+      string_destroy(output);
+    }
+  }
+
+  // A sink returning false stops the run early.
+  int calls = 0;
+  assert(!string_pipeline_run(&pipeline, input->data, input->length,
+                              pipeline_stop_sink, &calls));
+  assert(calls == 3);
+
+  // Files are mapped and processed the same way; empty input yields nothing.
+  char path[] = "/tmp/string_pipeline_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(write(fd, input->data, input->length) == (ssize_t)input->length);
+  close(fd);
+  pipeline.ordered = true;
+  string *output = string_alloc("");
+  assert(string_pipeline_run_file(&pipeline, path, pipeline_collect_sink,
+                                  &output));
+  assert(strcmp(output->data, expected->data) == 0);
+  assert(truncate(path, 0) == 0);
+  string_clear(&output);
+  assert(string_pipeline_run_file(&pipeline, path, pipeline_collect_sink,
+                                  &output));
+  assert(output->length == 0 && pipeline.lines_read == 0);
+  remove(path);
+  assert(!string_pipeline_run_file(&pipeline, path, pipeline_collect_sink,
+                                   &output));
+  string_destroy(output);
+
+  string_pipeline_destroy(&pipeline);
+  string_destroy(sorted_expected);
+  string_destroy(expected);
+  string_destroy(input);
+}
+
 int main() {
   test_string_init();
   test_str_concat();
@@ -310,5 +1897,23 @@ int main() {
   test_str_endswith();
   test_regex_sub_match();
   test_string_trimspace();
+  test_string_pool();
+  test_string_share();
+  test_string_literal();
+  test_string_binary_safe();
+  test_string_builder();
+  test_string_convert_case();
+  test_string_edit_distance();
+  test_string_sort();
+  test_string_csv();
+  test_string_escape();
+  test_string_base64_hex();
+  test_string_write_all();
+  test_string_cold();
+  test_string_index();
+  test_string_finder();
+  test_string_table();
+  test_string_fifo();
+  test_string_pipeline();
   return 0;
 }